@@ -0,0 +1,205 @@
+#!/usr/bin/env python
+#
+# Script which measures how fast each fuzzer replays its seed corpus, and
+# compares the results against a saved baseline.
+
+import argparse
+import json
+import logging
+import os
+import subprocess
+import sys
+import tempfile
+log = logging.getLogger(__name__)
+
+
+def run_round(binary, files):
+    """
+    Replay a corpus once through a fuzzer. Returns the timing report written
+    by the standalone engine, along with the peak RSS of the process in KB.
+    """
+    fd, report_path = tempfile.mkstemp(suffix=".json")
+    os.close(fd)
+
+    try:
+        with open(os.devnull, "wb") as devnull:
+            proc = subprocess.Popen([binary, "-k", "0", "-o", report_path] +
+                                    files,
+                                    stdout=devnull,
+                                    stderr=devnull)
+            _, status, rusage = os.wait4(proc.pid, 0)
+            proc.returncode = status
+
+        if status != 0:
+            raise ScriptException("{0} exited with status {1}"
+                                  .format(binary, status))
+
+        with open(report_path, "r") as f:
+            report = json.load(f)
+    finally:
+        os.unlink(report_path)
+
+    return report, rusage.ru_maxrss
+
+
+def median(values):
+    values = sorted(values)
+    return values[len(values) // 2]
+
+
+def bench_target(options, target):
+    """
+    Replay a target's corpus for the configured number of rounds and
+    summarise the results.
+    """
+    binary = os.path.join(options.build_root, target)
+    corpus_dir = os.path.join(options.build_root, "corpora", target)
+    files = sorted(os.path.join(corpus_dir, name)
+                   for name in os.listdir(corpus_dir))
+
+    inputs = 0
+    seconds = 0.0
+    rounds = []
+    max_rss_kb = 0
+
+    for _ in range(options.rounds):
+        report, rss_kb = run_round(binary, files)
+        inputs += report["inputs"]
+        seconds += report["wall_seconds"]
+        rounds.append(report["latency_us"])
+        max_rss_kb = max(max_rss_kb, rss_kb)
+
+    # Percentiles are taken from the median round, so one noisy round
+    # doesn't decide the result.
+    return {
+        "exec_per_second": inputs / seconds if seconds > 0 else 0.0,
+        "mean_us": median([r["mean"] for r in rounds]),
+        "p50_us": median([r["p50"] for r in rounds]),
+        "p99_us": median([r["p99"] for r in rounds]),
+        "max_rss_kb": max_rss_kb,
+    }
+
+
+def find_regressions(options, target, result, baseline):
+    """
+    Compare a target's results with its baseline. Returns a list of
+    descriptions of anything which got worse by more than the threshold.
+    """
+    regressions = []
+    if target not in baseline:
+        return regressions
+
+    base = baseline[target]
+    limit = options.threshold / 100.0
+
+    if result["exec_per_second"] < base["exec_per_second"] * (1 - limit):
+        regressions.append("exec/s {0:.1f} -> {1:.1f}"
+                           .format(base["exec_per_second"],
+                                   result["exec_per_second"]))
+
+    if result["max_rss_kb"] > base["max_rss_kb"] * (1 + limit):
+        regressions.append("peak RSS {0}KB -> {1}KB"
+                           .format(base["max_rss_kb"], result["max_rss_kb"]))
+
+    return regressions
+
+
+def bench(options):
+    baseline = {}
+    if os.path.exists(options.baseline):
+        with open(options.baseline, "r") as f:
+            baseline = json.load(f)
+
+    results = {}
+    failed = []
+
+    log.info("%-20s %10s %10s %10s %10s %10s",
+             "target", "exec/s", "mean us", "p50 us", "p99 us", "RSS KB")
+
+    for target in options.targets:
+        result = bench_target(options, target)
+        results[target] = result
+
+        log.info("%-20s %10.1f %10.1f %10.1f %10.1f %10d",
+                 target,
+                 result["exec_per_second"],
+                 result["mean_us"],
+                 result["p50_us"],
+                 result["p99_us"],
+                 result["max_rss_kb"])
+
+        for regression in find_regressions(options, target, result,
+                                           baseline):
+            log.error("%s regressed: %s", target, regression)
+            failed.append(target)
+
+    if options.save_baseline:
+        baseline.update(results)
+        with open(options.baseline, "w") as f:
+            json.dump(baseline, f, indent=2, sort_keys=True)
+        log.info("Saved baseline to %s", options.baseline)
+
+    if failed and not options.save_baseline:
+        log.error("%d targets regressed by more than %.1f%%",
+                  len(set(failed)), options.threshold)
+        return ScriptRC.FAILURE
+
+    return ScriptRC.SUCCESS
+
+
+def get_options():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--build_root", required=True)
+    parser.add_argument("--targets", nargs="+", required=True)
+    parser.add_argument("--rounds", type=int, default=5)
+    parser.add_argument("--baseline", required=True)
+    parser.add_argument("--save_baseline", action="store_true")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="Percentage slowdown or RSS growth which "
+                             "counts as a regression")
+    return parser.parse_args()
+
+
+def setup_logging():
+    """
+    Set up logging from the command line options
+    """
+    root_logger = logging.getLogger()
+    formatter = logging.Formatter("%(asctime)s %(levelname)-5.5s %(message)s")
+    stdout_handler = logging.StreamHandler(sys.stdout)
+    stdout_handler.setFormatter(formatter)
+    stdout_handler.setLevel(logging.DEBUG)
+    root_logger.addHandler(stdout_handler)
+    root_logger.setLevel(logging.DEBUG)
+
+
+class ScriptRC(object):
+    """Enum for script return codes"""
+    SUCCESS = 0
+    FAILURE = 1
+    EXCEPTION = 2
+
+
+class ScriptException(Exception):
+    pass
+
+
+def main():
+    # Get the options from the user.
+    options = get_options()
+
+    setup_logging()
+
+    # Run main script.
+    try:
+        rc = bench(options)
+    except Exception as e:
+        log.exception(e)
+        rc = ScriptRC.EXCEPTION
+
+    log.info("Returning %d", rc)
+    return rc
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -1,97 +1,57 @@
 #!/usr/bin/env python
 #
 # Common corpus functions
+import codecs
 import logging
+import os
+import re
 import struct
 log = logging.getLogger(__name__)
 
 
+# The TLV schema shared with the fuzzer. Each entry is
+# FUZZ_TLV(NAME, TYPE, KIND, CURLOPT, PROTOCOLS, CONNECTION, RESPONSE, PYNAME,
+#          "DESC").
+TLV_SCHEMA_FILE = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                               "curl_fuzzer_tlv.def")
+TLV_SCHEMA_RE = re.compile(r'^FUZZ_TLV\(\s*(\w+),\s*(\d+),\s*(\w+),\s*(\w+),'
+                           r'\s*(\w+),\s*(\d+),\s*(\d+),\s*(\w+),'
+                           r'\s*"([^"]*)"\)',
+                           re.MULTILINE)
+
+
+class TLVSchemaEntry(object):
+    def __init__(self, match):
+        self.name = match.group(1)
+        self.type = int(match.group(2))
+        self.kind = match.group(3)
+        self.option = match.group(4)
+        self.protocols = match.group(5)
+        self.connection = int(match.group(6))
+        self.response = int(match.group(7))
+        self.pyname = match.group(8)
+        self.description = match.group(9)
+
+
+def load_tlv_schema(path=TLV_SCHEMA_FILE):
+    with open(path, "r") as f:
+        return [TLVSchemaEntry(m) for m in TLV_SCHEMA_RE.finditer(f.read())]
+
+
+TLV_SCHEMA = load_tlv_schema()
+
+
 class BaseType(object):
-    TYPE_URL = 1
-    TYPE_RSP0 = 2
-    TYPE_USERNAME = 3
-    TYPE_PASSWORD = 4
-    TYPE_POSTFIELDS = 5
-    TYPE_HEADER = 6
-    TYPE_COOKIE = 7
-    TYPE_UPLOAD1 = 8
-    TYPE_RANGE = 9
-    TYPE_CUSTOMREQUEST = 10
-    TYPE_MAIL_RECIPIENT = 11
-    TYPE_MAIL_FROM = 12
-    TYPE_MIME_PART = 13
-    TYPE_MIME_PART_NAME = 14
-    TYPE_MIME_PART_DATA = 15
-    TYPE_HTTPAUTH = 16
-    TYPE_RSP1 = 17
-    TYPE_RSP2 = 18
-    TYPE_RSP3 = 19
-    TYPE_RSP4 = 20
-    TYPE_RSP5 = 21
-    TYPE_RSP6 = 22
-    TYPE_RSP7 = 23
-    TYPE_RSP8 = 24
-    TYPE_RSP9 = 25
-    TYPE_RSP10 = 26
-    TYPE_OPTHEADER = 27
-    TYPE_NOBODY = 28
-    TYPE_FOLLOWLOCATION = 29
-    TYPE_ACCEPT_ENCODING = 30
-    TYPE_SECRSP0 = 31
-    TYPE_SECRSP1 = 32
-    TYPE_WILDCARDMATCH = 33
-    TYPE_RTSP_REQUEST = 34
-    TYPE_RTSP_SESSION_ID = 35
-    TYPE_RTSP_STREAM_URI = 36
-    TYPE_RTSP_TRANSPORT = 37
-    TYPE_RTSP_CLIENT_CSEQ = 38
-    TYPE_MAIL_AUTH = 39
-    TYPE_HTTP_VERSION = 40
-    TYPE_DOH_URL = 41
-
-    TYPEMAP = {
-        TYPE_URL: "CURLOPT_URL",
-        TYPE_RSP0: "Server banner (sent on connection)",
-        TYPE_RSP1: "Server response 1",
-        TYPE_RSP2: "Server response 2",
-        TYPE_RSP3: "Server response 3",
-        TYPE_RSP4: "Server response 4",
-        TYPE_RSP5: "Server response 5",
-        TYPE_RSP6: "Server response 6",
-        TYPE_RSP7: "Server response 7",
-        TYPE_RSP8: "Server response 8",
-        TYPE_RSP9: "Server response 9",
-        TYPE_RSP10: "Server response 10",
-        TYPE_SECRSP0: "Socket 2: Server banner (sent on connection)",
-        TYPE_SECRSP1: "Socket 2: Server response 1",
-        TYPE_USERNAME: "CURLOPT_USERNAME",
-        TYPE_PASSWORD: "CURLOPT_PASSWORD",
-        TYPE_POSTFIELDS: "CURLOPT_POSTFIELDS",
-        TYPE_HEADER: "CURLOPT_HEADER",
-        TYPE_COOKIE: "CURLOPT_COOKIE",
-        TYPE_UPLOAD1: "CURLOPT_UPLOAD / CURLOPT_INFILESIZE_LARGE",
-        TYPE_RANGE: "CURLOPT_RANGE",
-        TYPE_CUSTOMREQUEST: "CURLOPT_CUSTOMREQUEST",
-        TYPE_MAIL_RECIPIENT: "curl_slist_append(mail recipient)",
-        TYPE_MAIL_FROM: "CURLOPT_MAIL_FROM",
-        TYPE_MIME_PART: "curl_mime_addpart",
-        TYPE_MIME_PART_NAME: "curl_mime_name",
-        TYPE_MIME_PART_DATA: "curl_mime_data",
-        TYPE_HTTPAUTH: "CURLOPT_HTTPAUTH",
-        TYPE_OPTHEADER: "CURLOPT_HEADER",
-        TYPE_NOBODY: "CURLOPT_NOBODY",
-        TYPE_FOLLOWLOCATION: "CURLOPT_FOLLOWLOCATION",
-        TYPE_ACCEPT_ENCODING: "CURLOPT_ACCEPT_ENCODING",
-        TYPE_WILDCARDMATCH: "CURLOPT_WILDCARDMATCH",
-        TYPE_RTSP_REQUEST: "CURLOPT_RTSP_REQUEST",
-        TYPE_RTSP_SESSION_ID: "CURLOPT_RTSP_SESSION_ID",
-        TYPE_RTSP_STREAM_URI: "CURLOPT_RTSP_STREAM_URI",
-        TYPE_RTSP_TRANSPORT: "CURLOPT_RTSP_TRANSPORT",
-        TYPE_RTSP_CLIENT_CSEQ: "CURLOPT_RTSP_CLIENT_CSEQ",
-        TYPE_MAIL_AUTH: "CURLOPT_MAIL_AUTH",
-        TYPE_HTTP_VERSION: "CURLOPT_HTTP_VERSION",
-        TYPE_DOH_URL: "CURLOPT_DOH_URL",
-    }
+    TRIGGER_DELIMITER = 0
+    TRIGGER_BYTE_COUNT = 1
+
+    TYPEMAP = dict((entry.type, entry.description) for entry in TLV_SCHEMA)
+
+
+# Add a TYPE_<PYNAME> constant for each TLV type in the schema.
+for _entry in TLV_SCHEMA:
+    setattr(BaseType, "TYPE_" + _entry.pyname, _entry.type)
+del _entry
 
 
 class TLVEncoder(BaseType):
@@ -129,6 +89,33 @@ class TLVEncoder(BaseType):
             wstring = self.test_data.get_test_data(rsp_test)
             self.write_bytes(rsp_type, wstring.encode("utf-8"))
 
+    def write_connection_response(self, connrsp, from_file=False):
+        (conn, index, value) = connrsp.split(":", 2)
+        if from_file:
+            with open(value, "rb") as g:
+                data = g.read()
+        else:
+            data = value.encode("utf-8")
+
+        # The connection and response numbers are a byte each, followed by
+        # the response data.
+        data = struct.pack("!BB", int(conn), int(index)) + data
+        self.write_bytes(self.TYPE_CONNRSP, data)
+
+    def write_response_trigger(self, trigger, byte_count=False):
+        (conn, index, value) = trigger.split(":", 2)
+        if byte_count:
+            data = struct.pack("!BBBL", int(conn), int(index),
+                               self.TRIGGER_BYTE_COUNT, int(value))
+        else:
+            # Allow escapes such as \r\n in delimiters.
+            delimiter = codecs.decode(value, "unicode_escape")
+            data = struct.pack("!BBB", int(conn), int(index),
+                               self.TRIGGER_DELIMITER)
+            data = data + delimiter.encode("latin-1")
+
+        self.write_bytes(self.TYPE_RSP_TRIGGER, data)
+
     def write_mimepart(self, namevalue):
         (name, value) = namevalue.split(":", 1)
 
@@ -20,13 +20,143 @@
  *
  ***************************************************************************/
 
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <curl/curl.h>
 #include "curl_fuzzer.h"
 
+/* Handles kept between fuzzing runs when recycling is enabled. Engines may
+   call LLVMFuzzerTestOneInput from several threads, so each has its own. */
+static thread_local FUZZ_HANDLE_POOL handle_pool;
+static FUZZ_POOL_STATS pool_stats;
+
+/* Key whose destructor cleans up a thread's pooled handles when it exits. */
+static pthread_key_t handle_pool_key;
+static pthread_once_t pool_report_once = PTHREAD_ONCE_INIT;
+
+/* Process-wide setup, done once whichever thread gets there first. */
+static pthread_once_t global_setup_once = PTHREAD_ONCE_INIT;
+
+/* Settings from the environment, filled in by the process-wide setup. */
+static FUZZ_CONFIG fuzz_config;
+
+/* CURLOPT_CONNECT_TO list forcing resolution of all addresses to a specific
+   IP address. libcurl only reads it, so one list serves every run. */
+static char connect_to_string[] = "::127.0.1.127:";
+static struct curl_slist connect_to_list = { connect_to_string, NULL };
+
+/* URL schemes and the protocols they select. */
+static const FUZZ_URL_SCHEME url_schemes[] = {
+  {"dict", CURLPROTO_DICT},
+  {"file", CURLPROTO_FILE},
+  {"ftp", CURLPROTO_FTP},
+  {"ftps", CURLPROTO_FTPS},
+  {"gopher", CURLPROTO_GOPHER},
+  {"http", CURLPROTO_HTTP},
+  {"https", CURLPROTO_HTTPS},
+  {"imap", CURLPROTO_IMAP},
+  {"imaps", CURLPROTO_IMAPS},
+  {"ldap", CURLPROTO_LDAP},
+  {"ldaps", CURLPROTO_LDAPS},
+  {"pop3", CURLPROTO_POP3},
+  {"pop3s", CURLPROTO_POP3S},
+  {"rtmp", CURLPROTO_RTMP},
+  {"rtmpe", CURLPROTO_RTMPE},
+  {"rtmps", CURLPROTO_RTMPS},
+  {"rtmpt", CURLPROTO_RTMPT},
+  {"rtmpte", CURLPROTO_RTMPTE},
+  {"rtmpts", CURLPROTO_RTMPTS},
+  {"rtsp", CURLPROTO_RTSP},
+  {"scp", CURLPROTO_SCP},
+  {"sftp", CURLPROTO_SFTP},
+  {"smb", CURLPROTO_SMB},
+  {"smbs", CURLPROTO_SMBS},
+  {"smtp", CURLPROTO_SMTP},
+  {"smtps", CURLPROTO_SMTPS},
+  {"telnet", CURLPROTO_TELNET},
+  {"tftp", CURLPROTO_TFTP},
+  {NULL, 0}
+};
+
+/**
+ * Reads the settings from the environment into fuzz_config.
+ */
+static void fuzz_read_config(void)
+{
+  const char *fuzz_str;
+
+  /* Check for verbose mode. */
+  fuzz_config.verbose = (getenv("FUZZ_VERBOSE") != NULL);
+
+  /* Check which transfer engine to use. */
+  fuzz_str = getenv("FUZZ_TRANSFER_ENGINE");
+  if(fuzz_str != NULL && strcmp(fuzz_str, "select") == 0) {
+    fuzz_config.engine = FUZZ_ENGINE_SELECT;
+  }
+  else {
+    fuzz_config.engine = FUZZ_ENGINE_SOCKET;
+  }
+
+  /* Check which transport to use. The select engine needs real file
+     descriptors for the server side, so always uses socket pairs. */
+  fuzz_str = getenv("FUZZ_TRANSPORT");
+  if((fuzz_str != NULL && strcmp(fuzz_str, "socketpair") == 0) ||
+     fuzz_config.engine == FUZZ_ENGINE_SELECT) {
+    fuzz_config.transport = FUZZ_TRANSPORT_SOCKETPAIR;
+  }
+  else {
+    fuzz_config.transport = FUZZ_TRANSPORT_MEMORY;
+  }
+
+  /* Check for virtual time mode. */
+  fuzz_config.virtual_time = (getenv("FUZZ_VIRTUAL_TIME") != NULL);
+
+  /* Check for handle recycling. FUZZ_RECYCLE_HANDLES gives the number of runs
+     between full teardowns of the handles; 1 means no recycling at all. */
+  fuzz_str = getenv("FUZZ_RECYCLE_HANDLES");
+  if(fuzz_str != NULL) {
+    fuzz_config.recycle_interval = FUZZ_MAX(strtol(fuzz_str, NULL, 10), 1);
+  }
+}
+
+/**
+ * Process-wide setup shared by every fuzzing run.
+ */
+static void fuzz_global_setup(void)
+{
+  /* Ignore SIGPIPE errors. We'll handle the errors ourselves. */
+  signal(SIGPIPE, SIG_IGN);
+
+  fuzz_read_config();
+
+  FUZZ_PROFILE_INIT();
+
+  pthread_key_create(&handle_pool_key, fuzz_pool_thread_exit);
+
+  fuzz_arena_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+/**
+ * One-off initialisation before the first test case. libcurl's global state,
+ * including the TLS library, is set up here so that a forking engine only
+ * pays for it once.
+ */
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+  (void)argc;
+  (void)argv;
+
+  pthread_once(&global_setup_once, fuzz_global_setup);
+
+  return 0;
+}
+
 /**
  * Fuzzing entry point. This function is passed a buffer containing a test
  * case.  This test case should drive the CURL API into making a request.
@@ -38,39 +168,46 @@ extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
   FUZZ_DATA fuzz;
   TLV tlv;
 
-  /* Ignore SIGPIPE errors. We'll handle the errors ourselves. */
-  signal(SIGPIPE, SIG_IGN);
+  /* Engines which don't call LLVMFuzzerInitialize get the setup here. */
+  pthread_once(&global_setup_once, fuzz_global_setup);
 
   /* Have to set all fields to zero before getting to the terminate function */
   memset(&fuzz, 0, sizeof(FUZZ_DATA));
 
+  FUZZ_PROFILE_BEGIN_RUN();
+  FUZZ_PROFILE_PHASE(FUZZ_PHASE_PARSE);
+
   if(size < sizeof(TLV_RAW)) {
     /* Not enough data for a single TLV - don't continue */
     goto EXIT_LABEL;
   }
 
+  /* Check the whole input before creating anything, and throw it away if
+     it's no good. */
+  if(fuzz_validate_input(data, size) != FUZZ_REJECT_NONE) {
+    FUZZ_PROFILE_END_RUN();
+    return -1;
+  }
+
   /* Try to initialize the fuzz data */
   FTRY(fuzz_initialize_fuzz_data(&fuzz, data, size));
 
-  for(tlv_rc = fuzz_get_first_tlv(&fuzz, &tlv);
+  for(tlv_rc = fuzz_get_first_tlv(&fuzz.state, &tlv);
       tlv_rc == 0;
-      tlv_rc = fuzz_get_next_tlv(&fuzz, &tlv)) {
+      tlv_rc = fuzz_get_next_tlv(&fuzz.state, &tlv)) {
 
-    /* Have the TLV in hand. Parse the TLV. */
+    /* Have the TLV in hand. Apply it to the easy handle. */
     rc = fuzz_parse_tlv(&fuzz, &tlv);
 
     if(rc != 0) {
-      /* Failed to parse the TLV. Can't continue. */
+      /* libcurl wouldn't accept an option. Can't continue. */
+      fuzz_count_setup_failure();
       goto EXIT_LABEL;
     }
   }
 
-  if(tlv_rc != TLV_RC_NO_MORE_TLVS) {
-    /* A TLV call failed. Can't continue. */
-    goto EXIT_LABEL;
-  }
-
   /* Set up the standard easy options. */
+  FUZZ_PROFILE_PHASE(FUZZ_PHASE_SETOPT);
   FTRY(fuzz_set_easy_options(&fuzz));
 
   /**
@@ -90,13 +227,18 @@ extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
   }
 
   /* Run the transfer. */
+  FUZZ_PROFILE_PHASE(FUZZ_PHASE_TRANSFER);
   fuzz_handle_transfer(&fuzz);
+  FUZZ_PROFILE_CURL_TIMES(fuzz.easy);
 
 EXIT_LABEL:
 
+  FUZZ_PROFILE_PHASE(FUZZ_PHASE_TEARDOWN);
   fuzz_terminate_fuzz_data(&fuzz);
+  FUZZ_PROFILE_END_RUN();
 
-  /* This function must always return 0. Non-zero codes are reserved. */
+  /* Apart from rejected inputs, which return -1 so that libFuzzer keeps
+     them out of the corpus, this function must always return 0. */
   return 0;
 }
 
@@ -133,23 +275,46 @@ int fuzz_initialize_fuzz_data(FUZZ_DATA *fuzz,
   /* Initialize the fuzz data. */
   memset(fuzz, 0, sizeof(FUZZ_DATA));
 
-  /* Create an easy handle. This will have all of the settings configured on
-     it. */
-  fuzz->easy = curl_easy_init();
-  FCHECK(fuzz->easy != NULL);
-
   /* Set up the state parser */
   fuzz->state.data = data;
   fuzz->state.data_len = data_len;
 
   /* Set up the state of the server sockets. */
-  for(ii = 0; ii < FUZZ_NUM_CONNECTIONS; ii++) {
+  for(ii = 0; ii < FUZZ_MAX_CONNECTIONS; ii++) {
     fuzz->sockman[ii].index = ii;
     fuzz->sockman[ii].fd_state = FUZZ_SOCK_CLOSED;
   }
 
-  /* Check for verbose mode. */
-  fuzz->verbose = (getenv("FUZZ_VERBOSE") != NULL);
+  /* No sockets are being watched by the socket engine yet. */
+  for(ii = 0; ii < FUZZ_MAX_CURL_SOCKETS; ii++) {
+    fuzz->curl_sockets[ii].fd = CURL_SOCKET_BAD;
+  }
+  fuzz->curl_timeout_ms = -1;
+
+  /* Copy in the settings from the environment. */
+  fuzz->verbose = fuzz_config.verbose;
+  fuzz->state.verbose = fuzz->verbose;
+  fuzz->engine = fuzz_config.engine;
+  fuzz->transport = fuzz_config.transport;
+  fuzz->virtual_time = fuzz_config.virtual_time;
+  fuzz_vclock_set_active(fuzz->virtual_time);
+
+  fuzz->recycle_interval = fuzz_config.recycle_interval;
+  if(fuzz->recycle_interval > 0) {
+    /* Not CLOCK_MONOTONIC, which virtual time moves forward. */
+    clock_gettime(CLOCK_BOOTTIME, &fuzz->start_time);
+  }
+
+  /* Recycled handles outlive the run, so their allocations can't come from
+     the arena. */
+  if(fuzz->recycle_interval == 0) {
+    fuzz_arena_begin_run();
+  }
+
+  /* Create an easy handle. This will have all of the settings configured on
+     it. */
+  fuzz->easy = fuzz_pool_get_easy(fuzz);
+  FCHECK(fuzz->easy != NULL);
 
 EXIT_LABEL:
 
@@ -201,8 +366,7 @@ int fuzz_set_easy_options(FUZZ_DATA *fuzz)
   }
 
   /* Force resolution of all addresses to a specific IP address. */
-  fuzz->connect_to_list = curl_slist_append(NULL, "::127.0.1.127:");
-  FTRY(curl_easy_setopt(fuzz->easy, CURLOPT_CONNECT_TO, fuzz->connect_to_list));
+  FTRY(curl_easy_setopt(fuzz->easy, CURLOPT_CONNECT_TO, &connect_to_list));
 
   /* Limit the protocols in use by this fuzzer. */
   FTRY(fuzz_set_allowed_protocols(fuzz));
@@ -219,20 +383,13 @@ void fuzz_terminate_fuzz_data(FUZZ_DATA *fuzz)
 {
   int ii;
 
-  fuzz_free((void **)&fuzz->postfields);
-
-  for(ii = 0; ii < FUZZ_NUM_CONNECTIONS; ii++) {
+  for(ii = 0; ii < fuzz->num_sockman; ii++) {
     if(fuzz->sockman[ii].fd_state != FUZZ_SOCK_CLOSED) {
-      close(fuzz->sockman[ii].fd);
+      fuzz_sman_close(&fuzz->sockman[ii]);
       fuzz->sockman[ii].fd_state = FUZZ_SOCK_CLOSED;
     }
   }
 
-  if(fuzz->connect_to_list != NULL) {
-    curl_slist_free_all(fuzz->connect_to_list);
-    fuzz->connect_to_list = NULL;
-  }
-
   if(fuzz->header_list != NULL) {
     curl_slist_free_all(fuzz->header_list);
     fuzz->header_list = NULL;
@@ -248,10 +405,19 @@ void fuzz_terminate_fuzz_data(FUZZ_DATA *fuzz)
     fuzz->mime = NULL;
   }
 
-  if(fuzz->easy != NULL) {
+  if(fuzz->recycle_interval > 0) {
+    /* Keep the handles for the next run, or tear them down. */
+    fuzz_pool_release(fuzz);
+  }
+  else if(fuzz->easy != NULL) {
     curl_easy_cleanup(fuzz->easy);
     fuzz->easy = NULL;
   }
+
+  /* Everything libcurl does for this run has finished. */
+  fuzz_transport_end_run();
+  fuzz_arena_end_run();
+  fuzz_vclock_set_active(0);
 }
 
 /**
@@ -273,30 +439,258 @@ int fuzz_handle_transfer(FUZZ_DATA *fuzz)
 {
   int rc = 0;
   CURLM *multi_handle;
+  int ii;
+
+  for(ii = 0; ii < FUZZ_MAX_CONNECTIONS; ii++) {
+    /* Set up the starting index for responses. */
+    fuzz->sockman[ii].response_index = 1;
+  }
+
+  /* init a multi stack */
+  multi_handle = fuzz_pool_get_multi(fuzz);
+  if(multi_handle == NULL) {
+    return -1;
+  }
+
+  if(fuzz->engine == FUZZ_ENGINE_SELECT) {
+    rc = fuzz_handle_transfer_select(fuzz, multi_handle);
+  }
+  else {
+    rc = fuzz_handle_transfer_socket(fuzz, multi_handle);
+  }
+
+  /* Remove the easy handle from the multi stack. */
+  curl_multi_remove_handle(multi_handle, fuzz->easy);
+
+  /* Clean up the multi handle, or keep it for the next run - the top level
+     function will handle the easy handle. */
+  fuzz_pool_put_multi(fuzz, multi_handle);
+
+  return(rc);
+}
+
+/**
+ * Get an easy handle for a fuzzing run. When recycling handles, the handle
+ * from the previous run is reused if there is one.
+ */
+CURL *fuzz_pool_get_easy(FUZZ_DATA *fuzz)
+{
+  if(fuzz->recycle_interval == 0) {
+    return curl_easy_init();
+  }
+
+  if(handle_pool.easy == NULL) {
+    handle_pool.easy = curl_easy_init();
+    pthread_setspecific(handle_pool_key, &handle_pool);
+  }
+  else {
+    __atomic_fetch_add(&pool_stats.easys_recycled, 1, __ATOMIC_RELAXED);
+  }
+
+  return handle_pool.easy;
+}
+
+/**
+ * Get a multi handle for a fuzzing run. When recycling handles, the handle
+ * from the previous run is reused if there is one.
+ */
+CURLM *fuzz_pool_get_multi(FUZZ_DATA *fuzz)
+{
+  if(fuzz->recycle_interval == 0) {
+    return curl_multi_init();
+  }
+
+  if(handle_pool.multi == NULL) {
+    handle_pool.multi = curl_multi_init();
+    pthread_setspecific(handle_pool_key, &handle_pool);
+  }
+  else {
+    __atomic_fetch_add(&pool_stats.multis_recycled, 1, __ATOMIC_RELAXED);
+  }
+
+  return handle_pool.multi;
+}
+
+/**
+ * Hand back a multi handle at the end of a transfer. A recycled multi handle
+ * is only kept if no connection was made: connections leave state behind in
+ * the multi handle, such as the connection numbering that IMAP command tags
+ * are built from, which would make runs depend on the runs before them, and
+ * libcurl has no way of resetting it. As nearly every input connects, in
+ * practice only the easy handle is reused.
+ */
+void fuzz_pool_put_multi(FUZZ_DATA *fuzz, CURLM *multi_handle)
+{
+  long connects = 0;
+  int connected = 0;
+  int ii;
+
+  for(ii = 0; ii < fuzz->num_sockman; ii++) {
+    if(fuzz->sockman[ii].fd_state != FUZZ_SOCK_CLOSED) {
+      connected = 1;
+    }
+  }
+
+  if(curl_easy_getinfo(fuzz->easy,
+                       CURLINFO_NUM_CONNECTS,
+                       &connects) != CURLE_OK ||
+     connects > 0) {
+    connected = 1;
+  }
+
+  if(fuzz->recycle_interval > 0 && !connected) {
+    /* Stop the multi handle calling back into this run's data. */
+    curl_multi_setopt(multi_handle, CURLMOPT_SOCKETFUNCTION, NULL);
+    curl_multi_setopt(multi_handle, CURLMOPT_SOCKETDATA, NULL);
+    curl_multi_setopt(multi_handle, CURLMOPT_TIMERFUNCTION, NULL);
+    curl_multi_setopt(multi_handle, CURLMOPT_TIMERDATA, NULL);
+    return;
+  }
+
+  curl_multi_cleanup(multi_handle);
+
+  if(multi_handle == handle_pool.multi) {
+    handle_pool.multi = NULL;
+  }
+}
+
+/**
+ * Clean up the handles a thread has pooled when the thread exits.
+ */
+void fuzz_pool_thread_exit(void *arg)
+{
+  FUZZ_HANDLE_POOL *pool = (FUZZ_HANDLE_POOL *)arg;
+
+  if(pool->multi != NULL) {
+    curl_multi_cleanup(pool->multi);
+    pool->multi = NULL;
+  }
+
+  if(pool->easy != NULL) {
+    curl_easy_cleanup(pool->easy);
+    pool->easy = NULL;
+  }
+
+  pool->uses = 0;
+}
+
+/**
+ * Arrange for the handle recycling statistics to be printed at exit.
+ */
+static void fuzz_pool_report_at_exit(void)
+{
+  atexit(fuzz_pool_report);
+}
+
+/**
+ * Hand the recycled handles back at the end of a fuzzing run. Per-run state
+ * is wiped from the easy handle, and both handles are destroyed every
+ * recycle_interval runs so that state leaking between runs stays bounded.
+ */
+void fuzz_pool_release(FUZZ_DATA *fuzz)
+{
+  struct timespec end_time;
+  uint64_t start_ns;
+  uint64_t end_ns;
+  uint64_t seen_ns;
+
+  if(fuzz->easy != NULL) {
+    /* Forget any cookies, then go back to the default options. */
+    curl_easy_setopt(fuzz->easy, CURLOPT_COOKIELIST, "ALL");
+    curl_easy_reset(fuzz->easy);
+    fuzz->easy = NULL;
+  }
+
+  __atomic_store_n(&pool_stats.interval,
+                   fuzz->recycle_interval,
+                   __ATOMIC_RELAXED);
+  handle_pool.uses++;
+
+  if(handle_pool.uses >= fuzz->recycle_interval) {
+    if(handle_pool.easy != NULL) {
+      curl_easy_cleanup(handle_pool.easy);
+      handle_pool.easy = NULL;
+    }
+
+    if(handle_pool.multi != NULL) {
+      curl_multi_cleanup(handle_pool.multi);
+      handle_pool.multi = NULL;
+    }
+
+    handle_pool.uses = 0;
+  }
+
+  /* Keep statistics so exec/s with and without recycling can be compared. */
+  pthread_once(&pool_report_once, fuzz_pool_report_at_exit);
+
+  clock_gettime(CLOCK_BOOTTIME, &end_time);
+  start_ns = (uint64_t)fuzz->start_time.tv_sec * 1000000000 +
+             fuzz->start_time.tv_nsec;
+  end_ns = (uint64_t)end_time.tv_sec * 1000000000 + end_time.tv_nsec;
+
+  seen_ns = __atomic_load_n(&pool_stats.first_start_ns, __ATOMIC_RELAXED);
+  while((seen_ns == 0 || start_ns < seen_ns) &&
+        !__atomic_compare_exchange_n(&pool_stats.first_start_ns,
+                                     &seen_ns,
+                                     start_ns,
+                                     0,
+                                     __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED)) {
+    /* Another thread started a run; try again. */
+  }
+
+  seen_ns = __atomic_load_n(&pool_stats.last_end_ns, __ATOMIC_RELAXED);
+  while(end_ns > seen_ns &&
+        !__atomic_compare_exchange_n(&pool_stats.last_end_ns,
+                                     &seen_ns,
+                                     end_ns,
+                                     0,
+                                     __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED)) {
+    /* Another thread finished a run; try again. */
+  }
+
+  __atomic_fetch_add(&pool_stats.runs, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Print handle recycling statistics.
+ */
+void fuzz_pool_report(void)
+{
+  double run_seconds =
+    (pool_stats.last_end_ns - pool_stats.first_start_ns) / 1e9;
+
+  fprintf(stderr,
+          "FUZZ: %lu runs in %.3fs (%.1f exec/s), recycled %lu easy and "
+          "%lu multi handles, full teardown every %ld runs\n",
+          pool_stats.runs,
+          run_seconds,
+          run_seconds > 0 ? pool_stats.runs / run_seconds : 0.0,
+          pool_stats.easys_recycled,
+          pool_stats.multis_recycled,
+          pool_stats.interval);
+}
+
+/**
+ * Transfer engine which polls the file descriptors given out by
+ * curl_multi_fdset() with select(). It only stops after two select()
+ * timeouts in a row.
+ */
+int fuzz_handle_transfer_select(FUZZ_DATA *fuzz, CURLM *multi_handle)
+{
+  int rc = 0;
   int still_running; /* keep number of running handles */
-  CURLMsg *msg; /* for picking up messages with the transfer status */
-  int msgs_left; /* how many messages are left */
   int double_timeout = 0;
   fd_set fdread;
   fd_set fdwrite;
   fd_set fdexcep;
   struct timeval timeout;
-  int select_rc;
   CURLMcode mc;
   int maxfd = -1;
-  long curl_timeo = -1;
   int ii;
-  FUZZ_SOCKET_MANAGER *sman[FUZZ_NUM_CONNECTIONS];
-
-  for(ii = 0; ii < FUZZ_NUM_CONNECTIONS; ii++) {
-    sman[ii] = &fuzz->sockman[ii];
-
-    /* Set up the starting index for responses. */
-    sman[ii]->response_index = 1;
-  }
-
-  /* init a multi stack */
-  multi_handle = curl_multi_init();
+  FUZZ_SOCKET_MANAGER *sman;
 
   /* add the individual transfers */
   curl_multi_add_handle(multi_handle, fuzz->easy);
@@ -327,14 +721,15 @@ int fuzz_handle_transfer(FUZZ_DATA *fuzz)
       break;
     }
 
-    for(ii = 0; ii < FUZZ_NUM_CONNECTIONS; ii++) {
+    for(ii = 0; ii < fuzz->num_sockman; ii++) {
       /* Add the socket FD into the readable set if connected. */
-      if(sman[ii]->fd_state == FUZZ_SOCK_OPEN) {
-        FD_SET(sman[ii]->fd, &fdread);
+      sman = &fuzz->sockman[ii];
+      if(sman->fd_state == FUZZ_SOCK_OPEN) {
+        FD_SET(sman->fd, &fdread);
 
         /* Work out the maximum FD between the cURL file descriptors and the
            server FD. */
-        maxfd = FUZZ_MAX(sman[ii]->fd, maxfd);
+        maxfd = FUZZ_MAX(sman->fd, maxfd);
       }
     }
 
@@ -369,10 +764,10 @@ int fuzz_handle_transfer(FUZZ_DATA *fuzz)
 
     /* Check to see if a server file descriptor is readable. If it is,
        then send the next response from the fuzzing data. */
-    for(ii = 0; ii < FUZZ_NUM_CONNECTIONS; ii++) {
-      if(sman[ii]->fd_state == FUZZ_SOCK_OPEN &&
-         FD_ISSET(sman[ii]->fd, &fdread)) {
-        rc = fuzz_send_next_response(fuzz, sman[ii]);
+    for(ii = 0; ii < fuzz->num_sockman; ii++) {
+      sman = &fuzz->sockman[ii];
+      if(sman->fd_state == FUZZ_SOCK_OPEN && FD_ISSET(sman->fd, &fdread)) {
+        rc = fuzz_send_next_response(fuzz, sman);
         if(rc != 0) {
           /* Failed to send a response. Break out here. */
           break;
@@ -383,56 +778,262 @@ int fuzz_handle_transfer(FUZZ_DATA *fuzz)
     curl_multi_perform(multi_handle, &still_running);
   }
 
-  /* Remove the easy handle from the multi stack. */
-  curl_multi_remove_handle(multi_handle, fuzz->easy);
+  return(rc);
+}
 
-  /* Clean up the multi handle - the top level function will handle the easy
-     handle. */
-  curl_multi_cleanup(multi_handle);
+/**
+ * Transfer engine driven by curl_multi_socket_action(). libcurl tells us
+ * which sockets to watch and when its next timeout is due, and the server
+ * file descriptors are polled alongside. The transfer is abandoned as soon as
+ * no file descriptor has work and libcurl has no timer due shortly, rather
+ * than waiting for a run of select() timeouts.
+ */
+int fuzz_handle_transfer_socket(FUZZ_DATA *fuzz, CURLM *multi_handle)
+{
+  int rc = 0;
+  int still_running = 0;
+  struct pollfd pfds[FUZZ_MAX_POLL_FDS];
+  FUZZ_SOCKET_MANAGER *pfd_sman[FUZZ_MAX_POLL_FDS];
+  nfds_t nfds;
+  nfds_t jj;
+  int poll_rc;
+  int wait_ms;
+  int ev_bitmask;
+  int ii;
+  int servers_ready;
+  FUZZ_SOCKET_MANAGER *sman;
+  FUZZ_CURL_SOCKET *csock;
+
+  curl_multi_setopt(multi_handle,
+                    CURLMOPT_SOCKETFUNCTION,
+                    fuzz_socket_callback);
+  curl_multi_setopt(multi_handle, CURLMOPT_SOCKETDATA, fuzz);
+  curl_multi_setopt(multi_handle,
+                    CURLMOPT_TIMERFUNCTION,
+                    fuzz_timer_callback);
+  curl_multi_setopt(multi_handle, CURLMOPT_TIMERDATA, fuzz);
+
+  /* add the individual transfers */
+  curl_multi_add_handle(multi_handle, fuzz->easy);
+
+  /* Kick off the transfer. This might end the transfer immediately. */
+  curl_multi_socket_action(multi_handle, CURL_SOCKET_TIMEOUT, 0,
+                           &still_running);
+  FV_PRINTF(fuzz,
+            "FUZZ: Initial socket action; still running? %d \n",
+            still_running);
+
+  while(still_running) {
+    nfds = 0;
+
+    /* Watch the sockets libcurl is interested in. */
+    for(ii = 0; ii < FUZZ_MAX_CURL_SOCKETS; ii++) {
+      csock = &fuzz->curl_sockets[ii];
+      if(csock->fd != CURL_SOCKET_BAD) {
+        pfds[nfds].fd = csock->fd;
+        pfds[nfds].events = 0;
+        if(csock->what & CURL_POLL_IN) {
+          pfds[nfds].events |= POLLIN;
+        }
+        if(csock->what & CURL_POLL_OUT) {
+          pfds[nfds].events |= POLLOUT;
+        }
+        pfd_sman[nfds] = NULL;
+        nfds++;
+      }
+    }
+
+    /* Watch the server sockets that still have responses to send. In-memory
+       connections are checked directly rather than polled. */
+    servers_ready = 0;
+    for(ii = 0; ii < fuzz->num_sockman; ii++) {
+      sman = &fuzz->sockman[ii];
+      if(sman->fd_state != FUZZ_SOCK_OPEN) {
+        continue;
+      }
+
+      if(sman->memsock != NULL) {
+        if(fuzz_sman_readable(sman)) {
+          servers_ready++;
+        }
+      }
+      else {
+        pfds[nfds].fd = sman->fd;
+        pfds[nfds].events = POLLIN;
+        pfd_sman[nfds] = sman;
+        nfds++;
+      }
+    }
+
+    /* Only wait for libcurl's timer if the select engine would have waited
+       for it too, or if waiting is free because of virtual time. Otherwise
+       just check whether anything is ready now. */
+    if(servers_ready > 0) {
+      wait_ms = 0;
+    }
+    else if(fuzz->curl_timeout_ms >= 0 &&
+            (fuzz->curl_timeout_ms <= FUZZ_SOCKET_ENGINE_MAX_WAIT_MS ||
+             fuzz->virtual_time)) {
+      wait_ms = (int)FUZZ_MIN(fuzz->curl_timeout_ms, INT_MAX);
+    }
+    else {
+      wait_ms = 0;
+    }
+
+    poll_rc = fuzz_poll(pfds, nfds, wait_ms);
+
+    if(poll_rc == -1) {
+      /* Had an issue while polling a file descriptor. Let's just exit. */
+      FV_PRINTF(fuzz, "FUZZ: poll failed, exiting \n");
+      rc = -1;
+      break;
+    }
+    else if(poll_rc == 0 && servers_ready == 0) {
+      if(wait_ms == 0 && fuzz->curl_timeout_ms != 0) {
+        /* Nothing is ready and libcurl isn't about to time out, so nothing
+           more can happen in this transfer. */
+        FV_PRINTF(fuzz,
+                  "FUZZ: Nothing to do; libcurl timeout %ld, exiting \n",
+                  fuzz->curl_timeout_ms);
+        break;
+      }
+
+      /* libcurl's timer has expired. */
+      fuzz->curl_timeout_ms = -1;
+      curl_multi_socket_action(multi_handle, CURL_SOCKET_TIMEOUT, 0,
+                               &still_running);
+      continue;
+    }
+
+    /* Send the next response from the fuzzing data on each readable server
+       connection. */
+    for(ii = 0; ii < fuzz->num_sockman && rc == 0; ii++) {
+      sman = &fuzz->sockman[ii];
+      if(sman->fd_state == FUZZ_SOCK_OPEN && fuzz_sman_readable(sman)) {
+        rc = fuzz_send_next_response(fuzz, sman);
+      }
+    }
+    for(jj = 0; jj < nfds && rc == 0; jj++) {
+      if(pfd_sman[jj] != NULL && pfds[jj].revents != 0) {
+        rc = fuzz_send_next_response(fuzz, pfd_sman[jj]);
+        if(rc != 0) {
+          /* Failed to send a response. Break out here. */
+          break;
+        }
+      }
+    }
+
+    /* Tell libcurl about activity on its own sockets. */
+    for(jj = 0; jj < nfds && still_running; jj++) {
+      if(pfd_sman[jj] == NULL && pfds[jj].revents != 0) {
+        ev_bitmask = 0;
+        if(pfds[jj].revents & (POLLIN | POLLHUP)) {
+          ev_bitmask |= CURL_CSELECT_IN;
+        }
+        if(pfds[jj].revents & POLLOUT) {
+          ev_bitmask |= CURL_CSELECT_OUT;
+        }
+        if(pfds[jj].revents & (POLLERR | POLLNVAL)) {
+          ev_bitmask |= CURL_CSELECT_ERR;
+        }
+        curl_multi_socket_action(multi_handle, pfds[jj].fd, ev_bitmask,
+                                 &still_running);
+      }
+    }
+  }
 
   return(rc);
 }
 
 /**
- * Sends the next fuzzing response to the server file descriptor.
+ * Handles the server file descriptor becoming readable: reads what the client
+ * has sent and sends the next fuzzing response. Responses with a trigger are
+ * instead sent as soon as the client data satisfies the trigger, so one call
+ * can send several responses, or none.
  */
 int fuzz_send_next_response(FUZZ_DATA *fuzz, FUZZ_SOCKET_MANAGER *sman)
 {
   int rc = 0;
   ssize_t ret_in;
-  ssize_t ret_out;
+  size_t pos;
+  size_t used;
+  int sent = 0;
+  int client_closed = 0;
   char buffer[8192];
-  const uint8_t *data;
-  size_t data_len;
 
   /* Need to read all data sent by the client so the file descriptor becomes
      unreadable. Because the file descriptor is non-blocking we won't just
      hang here. */
   do {
-    ret_in = read(sman->fd, buffer, sizeof(buffer));
-    if(fuzz->verbose && ret_in > 0) {
-      printf("FUZZ[%d]: Received %zu bytes \n==>\n", sman->index, ret_in);
-      fwrite(buffer, ret_in, 1, stdout);
-      printf("\n<==\n");
+    ret_in = fuzz_sman_read(sman, buffer, sizeof(buffer));
+    if(ret_in == 0) {
+      client_closed = 1;
+    }
+    else if(ret_in > 0) {
+      if(fuzz->verbose) {
+        printf("FUZZ[%d]: Received %zu bytes \n==>\n", sman->index, ret_in);
+        fwrite(buffer, ret_in, 1, stdout);
+        printf("\n<==\n");
+      }
+
+      /* Send every response this data triggers. */
+      pos = 0;
+      while(rc == 0 &&
+            pos < (size_t)ret_in &&
+            sman->fd_state == FUZZ_SOCK_OPEN &&
+            fuzz_response_has_trigger(
+                                &sman->responses[sman->response_index]) &&
+            fuzz_match_trigger(sman,
+                               (const uint8_t *)&buffer[pos],
+                               ret_in - pos,
+                               &used)) {
+        pos += used;
+        rc = fuzz_send_response(fuzz, sman);
+        sent = 1;
+      }
     }
-  } while (ret_in > 0);
+  } while(ret_in > 0);
+
+  if(rc != 0 || sent || sman->fd_state != FUZZ_SOCK_OPEN) {
+    return(rc);
+  }
+
+  if(fuzz_response_has_trigger(&sman->responses[sman->response_index]) &&
+     !client_closed) {
+    /* The client hasn't finished its request yet. */
+    FV_PRINTF(fuzz,
+              "FUZZ[%d]: Waiting for trigger for response: %d \n",
+              sman->index,
+              sman->response_index);
+    return(rc);
+  }
 
   /* Now send a response to the request that the client just made. */
+  return fuzz_send_response(fuzz, sman);
+}
+
+/**
+ * Sends the current fuzzing response to the server file descriptor and moves
+ * on to the next one, shutting down the server if there are no more.
+ */
+int fuzz_send_response(FUZZ_DATA *fuzz, FUZZ_SOCKET_MANAGER *sman)
+{
+  int rc = 0;
+
   FV_PRINTF(fuzz,
             "FUZZ[%d]: Sending next response: %d \n",
             sman->index,
             sman->response_index);
-  data = sman->responses[sman->response_index].data;
-  data_len = sman->responses[sman->response_index].data_len;
-
-  if(data != NULL) {
-    if(write(sman->fd, data, data_len) != (ssize_t)data_len) {
-      /* Failed to write the data back to the client. Prevent any further
-         testing. */
-      rc = -1;
-    }
+  if(fuzz_sman_send(sman, sman->response_index) != 0) {
+    /* Failed to write the data back to the client. Prevent any further
+       testing. */
+    rc = -1;
   }
 
+  /* Triggers for the next response only count data from here on. */
+  sman->request_len = 0;
+  sman->request_tail_len = 0;
+
   /* Work out if there are any more responses. If not, then shut down the
      server. */
   sman->response_index++;
@@ -443,7 +1044,7 @@ int fuzz_send_next_response(FUZZ_DATA *fuzz, FUZZ_SOCKET_MANAGER *sman)
               "FUZZ[%d]: Shutting down server socket: %d \n",
               sman->index,
               sman->fd);
-    shutdown(sman->fd, SHUT_WR);
+    fuzz_sman_shutdown(sman);
     sman->fd_state = FUZZ_SOCK_SHUTDOWN;
   }
 
@@ -451,22 +1052,170 @@ int fuzz_send_next_response(FUZZ_DATA *fuzz, FUZZ_SOCKET_MANAGER *sman)
 }
 
 /**
- * Wrapper for select() so profiling can track it.
+ * Returns whether a response waits for a trigger in the client data.
+ */
+int fuzz_response_has_trigger(const FUZZ_RESPONSE *rsp)
+{
+  return rsp->trigger_len > 0 || rsp->trigger_bytes > 0;
+}
+
+/**
+ * Checks client data against the trigger for a socket manager's current
+ * response, carrying on from the data seen by earlier calls. Returns 1 if
+ * the trigger has been satisfied, with *used set to the number of bytes of
+ * data up to and including the end of the trigger. Otherwise returns 0 and
+ * all of the data has been used.
+ */
+int fuzz_match_trigger(FUZZ_SOCKET_MANAGER *sman,
+                       const uint8_t *data,
+                       size_t data_len,
+                       size_t *used)
+{
+  const FUZZ_RESPONSE *rsp = &sman->responses[sman->response_index];
+  uint8_t window[2 * FUZZ_MAX_TRIGGER_LEN];
+  size_t window_len;
+  size_t keep;
+  const uint8_t *match;
+
+  if(rsp->trigger_bytes > 0) {
+    if(sman->request_len + data_len >= rsp->trigger_bytes) {
+      *used = rsp->trigger_bytes - sman->request_len;
+      return 1;
+    }
+
+    sman->request_len += data_len;
+    *used = data_len;
+    return 0;
+  }
+
+  /* Look for a delimiter starting in the end of the earlier data. */
+  memcpy(window, sman->request_tail, sman->request_tail_len);
+  window_len = sman->request_tail_len;
+  keep = FUZZ_MIN(data_len, rsp->trigger_len - 1);
+  memcpy(&window[window_len], data, keep);
+  window_len += keep;
+
+  match = (const uint8_t *)memmem(window, window_len,
+                                  rsp->trigger, rsp->trigger_len);
+  if(match != NULL) {
+    *used = (match - window) + rsp->trigger_len - sman->request_tail_len;
+    return 1;
+  }
+
+  /* Then in the new data. */
+  match = (const uint8_t *)memmem(data, data_len,
+                                  rsp->trigger, rsp->trigger_len);
+  if(match != NULL) {
+    *used = (match - data) + rsp->trigger_len;
+    return 1;
+  }
+
+  /* Keep the end of the data in case the delimiter is split across reads. */
+  keep = rsp->trigger_len - 1;
+  if(data_len >= keep) {
+    memcpy(sman->request_tail, &data[data_len - keep], keep);
+    sman->request_tail_len = keep;
+  }
+  else {
+    keep = FUZZ_MIN(window_len, keep);
+    memmove(sman->request_tail, &window[window_len - keep], keep);
+    sman->request_tail_len = keep;
+  }
+
+  sman->request_len += data_len;
+  *used = data_len;
+  return 0;
+}
+
+/**
+ * Gets the socket manager for a connection, adding socket managers up to it
+ * if they are not in use yet. Returns NULL if the connection number is over
+ * the limit.
+ */
+FUZZ_SOCKET_MANAGER *fuzz_get_sockman(FUZZ_DATA *fuzz, int index)
+{
+  if(index < 0 || index >= FUZZ_MAX_CONNECTIONS) {
+    return NULL;
+  }
+
+  if(index >= fuzz->num_sockman) {
+    fuzz->num_sockman = index + 1;
+  }
+
+  return &fuzz->sockman[index];
+}
+
+/**
+ * Wrapper for select() so profiling can track it. With virtual time, a
+ * select() that would time out returns straight away and moves the virtual
+ * clock forward instead. Pooled socket pairs at an emulated end of file are
+ * reported readable, as the kernel doesn't know about it.
  */
 int fuzz_select(int nfds,
                 fd_set *readfds,
                 fd_set *writefds,
                 fd_set *exceptfds,
                 struct timeval *timeout) {
-  return select(nfds, readfds, writefds, exceptfds, timeout);
+  struct timeval no_wait;
+  fd_set at_eof;
+  int num_at_eof;
+  int fd;
+  int rc;
+
+  FUZZ_PROFILE_COUNT(FUZZ_CALL_SELECT);
+  FUZZ_PROFILE_START(FUZZ_PHASE_WAIT);
+
+  num_at_eof = fuzz_sockpair_select_pending(nfds, readfds, &at_eof);
+
+  if(num_at_eof > 0) {
+    no_wait.tv_sec = 0;
+    no_wait.tv_usec = 0;
+    rc = select(nfds, readfds, writefds, exceptfds, &no_wait);
+
+    for(fd = 0; fd < nfds && rc >= 0; fd++) {
+      if(FD_ISSET(fd, &at_eof) && !FD_ISSET(fd, readfds)) {
+        FD_SET(fd, readfds);
+        rc++;
+      }
+    }
+  }
+  else if(!fuzz_vclock_is_active() || timeout == NULL) {
+    rc = select(nfds, readfds, writefds, exceptfds, timeout);
+  }
+  else {
+    no_wait.tv_sec = 0;
+    no_wait.tv_usec = 0;
+    rc = select(nfds, readfds, writefds, exceptfds, &no_wait);
+
+    if(rc == 0) {
+      fuzz_vclock_advance(timeout->tv_sec * 1000 + timeout->tv_usec / 1000);
+    }
+  }
+
+  FUZZ_PROFILE_STOP(FUZZ_PHASE_WAIT);
+
+  return rc;
 }
 
 /**
- * Set allowed protocols based on the compile options
+ * Wrapper for poll() so profiling can track it.
  */
-int fuzz_set_allowed_protocols(FUZZ_DATA *fuzz)
+int fuzz_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+  int rc;
+
+  FUZZ_PROFILE_START(FUZZ_PHASE_WAIT);
+  rc = poll(fds, nfds, timeout);
+  FUZZ_PROFILE_STOP(FUZZ_PHASE_WAIT);
+
+  return rc;
+}
+
+/**
+ * Get the protocols allowed by the compile options, as CURLPROTO_* bits.
+ */
+unsigned long fuzz_allowed_protocols(void)
 {
-  int rc = 0;
   unsigned long allowed_protocols = 0;
 
 #ifdef FUZZ_PROTOCOLS_ALL
@@ -533,9 +1282,56 @@ int fuzz_set_allowed_protocols(FUZZ_DATA *fuzz)
   allowed_protocols |= CURLPROTO_TFTP;
 #endif
 
-  FTRY(curl_easy_setopt(fuzz->easy, CURLOPT_PROTOCOLS, allowed_protocols));
+  return allowed_protocols;
+}
+
+/**
+ * Set allowed protocols based on the compile options
+ */
+int fuzz_set_allowed_protocols(FUZZ_DATA *fuzz)
+{
+  int rc = 0;
+
+  FTRY(curl_easy_setopt(fuzz->easy,
+                        CURLOPT_PROTOCOLS,
+                        fuzz_allowed_protocols()));
 
 EXIT_LABEL:
 
   return rc;
 }
+
+/**
+ * Get the protocol for the scheme at the start of a URL, as a CURLPROTO_*
+ * bit. Returns 0 if the URL has no "<scheme>://" prefix or the scheme isn't
+ * known, in which case it's left to libcurl to decide.
+ */
+unsigned long fuzz_url_protocol(const uint8_t *url, size_t url_len)
+{
+  size_t scheme_len;
+  int ii;
+
+  for(scheme_len = 0; scheme_len < url_len; scheme_len++) {
+    if(!isalnum(url[scheme_len]) && url[scheme_len] != '+' &&
+       url[scheme_len] != '-' && url[scheme_len] != '.') {
+      break;
+    }
+  }
+
+  if(scheme_len == 0 ||
+     url_len - scheme_len < 3 ||
+     memcmp(url + scheme_len, "://", 3) != 0) {
+    return 0;
+  }
+
+  for(ii = 0; url_schemes[ii].scheme != NULL; ii++) {
+    if(strlen(url_schemes[ii].scheme) == scheme_len &&
+       strncasecmp(url_schemes[ii].scheme,
+                   (const char *)url,
+                   scheme_len) == 0) {
+      return url_schemes[ii].protocol;
+    }
+  }
+
+  return 0;
+}
@@ -20,53 +20,86 @@
  *
  ***************************************************************************/
 #include <inttypes.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
 #include <curl/curl.h>
 #include "testinput.h"
 
 /**
- * TLV types.
+ * TLV types, from the TLV schema.
  */
-#define TLV_TYPE_URL                    1
-#define TLV_TYPE_RESPONSE0              2
-#define TLV_TYPE_USERNAME               3
-#define TLV_TYPE_PASSWORD               4
-#define TLV_TYPE_POSTFIELDS             5
-#define TLV_TYPE_HEADER                 6
-#define TLV_TYPE_COOKIE                 7
-#define TLV_TYPE_UPLOAD1                8
-#define TLV_TYPE_RANGE                  9
-#define TLV_TYPE_CUSTOMREQUEST          10
-#define TLV_TYPE_MAIL_RECIPIENT         11
-#define TLV_TYPE_MAIL_FROM              12
-#define TLV_TYPE_MIME_PART              13
-#define TLV_TYPE_MIME_PART_NAME         14
-#define TLV_TYPE_MIME_PART_DATA         15
-#define TLV_TYPE_HTTPAUTH               16
-#define TLV_TYPE_RESPONSE1              17
-#define TLV_TYPE_RESPONSE2              18
-#define TLV_TYPE_RESPONSE3              19
-#define TLV_TYPE_RESPONSE4              20
-#define TLV_TYPE_RESPONSE5              21
-#define TLV_TYPE_RESPONSE6              22
-#define TLV_TYPE_RESPONSE7              23
-#define TLV_TYPE_RESPONSE8              24
-#define TLV_TYPE_RESPONSE9              25
-#define TLV_TYPE_RESPONSE10             26
-#define TLV_TYPE_OPTHEADER              27
-#define TLV_TYPE_NOBODY                 28
-#define TLV_TYPE_FOLLOWLOCATION         29
-#define TLV_TYPE_ACCEPTENCODING         30
-#define TLV_TYPE_SECOND_RESPONSE0       31
-#define TLV_TYPE_SECOND_RESPONSE1       32
-#define TLV_TYPE_WILDCARDMATCH          33
-#define TLV_TYPE_RTSP_REQUEST           34
-#define TLV_TYPE_RTSP_SESSION_ID        35
-#define TLV_TYPE_RTSP_STREAM_URI        36
-#define TLV_TYPE_RTSP_TRANSPORT         37
-#define TLV_TYPE_RTSP_CLIENT_CSEQ       38
-#define TLV_TYPE_MAIL_AUTH              39
-#define TLV_TYPE_HTTP_VERSION           40
-#define TLV_TYPE_DOH_URL                41
+enum {
+#define FUZZ_TLV(NAME, TYPE, KIND, OPTION, PROTOCOLS, CONN, RESPONSE, PYNAME, \
+                 DESC)                                                        \
+  TLV_TYPE_##NAME = TYPE,
+#include "curl_fuzzer_tlv.def"
+#undef FUZZ_TLV
+};
+
+/* Number of TLV types in the schema. */
+enum {
+#define FUZZ_TLV(NAME, TYPE, KIND, OPTION, PROTOCOLS, CONN, RESPONSE, PYNAME, \
+                 DESC)                                                        \
+  FUZZ_TLV_INDEX_##NAME,
+#include "curl_fuzzer_tlv.def"
+#undef FUZZ_TLV
+  FUZZ_NUM_TLV_TYPES
+};
+
+/**
+ * How a TLV is handled. See curl_fuzzer_tlv.def.
+ */
+typedef enum fuzz_tlv_kind {
+  FUZZ_TLV_STRING,
+  FUZZ_TLV_U32,
+  FUZZ_TLV_RESPONSE,
+  FUZZ_TLV_SPECIAL,
+  FUZZ_TLV_MIME_FIELD
+} FUZZ_TLV_KIND;
+
+/**
+ * Sets of protocols that TLVs apply to. See curl_fuzzer_tlv.def.
+ */
+#define FUZZ_TLV_PROTO_ANY      ((unsigned long)CURLPROTO_ALL)
+#define FUZZ_TLV_PROTO_HTTP     (CURLPROTO_HTTP | CURLPROTO_HTTPS |           \
+                                 CURLPROTO_RTSP)
+#define FUZZ_TLV_PROTO_MIME     (FUZZ_TLV_PROTO_HTTP |                        \
+                                 CURLPROTO_IMAP | CURLPROTO_IMAPS |           \
+                                 CURLPROTO_SMTP | CURLPROTO_SMTPS)
+#define FUZZ_TLV_PROTO_MAIL     (CURLPROTO_SMTP | CURLPROTO_SMTPS)
+#define FUZZ_TLV_PROTO_RTSP     CURLPROTO_RTSP
+#define FUZZ_TLV_PROTO_FTP      (CURLPROTO_FTP | CURLPROTO_FTPS)
+
+/**
+ * Schema entry for a TLV type.
+ */
+typedef struct fuzz_tlv_schema
+{
+  uint16_t type;
+  FUZZ_TLV_KIND kind;
+
+  /* Option set by STRING and U32 TLVs. */
+  CURLoption option;
+
+  /* Protocols the TLV means anything for, as CURLPROTO_* bits. */
+  unsigned long protocols;
+
+  /* Connection and response number set by RESPONSE TLVs. */
+  unsigned char connection;
+  unsigned char response;
+
+} FUZZ_TLV_SCHEMA;
+
+/**
+ * URL scheme and the protocol it selects.
+ */
+typedef struct fuzz_url_scheme
+{
+  const char *scheme;
+  unsigned long protocol;
+
+} FUZZ_URL_SCHEME;
 
 /**
  * TLV function return codes.
@@ -87,11 +120,37 @@
 /* Number of allowed CURLOPT_HEADERs */
 #define TLV_MAX_NUM_CURLOPT_HEADER      2000
 
-/* Space variable for all CURLOPTs. */
-#define FUZZ_CURLOPT_TRACKER_SPACE      300
+/* Response triggers. A response with a trigger is only sent once the client
+   has sent a delimiter, or a number of bytes, since the last response. */
+#define FUZZ_TRIGGER_DELIMITER          0
+#define FUZZ_TRIGGER_BYTE_COUNT         1
+
+/* Longest delimiter a response can be triggered by */
+#define FUZZ_MAX_TRIGGER_LEN            16
+
+/* Maximum number of connections allowed to be opened */
+#define FUZZ_MAX_CONNECTIONS            8
+
+/* Number of sockets libcurl can ask the socket engine to watch at once */
+#define FUZZ_MAX_CURL_SOCKETS           16
+
+/* Longest time in milliseconds the socket engine waits for a libcurl timer
+   when no file descriptor has work. This matches the 10ms select() timeout
+   used by the select engine. */
+#define FUZZ_SOCKET_ENGINE_MAX_WAIT_MS  10
+
+/* Size of the buffer holding client data sent over an in-memory socket */
+#define FUZZ_MEMSOCK_BUFFER_SIZE        16384
+
+/* Number of in-memory sockets that can be open at once */
+#define FUZZ_MAX_MEMSOCKS               FUZZ_MAX_CONNECTIONS
+
+/* Number of socket pairs each thread keeps for reuse between runs */
+#define FUZZ_SOCKPAIR_POOL_SIZE         FUZZ_MAX_CONNECTIONS
 
-/* Number of connections allowed to be opened */
-#define FUZZ_NUM_CONNECTIONS            2
+/* Maximum number of file descriptors polled by the socket engine */
+#define FUZZ_MAX_POLL_FDS               (FUZZ_MAX_CURL_SOCKETS +              \
+                                         FUZZ_MAX_CONNECTIONS)
 
 typedef enum fuzz_sock_state {
   FUZZ_SOCK_CLOSED,
@@ -99,6 +158,50 @@ typedef enum fuzz_sock_state {
   FUZZ_SOCK_SHUTDOWN
 } FUZZ_SOCK_STATE;
 
+/**
+ * Transfer engines. The socket engine is driven by curl_multi_socket_action()
+ * and poll(); the select engine is the original curl_multi_fdset() loop and
+ * can be chosen by setting FUZZ_TRANSFER_ENGINE=select.
+ */
+typedef enum fuzz_transfer_engine {
+  FUZZ_ENGINE_SOCKET,
+  FUZZ_ENGINE_SELECT
+} FUZZ_TRANSFER_ENGINE;
+
+/**
+ * Transports between libcurl and the fake server. The memory transport hands
+ * libcurl sockets which the harness emulates in-process; the socketpair
+ * transport uses real sockets and can be chosen by setting
+ * FUZZ_TRANSPORT=socketpair.
+ */
+typedef enum fuzz_transport {
+  FUZZ_TRANSPORT_MEMORY,
+  FUZZ_TRANSPORT_SOCKETPAIR
+} FUZZ_TRANSPORT;
+
+/**
+ * Settings taken from the environment. Read once by the process-wide setup
+ * and not changed afterwards, so every thread can use them without locking.
+ */
+typedef struct fuzz_config
+{
+  /* FUZZ_VERBOSE */
+  int verbose;
+
+  /* FUZZ_TRANSFER_ENGINE */
+  FUZZ_TRANSFER_ENGINE engine;
+
+  /* FUZZ_TRANSPORT. Always socket pairs with the select engine. */
+  FUZZ_TRANSPORT transport;
+
+  /* FUZZ_VIRTUAL_TIME */
+  int virtual_time;
+
+  /* FUZZ_RECYCLE_HANDLES, or 0 if handles aren't recycled. */
+  long recycle_interval;
+
+} FUZZ_CONFIG;
+
 /**
  * Byte stream representation of the TLV header. Casting the byte stream
  * to a TLV_RAW allows us to examine the type and length.
@@ -138,8 +241,67 @@ typedef struct fuzz_parse_state
   /* Current position of our "cursor" in processing the data stream. */
   size_t data_pos;
 
+  /* Verbose mode, for tracing each TLV. */
+  int verbose;
+
 } FUZZ_PARSE_STATE;
 
+/**
+ * Reasons for rejecting an input.
+ */
+typedef enum fuzz_reject {
+  FUZZ_REJECT_NONE,
+
+  /* A TLV runs past the end of the input. */
+  FUZZ_REJECT_SIZE,
+
+  /* Unknown TLV type. */
+  FUZZ_REJECT_UNKNOWN,
+
+  /* A TLV that can only be used once was used again. */
+  FUZZ_REJECT_DUPLICATE,
+
+  /* TLV data of the wrong length or out of range. */
+  FUZZ_REJECT_VALUE,
+
+  /* A TLV or URL for protocols that this fuzzer doesn't allow. */
+  FUZZ_REJECT_PROTOCOL,
+
+  /* libcurl wouldn't accept an option. Only found once handles are set
+     up. */
+  FUZZ_REJECT_SETUP,
+
+  FUZZ_NUM_REJECTS
+} FUZZ_REJECT;
+
+/**
+ * State for the first pass over an input, which checks the TLVs before
+ * anything is set up.
+ */
+typedef struct fuzz_validate_state
+{
+  /* Bitmap of the TLV types seen so far, by type. Most TLVs can only be
+     used once. */
+  unsigned char tlvs_seen[FUZZ_NUM_TLV_TYPES / 8 + 1];
+
+  int header_count;
+
+  /* Protocols allowed by this fuzzer, as CURLPROTO_* bits. */
+  unsigned long allowed_protocols;
+
+} FUZZ_VALIDATE_STATE;
+
+/**
+ * Validation statistics, summed over all threads. Updated with atomic
+ * operations.
+ */
+typedef struct fuzz_validate_stats
+{
+  unsigned long inputs;
+  unsigned long rejected[FUZZ_NUM_REJECTS];
+
+} FUZZ_VALIDATE_STATS;
+
 /**
  * Structure to use for responses.
  */
@@ -149,8 +311,71 @@ typedef struct fuzz_response
   const uint8_t *data;
   size_t data_len;
 
+  /* Delimiter or byte count that triggers the response, if trigger_len or
+     trigger_bytes is non-zero. Otherwise the response is sent whenever the
+     server socket becomes readable. */
+  const uint8_t *trigger;
+  size_t trigger_len;
+  uint32_t trigger_bytes;
+
 } FUZZ_RESPONSE;
 
+/**
+ * An in-memory socket. libcurl's recv(), send() and poll() calls on the file
+ * descriptor are served from the fuzzing responses without entering the
+ * kernel.
+ */
+typedef struct fuzz_memsock
+{
+  /* File descriptor handed to libcurl, or CURL_SOCKET_BAD if unused. */
+  curl_socket_t fd;
+
+  /* Server to client data. The first rx_queued responses have been sent;
+     the client reads them from rx_index at rx_offset. */
+  const FUZZ_RESPONSE *responses;
+  int rx_queued;
+  int rx_index;
+  size_t rx_offset;
+
+  /* The server has shut down its side for writing. */
+  int rx_shutdown;
+
+  /* Client to server data that the server hasn't read yet. */
+  uint8_t tx_buf[FUZZ_MEMSOCK_BUFFER_SIZE];
+  size_t tx_len;
+
+  /* Which ends of the socket have been closed. */
+  int server_closed;
+  int client_closed;
+
+} FUZZ_MEMSOCK;
+
+/**
+ * A socket pair kept for reuse by the socketpair transport. The pair is
+ * never shut down or closed while it is in the pool, so its file descriptor
+ * numbers stay the same from run to run. Instead, the harness emulates the
+ * end of file each side would have seen.
+ */
+typedef struct fuzz_sockpair
+{
+  /* Set once the pair has been created. */
+  int created;
+
+  curl_socket_t server_fd;
+  curl_socket_t client_fd;
+
+  /* Set while the pair is handed out to a run. */
+  int in_use;
+
+  /* The server has sent all of its responses, so the client reads end of
+     file once it has read them. */
+  int eof;
+
+  /* libcurl has closed the client end, so the server reads end of file. */
+  int client_closed;
+
+} FUZZ_SOCKPAIR;
+
 typedef struct fuzz_socket_manager
 {
   unsigned char index;
@@ -160,12 +385,115 @@ typedef struct fuzz_socket_manager
   FUZZ_RESPONSE responses[TLV_MAX_NUM_RESPONSES];
   int response_index;
 
+  /* Client data received since the last response was sent, for response
+     triggers: a byte count and the end of the data, in case a delimiter is
+     split across reads. */
+  size_t request_len;
+  uint8_t request_tail[FUZZ_MAX_TRIGGER_LEN];
+  size_t request_tail_len;
+
   /* Server file descriptor. */
   FUZZ_SOCK_STATE fd_state;
   curl_socket_t fd;
 
+  /* In-memory socket when using the memory transport, otherwise NULL. */
+  FUZZ_MEMSOCK *memsock;
+
+  /* Pooled socket pair when using the socketpair transport, or NULL if the
+     pair isn't from the pool. */
+  FUZZ_SOCKPAIR *sockpair;
+
 } FUZZ_SOCKET_MANAGER;
 
+/**
+ * A socket libcurl has asked to be watched through CURLMOPT_SOCKETFUNCTION.
+ */
+typedef struct fuzz_curl_socket
+{
+  /* libcurl file descriptor, or CURL_SOCKET_BAD if the slot is free. */
+  curl_socket_t fd;
+
+  /* CURL_POLL_IN, CURL_POLL_OUT or CURL_POLL_INOUT. */
+  int what;
+
+} FUZZ_CURL_SOCKET;
+
+/**
+ * Handles kept between fuzzing runs when handle recycling is enabled. Each
+ * thread has its own pool.
+ */
+typedef struct fuzz_handle_pool
+{
+  /* Handles to reuse, or NULL if they need creating. */
+  CURL *easy;
+  CURLM *multi;
+
+  /* Number of runs since the handles were created. */
+  long uses;
+
+} FUZZ_HANDLE_POOL;
+
+/**
+ * Handle recycling statistics, summed over all threads and reported at exit.
+ * Updated with atomic operations.
+ */
+typedef struct fuzz_pool_stats
+{
+  /* Number of runs between full teardowns of the handles. */
+  long interval;
+
+  unsigned long runs;
+  unsigned long easys_recycled;
+  unsigned long multis_recycled;
+
+  /* When the first run started and the last run ended, in nanoseconds on
+     CLOCK_BOOTTIME, so that exec/s is worked out from wall time however
+     many threads are running. */
+  uint64_t first_start_ns;
+  uint64_t last_end_ns;
+
+} FUZZ_POOL_STATS;
+
+/**
+ * Phases of a fuzzing run timed by the profiling counters.
+ */
+typedef enum fuzz_profile_phase {
+  /* Checking the input, creating the easy handle and applying the TLVs. */
+  FUZZ_PHASE_PARSE,
+
+  /* fuzz_set_easy_options() and the options built up from several TLVs. */
+  FUZZ_PHASE_SETOPT,
+
+  /* fuzz_handle_transfer(). */
+  FUZZ_PHASE_TRANSFER,
+
+  /* Waiting in fuzz_select() or fuzz_poll(), as part of the transfer. */
+  FUZZ_PHASE_WAIT,
+
+  /* fuzz_terminate_fuzz_data(). */
+  FUZZ_PHASE_TEARDOWN,
+
+  FUZZ_NUM_PHASES
+} FUZZ_PROFILE_PHASE;
+
+/**
+ * Calls counted by the profiling counters. All but the last enter the
+ * kernel.
+ */
+typedef enum fuzz_profile_call {
+  FUZZ_CALL_READ,
+  FUZZ_CALL_WRITE,
+  FUZZ_CALL_SELECT,
+  FUZZ_CALL_POLL,
+  FUZZ_CALL_SOCKETPAIR,
+
+  /* recv(), send() and poll() on in-memory sockets, answered without a
+     system call. */
+  FUZZ_CALL_EMULATED,
+
+  FUZZ_NUM_CALLS
+} FUZZ_PROFILE_CALL;
+
 /**
  * Data local to a fuzzing run.
  */
@@ -185,29 +513,46 @@ typedef struct fuzz_data
   size_t upload1_data_len;
   size_t upload1_data_written;
 
-  /* Singleton option tracker. Options should only be set once. */
-  unsigned char options[FUZZ_CURLOPT_TRACKER_SPACE];
-
-  /* CURLOPT_POSTFIELDS data. */
-  char *postfields;
-
-  /* List of headers */
-  int header_list_count;
+  /* List of headers, and its last entry to append to. */
   struct curl_slist *header_list;
+  struct curl_slist *header_list_tail;
 
-  /* List of mail recipients */
+  /* List of mail recipients, and its last entry to append to. */
   struct curl_slist *mail_recipients_list;
-
-  /* List of connect_to strings */
-  struct curl_slist *connect_to_list;
+  struct curl_slist *mail_recipients_tail;
 
   /* Mime data */
   curl_mime *mime;
   curl_mimepart *part;
 
-  /* Server socket managers. Primarily socket manager 0 is used, but some
-     protocols (FTP) use two sockets. */
-  FUZZ_SOCKET_MANAGER sockman[FUZZ_NUM_CONNECTIONS];
+  /* Server socket managers, one for each connection libcurl opens in turn.
+     Primarily socket manager 0 is used, but some protocols (FTP) and
+     redirects or DoH lookups open more. Only the first num_sockman are in
+     use; more are added as responses or connections need them. */
+  FUZZ_SOCKET_MANAGER sockman[FUZZ_MAX_CONNECTIONS];
+  int num_sockman;
+
+  /* Transfer engine used by fuzz_handle_transfer(). */
+  FUZZ_TRANSFER_ENGINE engine;
+
+  /* Transport used for connections to the fake server. */
+  FUZZ_TRANSPORT transport;
+
+  /* Virtual time mode. Waits for timeouts fast-forward a simulated clock
+     instead of sleeping. */
+  int virtual_time;
+
+  /* Number of runs between full teardowns of recycled handles, or 0 if
+     handles are created and destroyed for every run. */
+  long recycle_interval;
+
+  /* Time the run started, for handle recycling statistics. */
+  struct timespec start_time;
+
+  /* Sockets and timeout requested by libcurl when using the socket engine.
+     The timeout is -1 when libcurl has no timer pending. */
+  FUZZ_CURL_SOCKET curl_sockets[FUZZ_MAX_CURL_SOCKETS];
+  long curl_timeout_ms;
 
   /* Verbose mode. */
   int verbose;
@@ -222,6 +567,12 @@ int fuzz_initialize_fuzz_data(FUZZ_DATA *fuzz,
                               size_t data_len);
 int fuzz_set_easy_options(FUZZ_DATA *fuzz);
 void fuzz_terminate_fuzz_data(FUZZ_DATA *fuzz);
+CURL *fuzz_pool_get_easy(FUZZ_DATA *fuzz);
+CURLM *fuzz_pool_get_multi(FUZZ_DATA *fuzz);
+void fuzz_pool_put_multi(FUZZ_DATA *fuzz, CURLM *multi_handle);
+void fuzz_pool_release(FUZZ_DATA *fuzz);
+void fuzz_pool_thread_exit(void *arg);
+void fuzz_pool_report(void);
 void fuzz_free(void **ptr);
 curl_socket_t fuzz_open_socket(void *ptr,
                                curlsocktype purpose,
@@ -237,22 +588,72 @@ size_t fuzz_write_callback(void *contents,
                            size_t size,
                            size_t nmemb,
                            void *ptr);
-int fuzz_get_first_tlv(FUZZ_DATA *fuzz, TLV *tlv);
-int fuzz_get_next_tlv(FUZZ_DATA *fuzz, TLV *tlv);
-int fuzz_get_tlv_comn(FUZZ_DATA *fuzz, TLV *tlv);
+int fuzz_get_first_tlv(FUZZ_PARSE_STATE *state, TLV *tlv);
+int fuzz_get_next_tlv(FUZZ_PARSE_STATE *state, TLV *tlv);
+int fuzz_get_tlv_comn(FUZZ_PARSE_STATE *state, TLV *tlv);
+FUZZ_REJECT fuzz_validate_input(const uint8_t *data, size_t data_len);
+FUZZ_REJECT fuzz_validate_tlv(FUZZ_VALIDATE_STATE *vstate, TLV *tlv);
+FUZZ_REJECT fuzz_validate_special_tlv(FUZZ_VALIDATE_STATE *vstate, TLV *tlv);
+void fuzz_count_setup_failure(void);
+void fuzz_validate_report(void);
 int fuzz_parse_tlv(FUZZ_DATA *fuzz, TLV *tlv);
+int fuzz_parse_special_tlv(FUZZ_DATA *fuzz, TLV *tlv);
+const FUZZ_TLV_SCHEMA *fuzz_tlv_schema(uint16_t type);
 char *fuzz_tlv_to_string(TLV *tlv);
+void fuzz_slist_append(struct curl_slist **list,
+                       struct curl_slist **tail,
+                       const char *string);
 
 int fuzz_add_mime_part(TLV *src_tlv, curl_mimepart *part);
 int fuzz_parse_mime_tlv(curl_mimepart *part, TLV *tlv);
 int fuzz_handle_transfer(FUZZ_DATA *fuzz);
+int fuzz_handle_transfer_select(FUZZ_DATA *fuzz, CURLM *multi_handle);
+int fuzz_handle_transfer_socket(FUZZ_DATA *fuzz, CURLM *multi_handle);
 int fuzz_send_next_response(FUZZ_DATA *fuzz, FUZZ_SOCKET_MANAGER *sockman);
+int fuzz_send_response(FUZZ_DATA *fuzz, FUZZ_SOCKET_MANAGER *sockman);
+FUZZ_SOCKET_MANAGER *fuzz_get_sockman(FUZZ_DATA *fuzz, int index);
+int fuzz_response_has_trigger(const FUZZ_RESPONSE *rsp);
+int fuzz_match_trigger(FUZZ_SOCKET_MANAGER *sman,
+                       const uint8_t *data,
+                       size_t data_len,
+                       size_t *used);
 int fuzz_select(int nfds,
                 fd_set *readfds,
                 fd_set *writefds,
                 fd_set *exceptfds,
                 struct timeval *timeout);
+int fuzz_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int fuzz_socket_callback(CURL *easy,
+                         curl_socket_t s,
+                         int what,
+                         void *userp,
+                         void *socketp);
+int fuzz_timer_callback(CURLM *multi, long timeout_ms, void *userp);
+curl_socket_t fuzz_sman_open(FUZZ_DATA *fuzz, FUZZ_SOCKET_MANAGER *sman);
+int fuzz_sman_send(FUZZ_SOCKET_MANAGER *sman, int index);
+ssize_t fuzz_sman_read(FUZZ_SOCKET_MANAGER *sman, char *buffer, size_t len);
+int fuzz_sman_readable(FUZZ_SOCKET_MANAGER *sman);
+void fuzz_sman_shutdown(FUZZ_SOCKET_MANAGER *sman);
+void fuzz_sman_close(FUZZ_SOCKET_MANAGER *sman);
+void fuzz_transport_end_run(void);
+int fuzz_sockpair_select_pending(int nfds, fd_set *readfds, fd_set *pending);
+CURLcode fuzz_arena_global_init(long flags);
+void fuzz_arena_begin_run(void);
+void fuzz_arena_end_run(void);
+void fuzz_profile_init(void);
+void fuzz_profile_begin_run(void);
+void fuzz_profile_end_run(void);
+void fuzz_profile_phase(FUZZ_PROFILE_PHASE phase);
+void fuzz_profile_start(FUZZ_PROFILE_PHASE phase);
+void fuzz_profile_stop(FUZZ_PROFILE_PHASE phase);
+void fuzz_profile_count(FUZZ_PROFILE_CALL call);
+void fuzz_profile_curl_times(CURL *easy);
+void fuzz_vclock_set_active(int active);
+int fuzz_vclock_is_active(void);
+void fuzz_vclock_advance(long ms);
+unsigned long fuzz_allowed_protocols(void);
 int fuzz_set_allowed_protocols(FUZZ_DATA *fuzz);
+unsigned long fuzz_url_protocol(const uint8_t *url, size_t url_len);
 
 /* Macros */
 #define FTRY(FUNC)                                                            \
@@ -274,40 +675,37 @@ int fuzz_set_allowed_protocols(FUZZ_DATA *fuzz);
           }                                                                   \
         }
 
-#define FSET_OPTION(FUZZP, OPTNAME, OPTVALUE)                                 \
-        FTRY(curl_easy_setopt((FUZZP)->easy, OPTNAME, OPTVALUE));             \
-        (FUZZP)->options[OPTNAME % 1000] = 1
-
-#define FCHECK_OPTION_UNSET(FUZZP, OPTNAME)                                   \
-        FCHECK((FUZZP)->options[OPTNAME % 1000] == 0)
-
-#define FSINGLETONTLV(FUZZP, TLVNAME, OPTNAME)                                \
-        case TLVNAME:                                                         \
-          FCHECK_OPTION_UNSET(FUZZP, OPTNAME);                                \
-          tmp = fuzz_tlv_to_string(tlv);                                      \
-          FSET_OPTION(FUZZP, OPTNAME, tmp);                                   \
-          break
-
-#define FRESPONSETLV(SMAN, TLVNAME, INDEX)                                    \
-        case TLVNAME:                                                         \
-          (SMAN)->responses[(INDEX)].data = tlv->value;                       \
-          (SMAN)->responses[(INDEX)].data_len = tlv->length;                  \
-          break
-
-#define FU32TLV(FUZZP, TLVNAME, OPTNAME)                                      \
-        case TLVNAME:                                                         \
-          if(tlv->length != 4) {                                              \
-            rc = 255;                                                         \
-            goto EXIT_LABEL;                                                  \
-          }                                                                   \
-          FCHECK_OPTION_UNSET(FUZZP, OPTNAME);                                \
-          tmp_u32 = to_u32(tlv->value);                                       \
-          FSET_OPTION(FUZZP, OPTNAME, tmp_u32);                               \
-          break
+#define FUZZ_TLV_SEEN(FUZZP, TYPE)                                            \
+        ((FUZZP)->tlvs_seen[(TYPE) / 8] & (1 << ((TYPE) % 8)))
+
+#define FSET_TLV_SEEN(FUZZP, TYPE)                                            \
+        (FUZZP)->tlvs_seen[(TYPE) / 8] |= (1 << ((TYPE) % 8))
 
 #define FV_PRINTF(FUZZP, ...)                                                 \
         if((FUZZP)->verbose) {                                                \
           printf(__VA_ARGS__);                                                \
         }
 
+/* Profiling counters, only built with --enable-profile-counters. */
+#ifdef FUZZ_PROFILE
+#define FUZZ_PROFILE_INIT()             fuzz_profile_init()
+#define FUZZ_PROFILE_BEGIN_RUN()        fuzz_profile_begin_run()
+#define FUZZ_PROFILE_END_RUN()          fuzz_profile_end_run()
+#define FUZZ_PROFILE_PHASE(PHASE)       fuzz_profile_phase(PHASE)
+#define FUZZ_PROFILE_START(PHASE)       fuzz_profile_start(PHASE)
+#define FUZZ_PROFILE_STOP(PHASE)        fuzz_profile_stop(PHASE)
+#define FUZZ_PROFILE_COUNT(CALL)        fuzz_profile_count(CALL)
+#define FUZZ_PROFILE_CURL_TIMES(EASY)   fuzz_profile_curl_times(EASY)
+#else
+#define FUZZ_PROFILE_INIT()
+#define FUZZ_PROFILE_BEGIN_RUN()
+#define FUZZ_PROFILE_END_RUN()
+#define FUZZ_PROFILE_PHASE(PHASE)
+#define FUZZ_PROFILE_START(PHASE)
+#define FUZZ_PROFILE_STOP(PHASE)
+#define FUZZ_PROFILE_COUNT(CALL)
+#define FUZZ_PROFILE_CURL_TIMES(EASY)
+#endif
+
 #define FUZZ_MAX(A, B) ((A) > (B) ? (A) : (B))
+#define FUZZ_MIN(A, B) ((A) < (B) ? (A) : (B))
@@ -0,0 +1,363 @@
+/***************************************************************************
+ *                                  _   _ ____  _
+ *  Project                     ___| | | |  _ \| |
+ *                             / __| | | | |_) | |
+ *                            | (__| |_| |  _ <| |___
+ *                             \___|\___/|_| \_\_____|
+ *
+ * Copyright (C) 2017, Max Dymond, <cmeister2@gmail.com>, et al.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution. The terms
+ * are also available at https://curl.haxx.se/docs/copyright.html.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <curl/curl.h>
+#include "curl_fuzzer.h"
+
+/**
+ * Region of memory that libcurl's allocations are carved from during a
+ * fuzzing run. Allocations just move the top of the region up, and the whole
+ * region is reset at the end of the run. Regions are allocated on the heap,
+ * as libcurl may free a block after the thread that made it has exited.
+ */
+typedef struct fuzz_arena
+{
+  uint8_t *base;
+  size_t used;
+
+  /* Most of the region used at once during the current run. */
+  size_t peak;
+
+  /* Number of allocations in the region that haven't been freed, plus one
+     while the thread that owns the region is running. The region can only
+     be reset once the owner's is the only one left, and is freed when this
+     drops to zero. Updated with atomic operations, as another thread may
+     free an allocation. */
+  long live;
+
+  /* Set while a fuzzing run is using the region. */
+  int active;
+
+} FUZZ_ARENA;
+
+/**
+ * Header in front of every allocation made through the arena callbacks,
+ * whether it came from the region or the heap.
+ */
+typedef struct fuzz_arena_block
+{
+  /* Usable size of the allocation. */
+  size_t size;
+
+  /* Region the allocation was made from, or NULL for the heap. */
+  FUZZ_ARENA *arena;
+
+} FUZZ_ARENA_BLOCK;
+
+/**
+ * Arena statistics, summed over all threads and reported at exit. Updated
+ * with atomic operations.
+ */
+typedef struct fuzz_arena_stats
+{
+  unsigned long runs;
+  size_t high_water;
+  unsigned long heap_allocs;
+  uint64_t heap_bytes;
+  unsigned long runs_not_reset;
+
+} FUZZ_ARENA_STATS;
+
+/* Size of each thread's region, or 0 if the arena is turned off. */
+static size_t arena_size;
+
+/* Each thread running fuzzing runs has its own region, or NULL until its
+   first run. */
+static thread_local FUZZ_ARENA *arena;
+
+/* Key whose destructor gives up a thread's region when it exits. */
+static pthread_key_t arena_key;
+
+static FUZZ_ARENA_STATS arena_stats;
+
+/* Round sizes up so every allocation stays suitably aligned. */
+#define FUZZ_ARENA_ALIGN(SIZE) (((SIZE) + 15) & ~(size_t)15)
+
+static FUZZ_ARENA_BLOCK *fuzz_arena_block(void *ptr)
+{
+  return (FUZZ_ARENA_BLOCK *)ptr - 1;
+}
+
+/**
+ * Returns whether a block is the most recent allocation in the current
+ * thread's region, and so can be resized or given back in place.
+ */
+static int fuzz_arena_is_top(FUZZ_ARENA_BLOCK *block)
+{
+  return block->arena != NULL &&
+         block->arena == arena &&
+         (uint8_t *)(block + 1) + FUZZ_ARENA_ALIGN(block->size) ==
+         arena->base + arena->used;
+}
+
+/**
+ * Drops a reference to a region, freeing it once nothing refers to it.
+ */
+static void fuzz_arena_unref(FUZZ_ARENA *region)
+{
+  if(__atomic_sub_fetch(&region->live, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(region->base);
+    free(region);
+  }
+}
+
+/**
+ * Gives up the region of a thread that is exiting. It is freed now, or when
+ * libcurl frees the last allocation still in it.
+ */
+static void fuzz_arena_thread_exit(void *arg)
+{
+  arena = NULL;
+  fuzz_arena_unref((FUZZ_ARENA *)arg);
+}
+
+static void *fuzz_arena_malloc(size_t size)
+{
+  FUZZ_ARENA_BLOCK *block;
+  size_t needed = sizeof(FUZZ_ARENA_BLOCK) + FUZZ_ARENA_ALIGN(size);
+
+  if(needed < size) {
+    return NULL;
+  }
+
+  if(arena != NULL && arena->active && needed <= arena_size - arena->used) {
+    block = (FUZZ_ARENA_BLOCK *)(arena->base + arena->used);
+    arena->used += needed;
+    arena->peak = FUZZ_MAX(arena->peak, arena->used);
+    block->arena = arena;
+    __atomic_fetch_add(&arena->live, 1, __ATOMIC_RELAXED);
+  }
+  else {
+    /* Outside a run, or the region is full. */
+    block = (FUZZ_ARENA_BLOCK *)malloc(sizeof(FUZZ_ARENA_BLOCK) + size);
+    if(block == NULL) {
+      return NULL;
+    }
+    block->arena = NULL;
+
+    if(arena != NULL && arena->active) {
+      __atomic_fetch_add(&arena_stats.heap_allocs, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&arena_stats.heap_bytes, size, __ATOMIC_RELAXED);
+    }
+  }
+
+  block->size = size;
+  return block + 1;
+}
+
+static void fuzz_arena_free(void *ptr)
+{
+  FUZZ_ARENA_BLOCK *block;
+
+  if(ptr == NULL) {
+    return;
+  }
+
+  block = fuzz_arena_block(ptr);
+
+  if(block->arena == NULL) {
+    free(block);
+    return;
+  }
+
+  if(fuzz_arena_is_top(block)) {
+    arena->used = (uint8_t *)block - arena->base;
+  }
+  fuzz_arena_unref(block->arena);
+}
+
+static void *fuzz_arena_realloc(void *ptr, size_t size)
+{
+  FUZZ_ARENA_BLOCK *block;
+  void *new_ptr;
+
+  if(ptr == NULL) {
+    return fuzz_arena_malloc(size);
+  }
+
+  block = fuzz_arena_block(ptr);
+
+  if(size <= block->size) {
+    return ptr;
+  }
+
+  if(fuzz_arena_is_top(block) &&
+     FUZZ_ARENA_ALIGN(size) - FUZZ_ARENA_ALIGN(block->size) <=
+     arena_size - arena->used) {
+    /* Grow the most recent allocation in place. */
+    arena->used += FUZZ_ARENA_ALIGN(size) - FUZZ_ARENA_ALIGN(block->size);
+    arena->peak = FUZZ_MAX(arena->peak, arena->used);
+    block->size = size;
+    return ptr;
+  }
+
+  new_ptr = fuzz_arena_malloc(size);
+  if(new_ptr != NULL) {
+    memcpy(new_ptr, ptr, block->size);
+    fuzz_arena_free(ptr);
+  }
+
+  return new_ptr;
+}
+
+static void *fuzz_arena_calloc(size_t nmemb, size_t size)
+{
+  void *ptr;
+
+  if(size != 0 && nmemb > (size_t)-1 / size) {
+    return NULL;
+  }
+
+  /* Regions are reused, so the memory has to be cleared. */
+  ptr = fuzz_arena_malloc(nmemb * size);
+  if(ptr != NULL) {
+    memset(ptr, 0, nmemb * size);
+  }
+
+  return ptr;
+}
+
+static char *fuzz_arena_strdup(const char *str)
+{
+  size_t len = strlen(str) + 1;
+  char *copy;
+
+  copy = (char *)fuzz_arena_malloc(len);
+  if(copy != NULL) {
+    memcpy(copy, str, len);
+  }
+
+  return copy;
+}
+
+/**
+ * Prints the arena statistics.
+ */
+static void fuzz_arena_report(void)
+{
+  fprintf(stderr,
+          "FUZZ: arena: %lu runs, high-water %zu of %zu KB, %lu allocations "
+          "(%lu KB) from the heap, %lu runs left allocations behind\n",
+          arena_stats.runs,
+          arena_stats.high_water / 1024,
+          arena_size / 1024,
+          arena_stats.heap_allocs,
+          (unsigned long)(arena_stats.heap_bytes / 1024),
+          arena_stats.runs_not_reset);
+}
+
+/**
+ * Initialises libcurl. If FUZZ_ARENA=<N> is set, libcurl's allocations are
+ * made from an N megabyte region per thread during each fuzzing run. Must be
+ * called before anything else uses libcurl.
+ */
+CURLcode fuzz_arena_global_init(long flags)
+{
+  const char *fuzz_str = getenv("FUZZ_ARENA");
+
+  if(fuzz_str == NULL) {
+    return curl_global_init(flags);
+  }
+
+  arena_size = (size_t)FUZZ_MAX(strtol(fuzz_str, NULL, 10), 1) << 20;
+  pthread_key_create(&arena_key, fuzz_arena_thread_exit);
+  atexit(fuzz_arena_report);
+
+  return curl_global_init_mem(flags,
+                              fuzz_arena_malloc,
+                              fuzz_arena_free,
+                              fuzz_arena_realloc,
+                              fuzz_arena_strdup,
+                              fuzz_arena_calloc);
+}
+
+/**
+ * Starts using the current thread's region for libcurl's allocations.
+ */
+void fuzz_arena_begin_run(void)
+{
+  if(arena_size == 0) {
+    return;
+  }
+
+  if(arena == NULL) {
+    arena = (FUZZ_ARENA *)calloc(1, sizeof(FUZZ_ARENA));
+    if(arena == NULL) {
+      return;
+    }
+
+    arena->base = (uint8_t *)malloc(arena_size);
+    if(arena->base == NULL) {
+      free(arena);
+      arena = NULL;
+      return;
+    }
+
+    /* The thread's own reference, dropped when it exits. */
+    arena->live = 1;
+    pthread_setspecific(arena_key, arena);
+  }
+
+  arena->active = 1;
+}
+
+/**
+ * Stops using the current thread's region and resets it. If some of the
+ * run's allocations haven't been freed, the region carries on from where it
+ * is instead, until a later run ends with nothing left in it.
+ */
+void fuzz_arena_end_run(void)
+{
+  size_t high_water;
+
+  if(arena == NULL || !arena->active) {
+    return;
+  }
+
+  arena->active = 0;
+
+  if(__atomic_load_n(&arena->live, __ATOMIC_RELAXED) == 1) {
+    arena->used = 0;
+  }
+  else {
+    __atomic_fetch_add(&arena_stats.runs_not_reset, 1, __ATOMIC_RELAXED);
+  }
+
+  __atomic_fetch_add(&arena_stats.runs, 1, __ATOMIC_RELAXED);
+
+  high_water = __atomic_load_n(&arena_stats.high_water, __ATOMIC_RELAXED);
+  while(arena->peak > high_water &&
+        !__atomic_compare_exchange_n(&arena_stats.high_water,
+                                     &high_water,
+                                     arena->peak,
+                                     0,
+                                     __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED)) {
+    /* Another thread raised the high-water mark; try again. */
+  }
+
+  arena->peak = arena->used;
+}
@@ -20,19 +20,11 @@
  *
  ***************************************************************************/
 
-#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/un.h>
 #include <curl/curl.h>
 #include "curl_fuzzer.h"
 
-/**
- * Define a macro which checks to see that allocated file descriptors are
- * valid and won't cause issue with FD_SETs.  Taken from lib/select.h
- */
-#define FUZZ_VALID_SOCK(s) (((s) >= 0) && ((s) < FD_SETSIZE))
-
 /**
  * Function for providing a socket to CURL already primed with data.
  */
@@ -41,87 +33,52 @@ curl_socket_t fuzz_open_socket(void *ptr,
                                struct curl_sockaddr *address)
 {
   FUZZ_DATA *fuzz = (FUZZ_DATA *)ptr;
-  int fds[2];
-  int flags;
-  int status;
-  const uint8_t *data;
-  size_t data_len;
-  struct sockaddr_un client_addr;
+  curl_socket_t client;
   FUZZ_SOCKET_MANAGER *sman;
+  int ii;
 
   /* Handle unused parameters */
   (void)purpose;
   (void)address;
 
-  if(fuzz->sockman[0].fd_state != FUZZ_SOCK_CLOSED &&
-     fuzz->sockman[1].fd_state != FUZZ_SOCK_CLOSED) {
-    /* Both sockets have already been opened. */
-    return CURL_SOCKET_BAD;
-  }
-  else if(fuzz->sockman[0].fd_state != FUZZ_SOCK_CLOSED) {
-    sman = &fuzz->sockman[1];
+  /* Each connection gets the next socket manager in turn. Connections past
+     the last one with responses still connect, but are shut down straight
+     away. */
+  for(ii = 0; ii < fuzz->num_sockman; ii++) {
+    if(fuzz->sockman[ii].fd_state == FUZZ_SOCK_CLOSED) {
+      break;
+    }
   }
-  else {
-    FV_PRINTF(fuzz, "FUZZ: Using socket manager 0 \n");
-    sman = &fuzz->sockman[0];
+
+  sman = fuzz_get_sockman(fuzz, ii);
+  if(sman == NULL) {
+    /* All of the connections have already been opened. */
+    return CURL_SOCKET_BAD;
   }
   FV_PRINTF(fuzz, "FUZZ[%d]: Using socket manager %d \n",
             sman->index,
             sman->index);
 
-  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
-    /* Failed to create a pair of sockets. */
+  client = fuzz_sman_open(fuzz, sman);
+  if(client == CURL_SOCKET_BAD) {
     return CURL_SOCKET_BAD;
   }
 
-  if(!FUZZ_VALID_SOCK(fds[0]) || !FUZZ_VALID_SOCK(fds[1])) {
-    /* One or more of the file descriptors is too large to fit in an fd_set,
-       so reject it here. Print out a message because this ought to be quite
-       rare. */
-    printf("FUZZ[%d]: Not using file descriptors %d,%d as FD_SETSIZE is %d\n",
-           sman->index,
-           fds[0],
-           fds[1],
-           FD_SETSIZE);
-
-    /* Close the file descriptors so they don't leak. */
-    close(fds[0]);
-    close(fds[1]);
-
-    return CURL_SOCKET_BAD;
-  }
-
-  /* Make the server non-blocking. */
-  flags = fcntl(fds[0], F_GETFL, 0);
-  status = fcntl(fds[0], F_SETFL, flags | O_NONBLOCK);
-
-  if(status == -1) {
-    /* Close the file descriptors so they don't leak. */
-    close(fds[0]);
-    close(fds[1]);
-
-    /* Setting non-blocking failed. Return a negative response code. */
-    return CURL_SOCKET_BAD;
-  }
-
-  /* At this point, the file descriptors in hand should be good enough to
-     work with. */
-  sman->fd = fds[0];
+  /* At this point, the connection in hand should be good enough to work
+     with. */
   sman->fd_state = FUZZ_SOCK_OPEN;
 
   /* If the server should be sending data immediately, send it here. */
-  data = sman->responses[0].data;
-  data_len = sman->responses[0].data_len;
-
-  if(data != NULL) {
+  if(sman->responses[0].data != NULL) {
     FV_PRINTF(fuzz, "FUZZ[%d]: Sending initial response \n", sman->index);
 
-    if(write(sman->fd, data, data_len) != (ssize_t)data_len) {
-      /* Close the file descriptors so they don't leak. */
-      close(sman->fd);
+    if(fuzz_sman_send(sman, 0) != 0) {
+      /* Close the connection so it doesn't leak. */
+      fuzz_sman_close(sman);
       sman->fd = -1;
+      sman->fd_state = FUZZ_SOCK_CLOSED;
 
-      close(fds[1]);
+      close(client);
 
       /* Failed to write all of the response data. */
       return CURL_SOCKET_BAD;
@@ -134,12 +91,12 @@ curl_socket_t fuzz_open_socket(void *ptr,
               "FUZZ[%d]: Shutting down server socket: %d \n",
               sman->index,
               sman->fd);
-    shutdown(sman->fd, SHUT_WR);
+    fuzz_sman_shutdown(sman);
     sman->fd_state = FUZZ_SOCK_SHUTDOWN;
   }
 
-  /* Return the other half of the socket pair. */
-  return fds[1];
+  /* Return the client end of the connection. */
+  return client;
 }
 
 /**
@@ -224,3 +181,71 @@ size_t fuzz_write_callback(void *contents,
 
   return total;
 }
+
+/**
+ * Callback function for the socket engine. libcurl tells us which sockets it
+ * wants watched and for which events.
+ */
+int fuzz_socket_callback(CURL *easy,
+                         curl_socket_t s,
+                         int what,
+                         void *userp,
+                         void *socketp)
+{
+  FUZZ_DATA *fuzz = (FUZZ_DATA *)userp;
+  FUZZ_CURL_SOCKET *free_slot = NULL;
+  int ii;
+
+  (void)easy;
+  (void)socketp;
+
+  for(ii = 0; ii < FUZZ_MAX_CURL_SOCKETS; ii++) {
+    if(fuzz->curl_sockets[ii].fd == s) {
+      if(what == CURL_POLL_REMOVE) {
+        /* libcurl is no longer interested in this socket. */
+        fuzz->curl_sockets[ii].fd = CURL_SOCKET_BAD;
+      }
+      else {
+        fuzz->curl_sockets[ii].what = what;
+      }
+      return 0;
+    }
+    else if(free_slot == NULL &&
+            fuzz->curl_sockets[ii].fd == CURL_SOCKET_BAD) {
+      free_slot = &fuzz->curl_sockets[ii];
+    }
+  }
+
+  if(what == CURL_POLL_REMOVE) {
+    /* Not a socket we know about. */
+    return 0;
+  }
+
+  if(free_slot == NULL) {
+    /* Too many sockets to watch. This ought to be quite rare. */
+    printf("FUZZ: Not watching socket %d as %d sockets are watched\n",
+           s,
+           FUZZ_MAX_CURL_SOCKETS);
+    return -1;
+  }
+
+  free_slot->fd = s;
+  free_slot->what = what;
+
+  return 0;
+}
+
+/**
+ * Callback function for the socket engine. libcurl tells us when it next
+ * needs to be called to handle timeouts, or -1 to delete the timer.
+ */
+int fuzz_timer_callback(CURLM *multi, long timeout_ms, void *userp)
+{
+  FUZZ_DATA *fuzz = (FUZZ_DATA *)userp;
+
+  (void)multi;
+
+  fuzz->curl_timeout_ms = timeout_ms;
+
+  return 0;
+}
@@ -0,0 +1,109 @@
+/***************************************************************************
+ *                                  _   _ ____  _
+ *  Project                     ___| | | |  _ \| |
+ *                             / __| | | | |_) | |
+ *                            | (__| |_| |  _ <| |___
+ *                             \___|\___/|_| \_\_____|
+ *
+ * Copyright (C) 2017, Max Dymond, <cmeister2@gmail.com>, et al.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution. The terms
+ * are also available at https://curl.haxx.se/docs/copyright.html.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+
+#include <dlfcn.h>
+#include <time.h>
+#include <curl/curl.h>
+#include "curl_fuzzer.h"
+
+#ifndef __THROW
+#define __THROW
+#endif
+
+/**
+ * Virtual clock state. While a fuzzing run with virtual time is in progress,
+ * CLOCK_MONOTONIC readings are moved forward by offset_ns. The offset only
+ * ever grows, so libcurl always sees time moving forwards.
+ */
+typedef struct fuzz_vclock
+{
+  /* Set while a fuzzing run with virtual time is in progress. */
+  int active;
+
+  /* How far the virtual clock is ahead of the real clock. */
+  uint64_t offset_ns;
+
+} FUZZ_VCLOCK;
+
+/* Each thread running fuzzing runs has its own virtual clock. */
+static thread_local FUZZ_VCLOCK vclock;
+
+typedef int (*clock_gettime_func)(clockid_t, struct timespec *);
+
+/**
+ * Turn the virtual clock on or off for the current fuzzing run.
+ */
+void fuzz_vclock_set_active(int active)
+{
+  vclock.active = active;
+}
+
+/**
+ * Returns whether the virtual clock is in use for the current fuzzing run.
+ */
+int fuzz_vclock_is_active(void)
+{
+  return vclock.active;
+}
+
+/**
+ * Moves the virtual clock forward by a number of milliseconds.
+ */
+void fuzz_vclock_advance(long ms)
+{
+  if(ms > 0) {
+    vclock.offset_ns += (uint64_t)ms * 1000000;
+  }
+}
+
+/**
+ * Interposes clock_gettime() so that libcurl reads the virtual clock. Only
+ * the monotonic clocks libcurl uses for its timers are moved forward.
+ */
+extern "C" int clock_gettime(clockid_t clk_id, struct timespec *tp) __THROW
+{
+  static clock_gettime_func real_clock_gettime = NULL;
+  clock_gettime_func real_func;
+  uint64_t nsec;
+  int rc;
+
+  real_func = __atomic_load_n(&real_clock_gettime, __ATOMIC_RELAXED);
+  if(real_func == NULL) {
+    real_func = (clock_gettime_func)dlsym(RTLD_NEXT, "clock_gettime");
+    __atomic_store_n(&real_clock_gettime, real_func, __ATOMIC_RELAXED);
+  }
+
+  rc = real_func(clk_id, tp);
+
+  if(rc == 0 && vclock.active && vclock.offset_ns != 0 &&
+     (clk_id == CLOCK_MONOTONIC
+#ifdef CLOCK_MONOTONIC_RAW
+      || clk_id == CLOCK_MONOTONIC_RAW
+#endif
+     )) {
+    nsec = (uint64_t)tp->tv_nsec + vclock.offset_ns;
+    tp->tv_sec += (time_t)(nsec / 1000000000);
+    tp->tv_nsec = (long)(nsec % 1000000000);
+  }
+
+  return rc;
+}
@@ -0,0 +1,751 @@
+/***************************************************************************
+ *                                  _   _ ____  _
+ *  Project                     ___| | | |  _ \| |
+ *                             / __| | | | |_) | |
+ *                            | (__| |_| |  _ <| |___
+ *                             \___|\___/|_| \_\_____|
+ *
+ * Copyright (C) 2017, Max Dymond, <cmeister2@gmail.com>, et al.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution. The terms
+ * are also available at https://curl.haxx.se/docs/copyright.html.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+
+/**
+ * Corpus inspector. Walks every input in the given files and directories
+ * with the fuzzer's own TLV parser and validation, on several threads, and
+ * prints statistics about the TLVs in them.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <curl/curl.h>
+#include "curl_fuzzer.h"
+
+/* Input sizes are counted in buckets that double in size. */
+#define INSPECT_SIZE_BUCKETS  33
+
+/**
+ * Statistics for one TLV type.
+ */
+typedef struct inspect_type_stats
+{
+  unsigned long count;
+  unsigned long inputs;
+  uint64_t bytes;
+  uint32_t min_len;
+  uint32_t max_len;
+
+} INSPECT_TYPE_STATS;
+
+/**
+ * Statistics for a set of inputs. Each thread keeps its own, and they are
+ * added together at the end.
+ */
+typedef struct inspect_stats
+{
+  unsigned long inputs;
+  uint64_t bytes;
+  unsigned long tlvs;
+  unsigned long read_errors;
+  unsigned long rejected[FUZZ_NUM_REJECTS];
+  unsigned long sizes[INSPECT_SIZE_BUCKETS];
+
+  /* Indexed by TLV type. Unknown types are counted at 0. */
+  INSPECT_TYPE_STATS types[FUZZ_NUM_TLV_TYPES + 1];
+
+} INSPECT_STATS;
+
+/**
+ * An inspector thread.
+ */
+typedef struct inspect_worker
+{
+  pthread_t thread;
+  INSPECT_STATS stats;
+
+  /* Hash of every input, for finding duplicates. */
+  uint64_t *hashes;
+  size_t num_hashes;
+  size_t hashes_size;
+
+  /* Buffer inputs are read into, and a line of the dump being built. */
+  uint8_t *buffer;
+  size_t buffer_size;
+  char *line;
+  size_t line_len;
+  size_t line_size;
+
+} INSPECT_WORKER;
+
+/**
+ * Everything the threads share.
+ */
+typedef struct inspect_shared
+{
+  /* Inputs to inspect. Each thread claims the next one by atomically
+     incrementing next_path. */
+  char **paths;
+  size_t num_paths;
+  size_t paths_size;
+  size_t next_path;
+
+  /* JSON-lines dump of every input, or NULL. */
+  FILE *dump;
+  pthread_mutex_t dump_lock;
+
+  /* Print each rejected input. */
+  int list_rejected;
+
+} INSPECT_SHARED;
+
+static INSPECT_SHARED inspect;
+
+/* Names of the TLV types, indexed by type. */
+static const char *const tlv_names[FUZZ_NUM_TLV_TYPES + 1] = {
+  "UNKNOWN",
+#define FUZZ_TLV(NAME, TYPE, KIND, OPTION, PROTOCOLS, CONN, RESPONSE, PYNAME, \
+                 DESC)                                                        \
+  #NAME,
+#include "curl_fuzzer_tlv.def"
+#undef FUZZ_TLV
+};
+
+/* Descriptions of each reason for rejecting an input. */
+static const char *const reject_names[FUZZ_NUM_REJECTS] = {
+  "ok",
+  "truncated",
+  "unknown TLV",
+  "duplicate TLV",
+  "bad TLV value",
+  "wrong protocol",
+  "refused by libcurl"
+};
+
+/**
+ * Grow a buffer to hold at least "needed" bytes. Returns 0 on success.
+ */
+static int inspect_reserve(void **buf, size_t *size, size_t needed)
+{
+  void *new_buf;
+  size_t new_size = *size ? *size : 4096;
+
+  if(needed <= *size) {
+    return 0;
+  }
+
+  while(new_size < needed) {
+    new_size *= 2;
+  }
+
+  new_buf = realloc(*buf, new_size);
+  if(new_buf == NULL) {
+    return 1;
+  }
+
+  *buf = new_buf;
+  *size = new_size;
+
+  return 0;
+}
+
+/**
+ * Add some text to the dump line being built.
+ */
+static void inspect_append(INSPECT_WORKER *worker,
+                           const char *text,
+                           size_t text_len)
+{
+  if(inspect_reserve((void **)&worker->line,
+                     &worker->line_size,
+                     worker->line_len + text_len + 1) != 0) {
+    return;
+  }
+
+  memcpy(&worker->line[worker->line_len], text, text_len);
+  worker->line_len += text_len;
+}
+
+/**
+ * Add a printf-style formatted string to the dump line being built.
+ */
+static void inspect_appendf(INSPECT_WORKER *worker, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+static void inspect_appendf(INSPECT_WORKER *worker, const char *fmt, ...)
+{
+  char text[256];
+  va_list args;
+  int len;
+
+  va_start(args, fmt);
+  len = vsnprintf(text, sizeof(text), fmt, args);
+  va_end(args);
+
+  if(len > 0) {
+    inspect_append(worker, text, FUZZ_MIN((size_t)len, sizeof(text) - 1));
+  }
+}
+
+/**
+ * Add bytes to the dump line as a JSON string. Each byte becomes the
+ * character with the same code, so the bytes can be recovered exactly.
+ */
+static void inspect_append_string(INSPECT_WORKER *worker,
+                                  const uint8_t *data,
+                                  size_t data_len)
+{
+  char escape[8];
+  size_t start = 0;
+  size_t ii;
+
+  inspect_append(worker, "\"", 1);
+
+  for(ii = 0; ii < data_len; ii++) {
+    if(data[ii] >= 0x20 && data[ii] < 0x7f &&
+       data[ii] != '"' && data[ii] != '\\') {
+      continue;
+    }
+
+    /* Copy the run of plain characters, then the escaped one. */
+    inspect_append(worker, (const char *)&data[start], ii - start);
+    snprintf(escape, sizeof(escape), "\\u%04x", data[ii]);
+    inspect_append(worker, escape, 6);
+    start = ii + 1;
+  }
+
+  inspect_append(worker, (const char *)&data[start], data_len - start);
+  inspect_append(worker, "\"", 1);
+}
+
+/**
+ * 64-bit FNV-1a hash of an input.
+ */
+static uint64_t inspect_hash(const uint8_t *data, size_t data_len)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t ii;
+
+  for(ii = 0; ii < data_len; ii++) {
+    hash = (hash ^ data[ii]) * 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+/**
+ * Read a whole file into the worker's buffer. Returns 0 on success.
+ */
+static int inspect_read(INSPECT_WORKER *worker,
+                        const char *path,
+                        size_t *data_len)
+{
+  struct stat st;
+  ssize_t got;
+  size_t pos = 0;
+  int fd;
+  int rc = 1;
+
+  fd = open(path, O_RDONLY);
+  if(fd == -1) {
+    return 1;
+  }
+
+  if(fstat(fd, &st) == 0 &&
+     inspect_reserve((void **)&worker->buffer,
+                     &worker->buffer_size,
+                     st.st_size + 1) == 0) {
+    while(pos < (size_t)st.st_size &&
+          (got = read(fd, &worker->buffer[pos], st.st_size - pos)) > 0) {
+      pos += got;
+    }
+
+    if(pos == (size_t)st.st_size) {
+      *data_len = pos;
+      rc = 0;
+    }
+  }
+
+  close(fd);
+
+  return rc;
+}
+
+/**
+ * Inspect one input, adding it to the worker's statistics and the dump.
+ */
+static void inspect_input(INSPECT_WORKER *worker,
+                          const char *path,
+                          const uint8_t *data,
+                          size_t data_len)
+{
+  INSPECT_STATS *stats = &worker->stats;
+  INSPECT_TYPE_STATS *type_stats;
+  FUZZ_VALIDATE_STATE vstate;
+  FUZZ_PARSE_STATE state;
+  FUZZ_REJECT reason = FUZZ_REJECT_NONE;
+  size_t reject_offset = 0;
+  unsigned char types_seen[FUZZ_NUM_TLV_TYPES + 1];
+  int num_tlvs = 0;
+  int bucket = 0;
+  size_t size;
+  TLV tlv;
+  int tlv_rc = TLV_RC_SIZE_ERROR;
+
+  memset(&vstate, 0, sizeof(FUZZ_VALIDATE_STATE));
+  vstate.allowed_protocols = fuzz_allowed_protocols();
+
+  memset(&state, 0, sizeof(FUZZ_PARSE_STATE));
+  state.data = data;
+  state.data_len = data_len;
+
+  memset(types_seen, 0, sizeof(types_seen));
+
+  stats->inputs++;
+  stats->bytes += data_len;
+  for(size = data_len; size > 0; size >>= 1) {
+    bucket++;
+  }
+  stats->sizes[bucket]++;
+
+  if(inspect.dump != NULL) {
+    worker->line_len = 0;
+    inspect_append(worker, "{\"path\": ", 9);
+    inspect_append_string(worker, (const uint8_t *)path, strlen(path));
+    inspect_appendf(worker, ", \"size\": %zu, \"tlvs\": [", data_len);
+  }
+
+  /* The harness doesn't run inputs too short for a single TLV. */
+  if(data_len >= sizeof(TLV_RAW)) {
+    tlv_rc = fuzz_get_first_tlv(&state, &tlv);
+  }
+
+  for(; tlv_rc == 0; tlv_rc = fuzz_get_next_tlv(&state, &tlv)) {
+    type_stats = &stats->types[fuzz_tlv_schema(tlv.type) ? tlv.type : 0];
+    if(type_stats->count == 0 || tlv.length < type_stats->min_len) {
+      type_stats->min_len = tlv.length;
+    }
+    type_stats->max_len = FUZZ_MAX(type_stats->max_len, tlv.length);
+    type_stats->count++;
+    type_stats->bytes += tlv.length;
+    if(!types_seen[type_stats - stats->types]) {
+      types_seen[type_stats - stats->types] = 1;
+      type_stats->inputs++;
+    }
+    stats->tlvs++;
+
+    if(inspect.dump != NULL) {
+      inspect_appendf(worker,
+                      "%s{\"offset\": %zu, \"type\": %u, \"name\": \"%s\", "
+                      "\"length\": %u, \"value\": ",
+                      num_tlvs ? ", " : "",
+                      state.data_pos,
+                      tlv.type,
+                      tlv_names[type_stats - stats->types],
+                      tlv.length);
+      inspect_append_string(worker, tlv.value, tlv.length);
+      inspect_append(worker, "}", 1);
+    }
+    num_tlvs++;
+
+    /* Carry on decoding after a bad TLV, but only report the first. */
+    if(reason == FUZZ_REJECT_NONE) {
+      reason = fuzz_validate_tlv(&vstate, &tlv);
+      reject_offset = state.data_pos;
+    }
+  }
+
+  if(tlv_rc != TLV_RC_NO_MORE_TLVS && reason == FUZZ_REJECT_NONE) {
+    reason = FUZZ_REJECT_SIZE;
+    reject_offset = state.data_pos;
+  }
+
+  stats->rejected[reason]++;
+
+  if(reason != FUZZ_REJECT_NONE && inspect.list_rejected) {
+    printf("%s: %s at offset %zu\n",
+           path,
+           reject_names[reason],
+           reject_offset);
+  }
+
+  if(inspect.dump != NULL) {
+    inspect_appendf(worker, "], \"status\": \"%s\"", reject_names[reason]);
+    if(reason != FUZZ_REJECT_NONE) {
+      inspect_appendf(worker, ", \"reject_offset\": %zu", reject_offset);
+    }
+    inspect_append(worker, "}\n", 2);
+
+    pthread_mutex_lock(&inspect.dump_lock);
+    fwrite(worker->line, 1, worker->line_len, inspect.dump);
+    pthread_mutex_unlock(&inspect.dump_lock);
+  }
+
+  if(inspect_reserve((void **)&worker->hashes,
+                     &worker->hashes_size,
+                     (worker->num_hashes + 1) * sizeof(uint64_t)) == 0) {
+    worker->hashes[worker->num_hashes++] = inspect_hash(data, data_len);
+  }
+}
+
+/**
+ * Body of an inspector thread: keep taking inputs until there are none
+ * left.
+ */
+static void *inspect_thread(void *arg)
+{
+  INSPECT_WORKER *worker = (INSPECT_WORKER *)arg;
+  size_t index;
+  size_t data_len;
+
+  for(;;) {
+    index = __atomic_fetch_add(&inspect.next_path, 1, __ATOMIC_RELAXED);
+    if(index >= inspect.num_paths) {
+      break;
+    }
+
+    if(inspect_read(worker, inspect.paths[index], &data_len) != 0) {
+      fprintf(stderr, "[%s] Read failed. \n", inspect.paths[index]);
+      worker->stats.read_errors++;
+      continue;
+    }
+
+    inspect_input(worker, inspect.paths[index], worker->buffer, data_len);
+  }
+
+  return NULL;
+}
+
+/**
+ * Add a file, or every file under a directory, to the inputs to inspect.
+ * Returns 0 on success.
+ */
+static int inspect_add_path(const char *path)
+{
+  struct dirent *entry;
+  struct stat st;
+  char *child;
+  DIR *dir;
+  int rc = 0;
+
+  if(stat(path, &st) != 0) {
+    fprintf(stderr, "[%s] Open failed. \n", path);
+    return 1;
+  }
+
+  if(!S_ISDIR(st.st_mode)) {
+    if(inspect_reserve((void **)&inspect.paths,
+                       &inspect.paths_size,
+                       (inspect.num_paths + 1) * sizeof(char *)) != 0) {
+      return 1;
+    }
+    inspect.paths[inspect.num_paths] = strdup(path);
+    if(inspect.paths[inspect.num_paths] == NULL) {
+      return 1;
+    }
+    inspect.num_paths++;
+    return 0;
+  }
+
+  dir = opendir(path);
+  if(dir == NULL) {
+    fprintf(stderr, "[%s] Open failed. \n", path);
+    return 1;
+  }
+
+  while(rc == 0 && (entry = readdir(dir)) != NULL) {
+    if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+
+    child = (char *)malloc(strlen(path) + strlen(entry->d_name) + 2);
+    if(child == NULL) {
+      rc = 1;
+      break;
+    }
+    sprintf(child, "%s/%s", path, entry->d_name);
+    rc = inspect_add_path(child);
+    free(child);
+  }
+
+  closedir(dir);
+
+  return rc;
+}
+
+/**
+ * Add one thread's statistics to the totals.
+ */
+static void inspect_merge(INSPECT_STATS *total, const INSPECT_STATS *stats)
+{
+  const INSPECT_TYPE_STATS *from;
+  INSPECT_TYPE_STATS *to;
+  int ii;
+
+  total->inputs += stats->inputs;
+  total->bytes += stats->bytes;
+  total->tlvs += stats->tlvs;
+  total->read_errors += stats->read_errors;
+
+  for(ii = 0; ii < FUZZ_NUM_REJECTS; ii++) {
+    total->rejected[ii] += stats->rejected[ii];
+  }
+
+  for(ii = 0; ii < INSPECT_SIZE_BUCKETS; ii++) {
+    total->sizes[ii] += stats->sizes[ii];
+  }
+
+  for(ii = 0; ii <= FUZZ_NUM_TLV_TYPES; ii++) {
+    from = &stats->types[ii];
+    to = &total->types[ii];
+
+    if(from->count == 0) {
+      continue;
+    }
+
+    if(to->count == 0 || from->min_len < to->min_len) {
+      to->min_len = from->min_len;
+    }
+    to->max_len = FUZZ_MAX(to->max_len, from->max_len);
+    to->count += from->count;
+    to->inputs += from->inputs;
+    to->bytes += from->bytes;
+  }
+}
+
+static int compare_hashes(const void *a, const void *b)
+{
+  uint64_t hash_a = *(const uint64_t *)a;
+  uint64_t hash_b = *(const uint64_t *)b;
+
+  return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+/**
+ * Print the statistics for all of the inputs.
+ */
+static void inspect_report(const INSPECT_STATS *stats,
+                           unsigned long duplicates,
+                           unsigned long duplicate_groups)
+{
+  const INSPECT_TYPE_STATS *type_stats;
+  unsigned long max_count = 0;
+  int min_bucket = INSPECT_SIZE_BUCKETS;
+  int max_bucket = 0;
+  int ii;
+
+  printf("Inputs: %lu (%llu bytes), %lu TLVs, %lu valid, %lu unreadable\n",
+         stats->inputs,
+         (unsigned long long)stats->bytes,
+         stats->tlvs,
+         stats->rejected[FUZZ_REJECT_NONE],
+         stats->read_errors);
+
+  printf("Rejected:");
+  for(ii = FUZZ_REJECT_SIZE; ii < FUZZ_NUM_REJECTS; ii++) {
+    printf("%s %lu %s", ii == FUZZ_REJECT_SIZE ? "" : ",",
+           stats->rejected[ii],
+           reject_names[ii]);
+  }
+  printf("\n");
+
+  printf("Duplicates: %lu inputs are copies of another, in %lu groups\n",
+         duplicates,
+         duplicate_groups);
+
+  for(ii = 0; ii < INSPECT_SIZE_BUCKETS; ii++) {
+    if(stats->sizes[ii] > 0) {
+      min_bucket = FUZZ_MIN(min_bucket, ii);
+      max_bucket = FUZZ_MAX(max_bucket, ii);
+      max_count = FUZZ_MAX(max_count, stats->sizes[ii]);
+    }
+  }
+
+  printf("Input sizes:\n");
+  for(ii = min_bucket; ii <= max_bucket; ii++) {
+    printf("  %10llu - %10llu bytes %8lu |%.*s\n",
+           ii ? (1ULL << (ii - 1)) : 0ULL,
+           ii ? (1ULL << ii) - 1 : 0ULL,
+           stats->sizes[ii],
+           (int)(stats->sizes[ii] * 40 / max_count),
+           "########################################");
+  }
+
+  printf("TLV types:\n");
+  printf("  %4s %-20s %8s %8s %10s %8s %10s %8s\n",
+         "type", "name", "count", "inputs", "bytes", "min", "mean", "max");
+  for(ii = 0; ii <= FUZZ_NUM_TLV_TYPES; ii++) {
+    type_stats = &stats->types[ii];
+    if(type_stats->count == 0) {
+      continue;
+    }
+
+    printf("  %4d %-20s %8lu %8lu %10llu %8u %10.1f %8u\n",
+           ii,
+           tlv_names[ii],
+           type_stats->count,
+           type_stats->inputs,
+           (unsigned long long)type_stats->bytes,
+           type_stats->min_len,
+           (double)type_stats->bytes / type_stats->count,
+           type_stats->max_len);
+  }
+}
+
+/**
+ * Main procedure for the corpus inspector.
+ *
+ * Usage: curl_fuzzer_inspect [-j N] [-o FILE] [-r] <file or directory>...
+ *   -j N     inspect inputs on N threads (default: one per CPU)
+ *   -o FILE  write every input's TLVs to FILE as JSON lines
+ *   -r       print each rejected input, with the reason and offset
+ *
+ * Inputs are checked against every protocol. The exit status is non-zero if
+ * any input would be rejected by the fuzzer or couldn't be read.
+ */
+int main(int argc, char **argv)
+{
+  INSPECT_WORKER *workers;
+  INSPECT_STATS *total;
+  uint64_t *hashes;
+  size_t num_hashes = 0;
+  unsigned long duplicates = 0;
+  unsigned long duplicate_groups = 0;
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *dump_path = NULL;
+  size_t ii;
+  int first = 1;
+  int rc = 0;
+
+  while(first < argc && argv[first][0] == '-') {
+    if(strcmp(argv[first], "-j") == 0 && first + 1 < argc) {
+      num_threads = atol(argv[++first]);
+    }
+    else if(strcmp(argv[first], "-o") == 0 && first + 1 < argc) {
+      dump_path = argv[++first];
+    }
+    else if(strcmp(argv[first], "-r") == 0) {
+      inspect.list_rejected = 1;
+    }
+    else {
+      fprintf(stderr, "Unknown option %s \n", argv[first]);
+      return 1;
+    }
+    first++;
+  }
+
+  if(first == argc) {
+    fprintf(stderr,
+            "Usage: %s [-j N] [-o FILE] [-r] <file or directory>...\n",
+            argv[0]);
+    return 1;
+  }
+
+  num_threads = FUZZ_MAX(num_threads, 1);
+
+  for(; first < argc; first++) {
+    if(inspect_add_path(argv[first]) != 0) {
+      return 1;
+    }
+  }
+
+  if(dump_path != NULL) {
+    inspect.dump = fopen(dump_path, "w");
+    if(inspect.dump == NULL) {
+      fprintf(stderr, "[%s] Failed to open for writing. \n", dump_path);
+      return 1;
+    }
+  }
+  pthread_mutex_init(&inspect.dump_lock, NULL);
+
+  workers = (INSPECT_WORKER *)calloc(num_threads, sizeof(INSPECT_WORKER));
+  total = (INSPECT_STATS *)calloc(1, sizeof(INSPECT_STATS));
+  if(workers == NULL || total == NULL) {
+    fprintf(stderr, "Failed to allocate %ld workers \n", num_threads);
+    return 1;
+  }
+
+  for(ii = 0; ii < (size_t)num_threads; ii++) {
+    if(pthread_create(&workers[ii].thread,
+                      NULL,
+                      inspect_thread,
+                      &workers[ii]) != 0) {
+      fprintf(stderr, "Failed to start thread %zu \n", ii);
+      num_threads = ii;
+      rc = 1;
+      break;
+    }
+  }
+
+  for(ii = 0; ii < (size_t)num_threads; ii++) {
+    pthread_join(workers[ii].thread, NULL);
+    inspect_merge(total, &workers[ii].stats);
+    num_hashes += workers[ii].num_hashes;
+  }
+
+  if(inspect.dump != NULL) {
+    fclose(inspect.dump);
+  }
+
+  /* Count the inputs whose contents have been seen before. */
+  hashes = (uint64_t *)malloc(FUZZ_MAX(num_hashes, 1) * sizeof(uint64_t));
+  if(hashes != NULL) {
+    num_hashes = 0;
+    for(ii = 0; ii < (size_t)num_threads; ii++) {
+      memcpy(&hashes[num_hashes],
+             workers[ii].hashes,
+             workers[ii].num_hashes * sizeof(uint64_t));
+      num_hashes += workers[ii].num_hashes;
+    }
+
+    qsort(hashes, num_hashes, sizeof(uint64_t), compare_hashes);
+
+    for(ii = 1; ii < num_hashes; ii++) {
+      if(hashes[ii] == hashes[ii - 1]) {
+        duplicates++;
+        if(ii == 1 || hashes[ii - 1] != hashes[ii - 2]) {
+          duplicate_groups++;
+        }
+      }
+    }
+    free(hashes);
+  }
+
+  inspect_report(total, duplicates, duplicate_groups);
+
+  if(total->rejected[FUZZ_REJECT_NONE] != total->inputs ||
+     total->read_errors > 0) {
+    rc = 1;
+  }
+
+  for(ii = 0; ii < (size_t)num_threads; ii++) {
+    free(workers[ii].hashes);
+    free(workers[ii].buffer);
+    free(workers[ii].line);
+  }
+  free(workers);
+  free(total);
+
+  for(ii = 0; ii < inspect.num_paths; ii++) {
+    free(inspect.paths[ii]);
+  }
+  free(inspect.paths);
+
+  return rc;
+}
@@ -0,0 +1,1232 @@
+/***************************************************************************
+ *                                  _   _ ____  _
+ *  Project                     ___| | | |  _ \| |
+ *                             / __| | | | |_) | |
+ *                            | (__| |_| |  _ <| |___
+ *                             \___|\___/|_| \_\_____|
+ *
+ * Copyright (C) 2017, Max Dymond, <cmeister2@gmail.com>, et al.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution. The terms
+ * are also available at https://curl.haxx.se/docs/copyright.html.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <curl/curl.h>
+#include "curl_fuzzer.h"
+
+/* libFuzzer's own byte-level mutator. Only there when linked with
+   libFuzzer. */
+extern "C" size_t LLVMFuzzerMutate(uint8_t *data, size_t size, size_t max_size)
+  __attribute__((weak));
+
+/* Most mutations applied to an input in one go. */
+#define FUZZ_MUT_MAX_STACK      4
+
+/* Most tries at finding a mutation that fits in the space given. */
+#define FUZZ_MUT_MAX_TRIES      16
+
+/**
+ * A TLV in an input being mutated. The value points into the copy of the
+ * input, or into the space for new values.
+ */
+typedef struct fuzz_mut_tlv
+{
+  uint16_t type;
+  uint32_t length;
+  const uint8_t *value;
+
+} FUZZ_MUT_TLV;
+
+/**
+ * List of the TLVs in an input.
+ */
+typedef struct fuzz_mut_list
+{
+  FUZZ_MUT_TLV *tlvs;
+  size_t num;
+  size_t size;
+
+} FUZZ_MUT_LIST;
+
+/**
+ * Mutator state. The buffers are kept between calls so that they only need
+ * to grow when a bigger input turns up.
+ */
+typedef struct fuzz_mutator
+{
+  uint32_t rand_state;
+
+  /* Largest output allowed for this call. */
+  size_t max_size;
+
+  /* Copy of the input, as the output is written over it. */
+  uint8_t *source;
+  size_t source_size;
+
+  /* Space for new and mutated TLV values, handed out from the bottom. */
+  uint8_t *values;
+  size_t values_size;
+  size_t values_used;
+
+  /* The TLVs in the input, and in a MIME part being mutated. */
+  FUZZ_MUT_LIST list;
+  FUZZ_MUT_LIST part_list;
+
+  /* The TLVs in the two inputs being crossed over. */
+  FUZZ_MUT_LIST cross_lists[2];
+
+} FUZZ_MUTATOR;
+
+/**
+ * 32-bit values that mean something for a U32 option.
+ */
+typedef struct fuzz_mut_u32_values
+{
+  uint16_t type;
+  const uint32_t *values;
+  size_t num_values;
+
+} FUZZ_MUT_U32_VALUES;
+
+static const uint32_t mut_httpauth_values[] = {
+  CURLAUTH_NONE,
+  CURLAUTH_BASIC,
+  CURLAUTH_DIGEST,
+  CURLAUTH_NEGOTIATE,
+  CURLAUTH_NTLM,
+  CURLAUTH_DIGEST_IE,
+  CURLAUTH_NTLM_WB,
+#ifdef CURLAUTH_BEARER
+  CURLAUTH_BEARER,
+#endif
+  (uint32_t)(CURLAUTH_ONLY | CURLAUTH_BASIC),
+  (uint32_t)(CURLAUTH_ONLY | CURLAUTH_DIGEST),
+  (uint32_t)CURLAUTH_ANY,
+  (uint32_t)CURLAUTH_ANYSAFE,
+};
+
+static const uint32_t mut_bool_values[] = { 0, 1 };
+
+static const uint32_t mut_rtsp_request_values[] = {
+  CURL_RTSPREQ_OPTIONS,
+  CURL_RTSPREQ_DESCRIBE,
+  CURL_RTSPREQ_ANNOUNCE,
+  CURL_RTSPREQ_SETUP,
+  CURL_RTSPREQ_PLAY,
+  CURL_RTSPREQ_PAUSE,
+  CURL_RTSPREQ_TEARDOWN,
+  CURL_RTSPREQ_GET_PARAMETER,
+  CURL_RTSPREQ_SET_PARAMETER,
+  CURL_RTSPREQ_RECORD,
+  CURL_RTSPREQ_RECEIVE,
+};
+
+static const uint32_t mut_rtsp_cseq_values[] = { 0, 1, 2, 0x7fffffff };
+
+static const uint32_t mut_http_version_values[] = {
+  CURL_HTTP_VERSION_NONE,
+  CURL_HTTP_VERSION_1_0,
+  CURL_HTTP_VERSION_1_1,
+  CURL_HTTP_VERSION_2_0,
+  CURL_HTTP_VERSION_2TLS,
+  CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE,
+  CURL_HTTP_VERSION_3,
+};
+
+#define FUZZ_MUT_U32(TYPE, VALUES)                                            \
+  { TYPE, VALUES, sizeof(VALUES) / sizeof(VALUES[0]) }
+
+static const FUZZ_MUT_U32_VALUES mut_u32_values[] = {
+  FUZZ_MUT_U32(TLV_TYPE_HTTPAUTH, mut_httpauth_values),
+  FUZZ_MUT_U32(TLV_TYPE_OPTHEADER, mut_bool_values),
+  FUZZ_MUT_U32(TLV_TYPE_NOBODY, mut_bool_values),
+  FUZZ_MUT_U32(TLV_TYPE_FOLLOWLOCATION, mut_bool_values),
+  FUZZ_MUT_U32(TLV_TYPE_WILDCARDMATCH, mut_bool_values),
+  FUZZ_MUT_U32(TLV_TYPE_RTSP_REQUEST, mut_rtsp_request_values),
+  FUZZ_MUT_U32(TLV_TYPE_RTSP_CLIENT_CSEQ, mut_rtsp_cseq_values),
+  FUZZ_MUT_U32(TLV_TYPE_HTTP_VERSION, mut_http_version_values),
+};
+
+/* URLs for new URL TLVs; only those for protocols the fuzzer allows are
+   used. */
+static const char *const mut_urls[] = {
+  "dict://127.0.0.1/d:word",
+  "file:///dev/null",
+  "ftp://127.0.0.1/file",
+  "gopher://127.0.0.1/1",
+  "http://127.0.0.1/",
+  "https://127.0.0.1/",
+  "imap://127.0.0.1/INBOX",
+  "ldap://127.0.0.1/",
+  "pop3://127.0.0.1/1",
+  "rtmp://127.0.0.1/",
+  "rtsp://127.0.0.1/",
+  "scp://127.0.0.1/file",
+  "sftp://127.0.0.1/file",
+  "smb://127.0.0.1/share/file",
+  "smtp://127.0.0.1/",
+  "tftp://127.0.0.1/file",
+};
+
+/* Value for new TLVs when the input has nothing better to copy. */
+static const char mut_default_value[] = "200 OK\r\n";
+
+static thread_local FUZZ_MUTATOR mutator;
+
+static int fuzz_mut_mime_part(FUZZ_MUTATOR *mut, FUZZ_MUT_TLV *tlv);
+
+/**
+ * Returns a random number below n, which must not be 0.
+ */
+static uint32_t fuzz_mut_rand(FUZZ_MUTATOR *mut, uint32_t n)
+{
+  /* xorshift32 */
+  mut->rand_state ^= mut->rand_state << 13;
+  mut->rand_state ^= mut->rand_state >> 17;
+  mut->rand_state ^= mut->rand_state << 5;
+
+  return mut->rand_state % n;
+}
+
+/**
+ * Grows a buffer to at least the size needed. Returns 0 on success.
+ */
+static int fuzz_mut_reserve(uint8_t **buf, size_t *size, size_t needed)
+{
+  uint8_t *new_buf;
+
+  if(needed <= *size) {
+    return 0;
+  }
+
+  new_buf = (uint8_t *)realloc(*buf, needed);
+  if(new_buf == NULL) {
+    return -1;
+  }
+
+  *buf = new_buf;
+  *size = needed;
+
+  return 0;
+}
+
+/**
+ * Hands out space for a new TLV value, or NULL if there's no room.
+ */
+static uint8_t *fuzz_mut_alloc(FUZZ_MUTATOR *mut, size_t len)
+{
+  uint8_t *ptr;
+
+  if(len > mut->values_size - mut->values_used) {
+    return NULL;
+  }
+
+  ptr = mut->values + mut->values_used;
+  mut->values_used += len;
+
+  return ptr;
+}
+
+/**
+ * Inserts a TLV into a list at the given position. Returns 0 on success.
+ */
+static int fuzz_mut_list_insert(FUZZ_MUT_LIST *list,
+                                size_t pos,
+                                const FUZZ_MUT_TLV *tlv)
+{
+  FUZZ_MUT_TLV *new_tlvs;
+  size_t new_size;
+
+  if(list->num == list->size) {
+    new_size = list->size ? list->size * 2 : 64;
+    new_tlvs = (FUZZ_MUT_TLV *)realloc(list->tlvs,
+                                       new_size * sizeof(FUZZ_MUT_TLV));
+    if(new_tlvs == NULL) {
+      return -1;
+    }
+    list->tlvs = new_tlvs;
+    list->size = new_size;
+  }
+
+  memmove(&list->tlvs[pos + 1],
+          &list->tlvs[pos],
+          (list->num - pos) * sizeof(FUZZ_MUT_TLV));
+  list->tlvs[pos] = *tlv;
+  list->num++;
+
+  return 0;
+}
+
+/**
+ * Removes a TLV from a list.
+ */
+static void fuzz_mut_list_remove(FUZZ_MUT_LIST *list, size_t pos)
+{
+  memmove(&list->tlvs[pos],
+          &list->tlvs[pos + 1],
+          (list->num - pos - 1) * sizeof(FUZZ_MUT_TLV));
+  list->num--;
+}
+
+/**
+ * Splits a TLV stream into a list, using the harness's own TLV routines.
+ * Anything after the last complete TLV is dropped.
+ */
+static void fuzz_mut_parse(FUZZ_MUT_LIST *list,
+                           const uint8_t *data,
+                           size_t data_len)
+{
+  FUZZ_PARSE_STATE state;
+  FUZZ_MUT_TLV mtlv;
+  TLV tlv;
+  int tlv_rc;
+
+  list->num = 0;
+
+  if(data_len < sizeof(TLV_RAW)) {
+    return;
+  }
+
+  memset(&state, 0, sizeof(FUZZ_PARSE_STATE));
+  state.data = data;
+  state.data_len = data_len;
+
+  for(tlv_rc = fuzz_get_first_tlv(&state, &tlv);
+      tlv_rc == 0;
+      tlv_rc = fuzz_get_next_tlv(&state, &tlv)) {
+    mtlv.type = tlv.type;
+    mtlv.length = tlv.length;
+    mtlv.value = tlv.value;
+
+    if(fuzz_mut_list_insert(list, list->num, &mtlv) != 0) {
+      return;
+    }
+  }
+}
+
+/**
+ * Returns the size of a list written out as a TLV stream.
+ */
+static size_t fuzz_mut_list_len(const FUZZ_MUT_LIST *list)
+{
+  size_t len = 0;
+  size_t ii;
+
+  for(ii = 0; ii < list->num; ii++) {
+    len += sizeof(TLV_RAW) + list->tlvs[ii].length;
+  }
+
+  return len;
+}
+
+/**
+ * Writes a list out as a TLV stream. The output must have room for
+ * fuzz_mut_list_len() bytes.
+ */
+static void fuzz_mut_list_write(const FUZZ_MUT_LIST *list, uint8_t *out)
+{
+  const FUZZ_MUT_TLV *tlv;
+  size_t ii;
+
+  for(ii = 0; ii < list->num; ii++) {
+    tlv = &list->tlvs[ii];
+
+    out[0] = (uint8_t)(tlv->type >> 8);
+    out[1] = (uint8_t)tlv->type;
+    out[2] = (uint8_t)(tlv->length >> 24);
+    out[3] = (uint8_t)(tlv->length >> 16);
+    out[4] = (uint8_t)(tlv->length >> 8);
+    out[5] = (uint8_t)tlv->length;
+    out += sizeof(TLV_RAW);
+
+    if(tlv->length > 0) {
+      memcpy(out, tlv->value, tlv->length);
+      out += tlv->length;
+    }
+  }
+}
+
+/**
+ * Returns whether a TLV type can appear more than once in an input.
+ */
+static int fuzz_mut_repeatable(uint16_t type)
+{
+  const FUZZ_TLV_SCHEMA *schema = fuzz_tlv_schema(type);
+
+  if(schema == NULL) {
+    return 0;
+  }
+
+  switch(type) {
+    case TLV_TYPE_HEADER:
+    case TLV_TYPE_MAIL_RECIPIENT:
+    case TLV_TYPE_MIME_PART:
+    case TLV_TYPE_CONNECTION_RESPONSE:
+    case TLV_TYPE_RESPONSE_TRIGGER:
+      return 1;
+
+    default:
+      return schema->kind == FUZZ_TLV_RESPONSE;
+  }
+}
+
+/**
+ * Returns whether a list already has a TLV of the given type.
+ */
+static int fuzz_mut_list_has(const FUZZ_MUT_LIST *list, uint16_t type)
+{
+  size_t ii;
+
+  for(ii = 0; ii < list->num; ii++) {
+    if(list->tlvs[ii].type == type) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Picks a meaningful value for a U32 option, or any value now and then.
+ */
+static uint32_t fuzz_mut_u32_value(FUZZ_MUTATOR *mut, uint16_t type)
+{
+  const FUZZ_MUT_U32_VALUES *known;
+  size_t ii;
+
+  for(ii = 0; ii < sizeof(mut_u32_values) / sizeof(mut_u32_values[0]); ii++) {
+    known = &mut_u32_values[ii];
+    if(known->type == type && fuzz_mut_rand(mut, 8) != 0) {
+      return known->values[fuzz_mut_rand(mut, known->num_values)];
+    }
+  }
+
+  return fuzz_mut_rand(mut, 0xffffffff);
+}
+
+/**
+ * Sets a TLV's value to a copy of some data.
+ */
+static int fuzz_mut_set_value(FUZZ_MUTATOR *mut,
+                              FUZZ_MUT_TLV *tlv,
+                              const void *data,
+                              size_t len)
+{
+  uint8_t *value = fuzz_mut_alloc(mut, len);
+
+  if(value == NULL) {
+    return -1;
+  }
+
+  memcpy(value, data, len);
+  tlv->value = value;
+  tlv->length = len;
+
+  return 0;
+}
+
+/**
+ * Sets a TLV's value to a big-endian 32-bit number.
+ */
+static int fuzz_mut_set_u32(FUZZ_MUTATOR *mut,
+                            FUZZ_MUT_TLV *tlv,
+                            uint32_t num)
+{
+  uint8_t data[4];
+
+  data[0] = (uint8_t)(num >> 24);
+  data[1] = (uint8_t)(num >> 16);
+  data[2] = (uint8_t)(num >> 8);
+  data[3] = (uint8_t)num;
+
+  return fuzz_mut_set_value(mut, tlv, data, sizeof(data));
+}
+
+/**
+ * Finds some data to base a new value on: the value of a random TLV of
+ * the same kind already in the input, or a default.
+ */
+static void fuzz_mut_donor(FUZZ_MUTATOR *mut,
+                           FUZZ_TLV_KIND kind,
+                           const uint8_t **data,
+                           size_t *len)
+{
+  const FUZZ_TLV_SCHEMA *schema;
+  const FUZZ_MUT_TLV *tlv;
+
+  *data = (const uint8_t *)mut_default_value;
+  *len = sizeof(mut_default_value) - 1;
+
+  if(mut->list.num == 0) {
+    return;
+  }
+
+  tlv = &mut->list.tlvs[fuzz_mut_rand(mut, mut->list.num)];
+  schema = fuzz_tlv_schema(tlv->type);
+  if(schema != NULL && schema->kind == kind && tlv->length > 0) {
+    *data = tlv->value;
+    *len = tlv->length;
+  }
+}
+
+/**
+ * Makes up a value for a new TLV that will pass validation.
+ */
+static int fuzz_mut_new_value(FUZZ_MUTATOR *mut, FUZZ_MUT_TLV *tlv)
+{
+  const FUZZ_TLV_SCHEMA *schema = fuzz_tlv_schema(tlv->type);
+  unsigned long allowed_protocols = fuzz_allowed_protocols();
+  const uint8_t *data;
+  size_t len;
+  uint8_t *value;
+  uint8_t header[3];
+  size_t ii;
+
+  if(tlv->type == TLV_TYPE_URL) {
+    for(ii = fuzz_mut_rand(mut, sizeof(mut_urls) / sizeof(mut_urls[0]));
+        ii < sizeof(mut_urls) / sizeof(mut_urls[0]);
+        ii++) {
+      len = strlen(mut_urls[ii]);
+      if(fuzz_url_protocol((const uint8_t *)mut_urls[ii], len) &
+         allowed_protocols) {
+        return fuzz_mut_set_value(mut, tlv, mut_urls[ii], len);
+      }
+    }
+    return -1;
+  }
+
+  switch(schema->kind) {
+    case FUZZ_TLV_U32:
+      return fuzz_mut_set_u32(mut, tlv, fuzz_mut_u32_value(mut, tlv->type));
+
+    case FUZZ_TLV_STRING:
+    case FUZZ_TLV_RESPONSE:
+      fuzz_mut_donor(mut, schema->kind, &data, &len);
+      return fuzz_mut_set_value(mut, tlv, data, len);
+
+    default:
+      break;
+  }
+
+  switch(tlv->type) {
+    case TLV_TYPE_CONNECTION_RESPONSE:
+      fuzz_mut_donor(mut, FUZZ_TLV_RESPONSE, &data, &len);
+      value = fuzz_mut_alloc(mut, 2 + len);
+      if(value == NULL) {
+        return -1;
+      }
+      value[0] = (uint8_t)fuzz_mut_rand(mut, FUZZ_MAX_CONNECTIONS);
+      value[1] = (uint8_t)fuzz_mut_rand(mut, TLV_MAX_NUM_RESPONSES);
+      memcpy(value + 2, data, len);
+      tlv->value = value;
+      tlv->length = 2 + len;
+      return 0;
+
+    case TLV_TYPE_RESPONSE_TRIGGER:
+      header[0] = (uint8_t)fuzz_mut_rand(mut, FUZZ_MAX_CONNECTIONS);
+      header[1] = (uint8_t)(1 + fuzz_mut_rand(mut, TLV_MAX_NUM_RESPONSES - 1));
+      if(fuzz_mut_rand(mut, 2) == 0) {
+        header[2] = FUZZ_TRIGGER_DELIMITER;
+        data = (const uint8_t *)"\r\n";
+        len = 2;
+      }
+      else {
+        header[2] = FUZZ_TRIGGER_BYTE_COUNT;
+        data = NULL;
+        len = 4;
+      }
+      value = fuzz_mut_alloc(mut, 3 + len);
+      if(value == NULL) {
+        return -1;
+      }
+      memcpy(value, header, 3);
+      if(data != NULL) {
+        memcpy(value + 3, data, len);
+      }
+      else {
+        value[3] = 0;
+        value[4] = 0;
+        value[5] = 0;
+        value[6] = (uint8_t)(1 + fuzz_mut_rand(mut, 255));
+      }
+      tlv->value = value;
+      tlv->length = 3 + len;
+      return 0;
+
+    case TLV_TYPE_MIME_PART:
+      /* A part with a name and some data. */
+      value = fuzz_mut_alloc(mut, 2 * sizeof(TLV_RAW) + 2);
+      if(value == NULL) {
+        return -1;
+      }
+      memcpy(value,
+             "\x00\x0e\x00\x00\x00\x01n"
+             "\x00\x0f\x00\x00\x00\x01d",
+             2 * sizeof(TLV_RAW) + 2);
+      tlv->value = value;
+      tlv->length = 2 * sizeof(TLV_RAW) + 2;
+      return 0;
+
+    default:
+      fuzz_mut_donor(mut, FUZZ_TLV_STRING, &data, &len);
+      return fuzz_mut_set_value(mut, tlv, data, len);
+  }
+}
+
+/**
+ * Mutates the bytes of a TLV's value, with libFuzzer's mutator if there is
+ * one.
+ */
+static int fuzz_mut_bytes(FUZZ_MUTATOR *mut, FUZZ_MUT_TLV *tlv)
+{
+  size_t max_len;
+  size_t len = tlv->length;
+  uint8_t *value;
+
+  /* Leave room for the value to grow. */
+  max_len = len + 64;
+  if(max_len > mut->max_size) {
+    max_len = FUZZ_MAX(mut->max_size, len);
+  }
+
+  value = fuzz_mut_alloc(mut, max_len);
+  if(value == NULL) {
+    return -1;
+  }
+  memcpy(value, tlv->value, len);
+
+  if(LLVMFuzzerMutate != NULL) {
+    len = LLVMFuzzerMutate(value, len, max_len);
+  }
+  else if(len > 0) {
+    value[fuzz_mut_rand(mut, len)] ^= (uint8_t)(1 + fuzz_mut_rand(mut, 255));
+  }
+  else {
+    value[len++] = (uint8_t)fuzz_mut_rand(mut, 256);
+  }
+
+  tlv->value = value;
+  tlv->length = len;
+
+  return 0;
+}
+
+/**
+ * Mutates the data after the header of a CONNECTION_RESPONSE or a
+ * RESPONSE_TRIGGER delimiter, keeping at most max_len bytes of it, and
+ * sometimes gives it another connection and response number.
+ */
+static int fuzz_mut_payload(FUZZ_MUTATOR *mut,
+                            FUZZ_MUT_TLV *tlv,
+                            size_t header_len,
+                            size_t max_len)
+{
+  FUZZ_MUT_TLV payload;
+  uint8_t header[3];
+  uint8_t *value;
+
+  memcpy(header, tlv->value, header_len);
+
+  payload.type = tlv->type;
+  payload.value = tlv->value + header_len;
+  payload.length = tlv->length - header_len;
+  if(fuzz_mut_bytes(mut, &payload) != 0) {
+    return -1;
+  }
+
+  payload.length = FUZZ_MIN(payload.length, max_len);
+  if(payload.length == 0 && tlv->type == TLV_TYPE_RESPONSE_TRIGGER) {
+    /* A delimiter can't be empty. */
+    return fuzz_mut_new_value(mut, tlv);
+  }
+
+  if(fuzz_mut_rand(mut, 4) == 0) {
+    header[0] = (uint8_t)fuzz_mut_rand(mut, FUZZ_MAX_CONNECTIONS);
+    if(tlv->type == TLV_TYPE_RESPONSE_TRIGGER) {
+      /* Response 0 is sent on connection, so can't have a trigger. */
+      header[1] = (uint8_t)(1 + fuzz_mut_rand(mut, TLV_MAX_NUM_RESPONSES - 1));
+    }
+    else {
+      header[1] = (uint8_t)fuzz_mut_rand(mut, TLV_MAX_NUM_RESPONSES);
+    }
+  }
+
+  value = fuzz_mut_alloc(mut, header_len + payload.length);
+  if(value == NULL) {
+    return -1;
+  }
+  memcpy(value, header, header_len);
+  memcpy(value + header_len, payload.value, payload.length);
+
+  tlv->value = value;
+  tlv->length = header_len + payload.length;
+
+  return 0;
+}
+
+/**
+ * Mutates the value of a random TLV in the way that suits its kind.
+ */
+static int fuzz_mut_value(FUZZ_MUTATOR *mut, FUZZ_MUT_LIST *list)
+{
+  FUZZ_MUT_TLV *tlv;
+  const FUZZ_TLV_SCHEMA *schema;
+  uint8_t *value;
+
+  if(list->num == 0) {
+    return -1;
+  }
+
+  tlv = &list->tlvs[fuzz_mut_rand(mut, list->num)];
+  schema = fuzz_tlv_schema(tlv->type);
+
+  if(schema != NULL && schema->kind == FUZZ_TLV_U32) {
+    return fuzz_mut_set_u32(mut, tlv, fuzz_mut_u32_value(mut, tlv->type));
+  }
+
+  if(tlv->type == TLV_TYPE_CONNECTION_RESPONSE) {
+    /* Keep the connection and response numbers valid. */
+    if(tlv->length < 3 || fuzz_mut_rand(mut, 4) == 0) {
+      return fuzz_mut_new_value(mut, tlv);
+    }
+    return fuzz_mut_payload(mut, tlv, 2, mut->max_size);
+  }
+
+  if(tlv->type == TLV_TYPE_RESPONSE_TRIGGER) {
+    if(tlv->length < 4 || fuzz_mut_rand(mut, 4) == 0) {
+      return fuzz_mut_new_value(mut, tlv);
+    }
+    if(tlv->value[2] != FUZZ_TRIGGER_DELIMITER) {
+      /* Byte counts keep their format; only renumber them. */
+      if(fuzz_mut_set_value(mut, tlv, tlv->value, tlv->length) != 0) {
+        return -1;
+      }
+      value = (uint8_t *)tlv->value;
+      value[0] = (uint8_t)fuzz_mut_rand(mut, FUZZ_MAX_CONNECTIONS);
+      value[1] = (uint8_t)(1 + fuzz_mut_rand(mut, TLV_MAX_NUM_RESPONSES - 1));
+      return 0;
+    }
+    return fuzz_mut_payload(mut, tlv, 3, FUZZ_MAX_TRIGGER_LEN);
+  }
+
+  if(tlv->type == TLV_TYPE_MIME_PART) {
+    return fuzz_mut_mime_part(mut, tlv);
+  }
+
+  return fuzz_mut_bytes(mut, tlv);
+}
+
+/**
+ * Inserts a new TLV at a random position. Only TLVs for the fuzzer's
+ * protocols are added, and one-use TLVs only if the input doesn't have one.
+ */
+static int fuzz_mut_insert(FUZZ_MUTATOR *mut, FUZZ_MUT_LIST *list)
+{
+  const FUZZ_TLV_SCHEMA *schema;
+  unsigned long allowed_protocols = fuzz_allowed_protocols();
+  FUZZ_MUT_TLV tlv;
+  int tries;
+
+  for(tries = 0; tries < FUZZ_MUT_MAX_TRIES; tries++) {
+    tlv.type = (uint16_t)(1 + fuzz_mut_rand(mut, FUZZ_NUM_TLV_TYPES));
+    schema = fuzz_tlv_schema(tlv.type);
+
+    if(schema->kind == FUZZ_TLV_MIME_FIELD ||
+       (schema->protocols & allowed_protocols) == 0 ||
+       (!fuzz_mut_repeatable(tlv.type) && fuzz_mut_list_has(list, tlv.type))) {
+      continue;
+    }
+
+    if(fuzz_mut_new_value(mut, &tlv) != 0) {
+      return -1;
+    }
+
+    return fuzz_mut_list_insert(list, fuzz_mut_rand(mut, list->num + 1), &tlv);
+  }
+
+  return -1;
+}
+
+/**
+ * Removes a random TLV.
+ */
+static int fuzz_mut_delete(FUZZ_MUTATOR *mut, FUZZ_MUT_LIST *list)
+{
+  if(list->num == 0) {
+    return -1;
+  }
+
+  fuzz_mut_list_remove(list, fuzz_mut_rand(mut, list->num));
+
+  return 0;
+}
+
+/**
+ * Copies a random TLV that can appear more than once to a random position.
+ */
+static int fuzz_mut_duplicate(FUZZ_MUTATOR *mut, FUZZ_MUT_LIST *list)
+{
+  FUZZ_MUT_TLV tlv;
+
+  if(list->num == 0) {
+    return -1;
+  }
+
+  tlv = list->tlvs[fuzz_mut_rand(mut, list->num)];
+  if(!fuzz_mut_repeatable(tlv.type)) {
+    return -1;
+  }
+
+  return fuzz_mut_list_insert(list, fuzz_mut_rand(mut, list->num + 1), &tlv);
+}
+
+/**
+ * Swaps two random TLVs.
+ */
+static int fuzz_mut_swap(FUZZ_MUTATOR *mut, FUZZ_MUT_LIST *list)
+{
+  FUZZ_MUT_TLV tlv;
+  size_t aa;
+  size_t bb;
+
+  if(list->num < 2) {
+    return -1;
+  }
+
+  aa = fuzz_mut_rand(mut, list->num);
+  bb = fuzz_mut_rand(mut, list->num);
+  if(aa == bb || list->tlvs[aa].type == list->tlvs[bb].type) {
+    return -1;
+  }
+
+  tlv = list->tlvs[aa];
+  list->tlvs[aa] = list->tlvs[bb];
+  list->tlvs[bb] = tlv;
+
+  return 0;
+}
+
+/**
+ * Mutates the TLVs inside a MIME part: a name or data value changes, or a
+ * name or data TLV is added, removed or copied.
+ */
+static int fuzz_mut_mime_part(FUZZ_MUTATOR *mut, FUZZ_MUT_TLV *tlv)
+{
+  FUZZ_MUT_LIST *part = &mut->part_list;
+  FUZZ_MUT_TLV sub_tlv;
+  uint8_t *value;
+  size_t len;
+  int rc;
+
+  fuzz_mut_parse(part, tlv->value, tlv->length);
+
+  switch(fuzz_mut_rand(mut, 4)) {
+    case 0:
+      sub_tlv.type = fuzz_mut_rand(mut, 2) ? TLV_TYPE_MIME_PART_NAME :
+                                             TLV_TYPE_MIME_PART_DATA;
+      rc = fuzz_mut_set_value(mut, &sub_tlv, "x", 1);
+      if(rc == 0) {
+        rc = fuzz_mut_list_insert(part,
+                                  fuzz_mut_rand(mut, part->num + 1),
+                                  &sub_tlv);
+      }
+      break;
+
+    case 1:
+      rc = fuzz_mut_delete(mut, part);
+      break;
+
+    case 2:
+      if(part->num == 0) {
+        rc = -1;
+        break;
+      }
+      sub_tlv = part->tlvs[fuzz_mut_rand(mut, part->num)];
+      rc = fuzz_mut_list_insert(part,
+                                fuzz_mut_rand(mut, part->num + 1),
+                                &sub_tlv);
+      break;
+
+    default:
+      if(part->num == 0) {
+        rc = -1;
+        break;
+      }
+      rc = fuzz_mut_bytes(mut, &part->tlvs[fuzz_mut_rand(mut, part->num)]);
+      break;
+  }
+
+  if(rc != 0) {
+    return rc;
+  }
+
+  /* Only name and data TLVs are allowed in a part. */
+  for(len = 0; len < part->num; len++) {
+    if(part->tlvs[len].type != TLV_TYPE_MIME_PART_NAME &&
+       part->tlvs[len].type != TLV_TYPE_MIME_PART_DATA) {
+      fuzz_mut_list_remove(part, len--);
+    }
+  }
+
+  len = fuzz_mut_list_len(part);
+  value = fuzz_mut_alloc(mut, len);
+  if(value == NULL) {
+    return -1;
+  }
+
+  fuzz_mut_list_write(part, value);
+  tlv->value = value;
+  tlv->length = len;
+
+  return 0;
+}
+
+/**
+ * Applies one random mutation to a list of TLVs. Returns 0 if the list was
+ * changed.
+ */
+static int fuzz_mut_once(FUZZ_MUTATOR *mut, FUZZ_MUT_LIST *list)
+{
+  switch(fuzz_mut_rand(mut, 8)) {
+    case 0:
+    case 1:
+    case 2:
+      return fuzz_mut_value(mut, list);
+
+    case 3:
+    case 4:
+      return fuzz_mut_insert(mut, list);
+
+    case 5:
+      return fuzz_mut_delete(mut, list);
+
+    case 6:
+      return fuzz_mut_duplicate(mut, list);
+
+    default:
+      return fuzz_mut_swap(mut, list);
+  }
+}
+
+/**
+ * Sets up the mutator for a call: copies the input, splits it into TLVs
+ * and makes room for new values. Returns 0 on success.
+ */
+static int fuzz_mut_begin(FUZZ_MUTATOR *mut,
+                          const uint8_t *data,
+                          size_t size,
+                          size_t max_size,
+                          unsigned int seed)
+{
+  mut->rand_state = seed ? seed : 1;
+  mut->max_size = max_size;
+  mut->values_used = 0;
+
+  if(fuzz_mut_reserve(&mut->source, &mut->source_size, size + 1) != 0 ||
+     fuzz_mut_reserve(&mut->values,
+                      &mut->values_size,
+                      FUZZ_MUT_MAX_STACK * (max_size + 64) + 64) != 0) {
+    return -1;
+  }
+
+  memcpy(mut->source, data, size);
+
+  return 0;
+}
+
+/**
+ * Splits an input into TLVs, dropping any TLVs the fuzzer would reject the
+ * input for having.
+ */
+static void fuzz_mut_load(FUZZ_MUT_LIST *list,
+                          const uint8_t *data,
+                          size_t data_len)
+{
+  const FUZZ_TLV_SCHEMA *schema;
+  size_t ii;
+
+  fuzz_mut_parse(list, data, data_len);
+
+  for(ii = 0; ii < list->num; ii++) {
+    schema = fuzz_tlv_schema(list->tlvs[ii].type);
+    if(schema == NULL || schema->kind == FUZZ_TLV_MIME_FIELD) {
+      fuzz_mut_list_remove(list, ii--);
+    }
+  }
+}
+
+/**
+ * Writes the mutated list back over the input if it fits. Returns the new
+ * size, or 0 if it doesn't fit.
+ */
+static size_t fuzz_mut_end(FUZZ_MUTATOR *mut, uint8_t *data)
+{
+  size_t len = fuzz_mut_list_len(&mut->list);
+
+  if(len == 0 || len > mut->max_size) {
+    return 0;
+  }
+
+  fuzz_mut_list_write(&mut->list, data);
+
+  return len;
+}
+
+/**
+ * libFuzzer hook for mutating an input. The input is treated as a list of
+ * TLVs, which are changed, added, removed, copied and swapped, so the output
+ * is always a well-formed TLV stream.
+ */
+extern "C" size_t LLVMFuzzerCustomMutator(uint8_t *data,
+                                          size_t size,
+                                          size_t max_size,
+                                          unsigned int seed)
+{
+  FUZZ_MUTATOR *mut = &mutator;
+  size_t new_size = 0;
+  int mutations;
+  int tries;
+
+  if(fuzz_mut_begin(mut, data, size, max_size, seed) != 0) {
+    return size;
+  }
+
+  for(tries = 0; new_size == 0 && tries < FUZZ_MUT_MAX_TRIES; tries++) {
+    /* Start again from the input each time. */
+    mut->values_used = 0;
+    fuzz_mut_load(&mut->list, mut->source, size);
+
+    mutations = 1 + fuzz_mut_rand(mut, FUZZ_MUT_MAX_STACK);
+    while(mutations > 0) {
+      if(fuzz_mut_once(mut, &mut->list) == 0) {
+        mutations--;
+      }
+      else if(fuzz_mut_rand(mut, 4) == 0) {
+        /* Don't keep trying forever on inputs with little to work on. */
+        mutations--;
+      }
+    }
+
+    new_size = fuzz_mut_end(mut, data);
+  }
+
+  if(new_size == 0 && LLVMFuzzerMutate != NULL) {
+    /* Nothing fitted; fall back to plain byte mutations. */
+    new_size = LLVMFuzzerMutate(data, size, max_size);
+  }
+
+  return new_size ? new_size : size;
+}
+
+/**
+ * Returns whether a TLV is part of the server's side of the conversation.
+ */
+static int fuzz_cross_is_server(uint16_t type)
+{
+  const FUZZ_TLV_SCHEMA *schema = fuzz_tlv_schema(type);
+
+  return schema->kind == FUZZ_TLV_RESPONSE ||
+         type == TLV_TYPE_CONNECTION_RESPONSE ||
+         type == TLV_TYPE_RESPONSE_TRIGGER;
+}
+
+/**
+ * Appends a TLV to the output, unless it can only be used once and the
+ * output already has one.
+ */
+static int fuzz_cross_add(FUZZ_MUT_LIST *list, const FUZZ_MUT_TLV *tlv)
+{
+  if(!fuzz_mut_repeatable(tlv->type) && fuzz_mut_list_has(list, tlv->type)) {
+    return 0;
+  }
+
+  return fuzz_mut_list_insert(list, list->num, tlv);
+}
+
+/**
+ * Gets the protocol an input's URL is for, or 0 if it's not known.
+ */
+static unsigned long fuzz_cross_protocol(const FUZZ_MUT_LIST *list)
+{
+  size_t ii;
+
+  for(ii = 0; ii < list->num; ii++) {
+    if(list->tlvs[ii].type == TLV_TYPE_URL) {
+      return fuzz_url_protocol(list->tlvs[ii].value, list->tlvs[ii].length);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * The client side (URL and options) of the first input, with the server's
+ * side of the conversation from the second.
+ */
+static int fuzz_cross_conversation(FUZZ_MUT_LIST *out,
+                                   const FUZZ_MUT_LIST *client,
+                                   const FUZZ_MUT_LIST *server)
+{
+  size_t ii;
+
+  for(ii = 0; ii < client->num; ii++) {
+    if(!fuzz_cross_is_server(client->tlvs[ii].type) &&
+       fuzz_cross_add(out, &client->tlvs[ii]) != 0) {
+      return -1;
+    }
+  }
+
+  for(ii = 0; ii < server->num; ii++) {
+    if(fuzz_cross_is_server(server->tlvs[ii].type) &&
+       fuzz_cross_add(out, &server->tlvs[ii]) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * The client side of the first input, with each response taken from either
+ * input. Only used when both inputs are for the same protocol.
+ */
+static int fuzz_cross_interleave(FUZZ_MUTATOR *mut,
+                                 FUZZ_MUT_LIST *out,
+                                 const FUZZ_MUT_LIST *first,
+                                 const FUZZ_MUT_LIST *second)
+{
+  /* Which input each response TLV type comes from. */
+  unsigned char from_second[FUZZ_NUM_TLV_TYPES + 1];
+  const FUZZ_MUT_TLV *tlv;
+  size_t ii;
+
+  for(ii = 0; ii <= FUZZ_NUM_TLV_TYPES; ii++) {
+    from_second[ii] = (unsigned char)fuzz_mut_rand(mut, 2);
+  }
+
+  for(ii = 0; ii < first->num; ii++) {
+    tlv = &first->tlvs[ii];
+    if((!fuzz_cross_is_server(tlv->type) || !from_second[tlv->type]) &&
+       fuzz_cross_add(out, tlv) != 0) {
+      return -1;
+    }
+  }
+
+  for(ii = 0; ii < second->num; ii++) {
+    tlv = &second->tlvs[ii];
+    if(fuzz_cross_is_server(tlv->type) && from_second[tlv->type] &&
+       fuzz_cross_add(out, tlv) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * The TLVs of the first input up to a random point, then those of the
+ * second from a random point.
+ */
+static int fuzz_cross_splice(FUZZ_MUTATOR *mut,
+                             FUZZ_MUT_LIST *out,
+                             const FUZZ_MUT_LIST *first,
+                             const FUZZ_MUT_LIST *second)
+{
+  size_t first_end = fuzz_mut_rand(mut, first->num + 1);
+  size_t ii;
+
+  for(ii = 0; ii < first_end; ii++) {
+    if(fuzz_cross_add(out, &first->tlvs[ii]) != 0) {
+      return -1;
+    }
+  }
+
+  for(ii = fuzz_mut_rand(mut, second->num + 1); ii < second->num; ii++) {
+    if(fuzz_cross_add(out, &second->tlvs[ii]) != 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * libFuzzer hook for crossing two inputs over. Inputs are only cut at TLV
+ * boundaries: the client side of one input is given the server's side of
+ * the conversation from the other, the responses of two inputs for the same
+ * protocol are mixed, or the start of one input is joined to the end of the
+ * other.
+ */
+extern "C" size_t LLVMFuzzerCustomCrossOver(const uint8_t *data1,
+                                            size_t size1,
+                                            const uint8_t *data2,
+                                            size_t size2,
+                                            uint8_t *out,
+                                            size_t max_out_size,
+                                            unsigned int seed)
+{
+  FUZZ_MUTATOR *mut = &mutator;
+  FUZZ_MUT_LIST *first = &mut->cross_lists[0];
+  FUZZ_MUT_LIST *second = &mut->cross_lists[1];
+  unsigned long protocol;
+  size_t len;
+  int rc;
+
+  mut->rand_state = seed ? seed : 1;
+
+  fuzz_mut_load(first, data1, size1);
+  fuzz_mut_load(second, data2, size2);
+
+  if(fuzz_mut_rand(mut, 2)) {
+    first = &mut->cross_lists[1];
+    second = &mut->cross_lists[0];
+  }
+
+  mut->list.num = 0;
+  protocol = fuzz_cross_protocol(first);
+
+  switch(fuzz_mut_rand(mut, 3)) {
+    case 0:
+      rc = fuzz_cross_conversation(&mut->list, first, second);
+      break;
+
+    case 1:
+      if(protocol != 0 && protocol == fuzz_cross_protocol(second)) {
+        rc = fuzz_cross_interleave(mut, &mut->list, first, second);
+      }
+      else {
+        rc = fuzz_cross_conversation(&mut->list, first, second);
+      }
+      break;
+
+    default:
+      rc = fuzz_cross_splice(mut, &mut->list, first, second);
+      break;
+  }
+
+  if(rc != 0) {
+    return 0;
+  }
+
+  /* Drop TLVs from the end until the output fits. */
+  len = fuzz_mut_list_len(&mut->list);
+  while(len > max_out_size) {
+    len -= sizeof(TLV_RAW) + mut->list.tlvs[mut->list.num - 1].length;
+    mut->list.num--;
+  }
+
+  fuzz_mut_list_write(&mut->list, out);
+
+  return len;
+}
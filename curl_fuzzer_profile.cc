@@ -0,0 +1,345 @@
+/***************************************************************************
+ *                                  _   _ ____  _
+ *  Project                     ___| | | |  _ \| |
+ *                             / __| | | | |_) | |
+ *                            | (__| |_| |  _ <| |___
+ *                             \___|\___/|_| \_\_____|
+ *
+ * Copyright (C) 2017, Max Dymond, <cmeister2@gmail.com>, et al.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution. The terms
+ * are also available at https://curl.haxx.se/docs/copyright.html.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <curl/curl.h>
+#include "curl_fuzzer.h"
+
+#ifdef FUZZ_PROFILE
+
+/* Virtual time moves CLOCK_MONOTONIC forward, so time the phases with a
+   clock it leaves alone. */
+#define PROFILE_CLOCK  CLOCK_BOOTTIME
+
+/**
+ * A time libcurl measures for each transfer.
+ */
+typedef struct fuzz_profile_info
+{
+  CURLINFO info;
+  const char *name;
+
+} FUZZ_PROFILE_INFO;
+
+static const FUZZ_PROFILE_INFO curl_times[] = {
+  {CURLINFO_NAMELOOKUP_TIME_T, "namelookup"},
+  {CURLINFO_CONNECT_TIME_T, "connect"},
+  {CURLINFO_APPCONNECT_TIME_T, "appconnect"},
+  {CURLINFO_PRETRANSFER_TIME_T, "pretransfer"},
+  {CURLINFO_STARTTRANSFER_TIME_T, "starttransfer"},
+  {CURLINFO_REDIRECT_TIME_T, "redirect"},
+  {CURLINFO_TOTAL_TIME_T, "total"}
+};
+
+#define FUZZ_NUM_CURL_TIMES  (sizeof(curl_times) / sizeof(curl_times[0]))
+
+static const char *const phase_names[FUZZ_NUM_PHASES] = {
+  "parse",
+  "setopt",
+  "transfer",
+  "  wait",
+  "teardown"
+};
+
+static const char *const call_names[FUZZ_NUM_CALLS] = {
+  "read",
+  "write",
+  "select",
+  "poll",
+  "socketpair",
+  "emulated"
+};
+
+/**
+ * Counters for the fuzzing run in progress on one thread.
+ */
+typedef struct fuzz_profile_run
+{
+  uint64_t phase_start_ns[FUZZ_NUM_PHASES];
+  uint64_t phase_ns[FUZZ_NUM_PHASES];
+
+  /* Phase the run is in, or FUZZ_NUM_PHASES if none. Waiting isn't counted
+     here, as it happens inside the transfer. */
+  FUZZ_PROFILE_PHASE current;
+  unsigned long calls[FUZZ_NUM_CALLS];
+
+  /* libcurl's times for the transfer, in microseconds, if it ran. */
+  int transferred;
+  uint64_t curl_us[FUZZ_NUM_CURL_TIMES];
+
+} FUZZ_PROFILE_RUN;
+
+/**
+ * Counters summed over all runs and threads, along with the largest value
+ * seen in any one run. Updated with atomic operations.
+ */
+typedef struct fuzz_profile_stats
+{
+  unsigned long runs;
+  uint64_t phase_ns[FUZZ_NUM_PHASES];
+  uint64_t phase_max_ns[FUZZ_NUM_PHASES];
+  unsigned long calls[FUZZ_NUM_CALLS];
+  uint64_t calls_max[FUZZ_NUM_CALLS];
+
+  unsigned long transfers;
+  uint64_t curl_us[FUZZ_NUM_CURL_TIMES];
+  uint64_t curl_max_us[FUZZ_NUM_CURL_TIMES];
+
+} FUZZ_PROFILE_STATS;
+
+static thread_local FUZZ_PROFILE_RUN profile_run;
+static FUZZ_PROFILE_STATS profile_stats;
+
+/* Set by SIGUSR1; the report is printed at the end of the next run. */
+static volatile sig_atomic_t profile_report_requested;
+
+/**
+ * Nanoseconds on the profiling clock.
+ */
+static uint64_t fuzz_profile_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(PROFILE_CLOCK, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Raise a maximum shared between threads to at least a value.
+ */
+static void fuzz_profile_max(uint64_t *max, uint64_t value)
+{
+  uint64_t current = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+  while(value > current &&
+        !__atomic_compare_exchange_n(max,
+                                     &current,
+                                     value,
+                                     1,
+                                     __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED)) {
+  }
+}
+
+/**
+ * Prints the profiling counters.
+ */
+static void fuzz_profile_report(void)
+{
+  unsigned long runs = __atomic_load_n(&profile_stats.runs, __ATOMIC_RELAXED);
+  unsigned long transfers =
+    __atomic_load_n(&profile_stats.transfers, __ATOMIC_RELAXED);
+  unsigned long per_run = runs ? runs : 1;
+  unsigned long per_transfer = transfers ? transfers : 1;
+  size_t ii;
+
+  fprintf(stderr,
+          "FUZZ: profile: %lu runs, %lu transfers\n"
+          "FUZZ: profile: %-14s %12s %12s %12s\n",
+          runs,
+          transfers,
+          "phase",
+          "total ms",
+          "mean us",
+          "max us");
+
+  for(ii = 0; ii < FUZZ_NUM_PHASES; ii++) {
+    fprintf(stderr,
+            "FUZZ: profile: %-14s %12.1f %12.1f %12.1f\n",
+            phase_names[ii],
+            profile_stats.phase_ns[ii] / 1e6,
+            profile_stats.phase_ns[ii] / 1e3 / per_run,
+            profile_stats.phase_max_ns[ii] / 1e3);
+  }
+
+  fprintf(stderr,
+          "FUZZ: profile: %-14s %12s %12s %12s\n",
+          "call",
+          "total",
+          "per run",
+          "max");
+
+  for(ii = 0; ii < FUZZ_NUM_CALLS; ii++) {
+    fprintf(stderr,
+            "FUZZ: profile: %-14s %12lu %12.1f %12llu\n",
+            call_names[ii],
+            profile_stats.calls[ii],
+            (double)profile_stats.calls[ii] / per_run,
+            (unsigned long long)profile_stats.calls_max[ii]);
+  }
+
+  fprintf(stderr,
+          "FUZZ: profile: %-14s %12s %12s %12s\n",
+          "libcurl time",
+          "total ms",
+          "mean us",
+          "max us");
+
+  for(ii = 0; ii < FUZZ_NUM_CURL_TIMES; ii++) {
+    fprintf(stderr,
+            "FUZZ: profile: %-14s %12.1f %12.1f %12llu\n",
+            curl_times[ii].name,
+            profile_stats.curl_us[ii] / 1e3,
+            (double)profile_stats.curl_us[ii] / per_transfer,
+            (unsigned long long)profile_stats.curl_max_us[ii]);
+  }
+}
+
+/**
+ * Asks for the report to be printed once the current run has finished.
+ */
+static void fuzz_profile_signal(int signum)
+{
+  (void)signum;
+
+  profile_report_requested = 1;
+}
+
+/**
+ * Arranges for the profiling counters to be printed at exit, and whenever
+ * the process gets SIGUSR1.
+ */
+void fuzz_profile_init(void)
+{
+  atexit(fuzz_profile_report);
+  signal(SIGUSR1, fuzz_profile_signal);
+}
+
+/**
+ * Clears the current thread's counters for a new run.
+ */
+void fuzz_profile_begin_run(void)
+{
+  memset(&profile_run, 0, sizeof(profile_run));
+  profile_run.current = FUZZ_NUM_PHASES;
+}
+
+/**
+ * Adds the current thread's counters for the run that has just finished to
+ * the totals.
+ */
+void fuzz_profile_end_run(void)
+{
+  size_t ii;
+
+  if(profile_run.current != FUZZ_NUM_PHASES) {
+    fuzz_profile_stop(profile_run.current);
+    profile_run.current = FUZZ_NUM_PHASES;
+  }
+
+  __atomic_fetch_add(&profile_stats.runs, 1, __ATOMIC_RELAXED);
+
+  for(ii = 0; ii < FUZZ_NUM_PHASES; ii++) {
+    __atomic_fetch_add(&profile_stats.phase_ns[ii],
+                       profile_run.phase_ns[ii],
+                       __ATOMIC_RELAXED);
+    fuzz_profile_max(&profile_stats.phase_max_ns[ii],
+                     profile_run.phase_ns[ii]);
+  }
+
+  for(ii = 0; ii < FUZZ_NUM_CALLS; ii++) {
+    __atomic_fetch_add(&profile_stats.calls[ii],
+                       profile_run.calls[ii],
+                       __ATOMIC_RELAXED);
+    fuzz_profile_max(&profile_stats.calls_max[ii],
+                     profile_run.calls[ii]);
+  }
+
+  if(profile_run.transferred) {
+    __atomic_fetch_add(&profile_stats.transfers, 1, __ATOMIC_RELAXED);
+
+    for(ii = 0; ii < FUZZ_NUM_CURL_TIMES; ii++) {
+      __atomic_fetch_add(&profile_stats.curl_us[ii],
+                         profile_run.curl_us[ii],
+                         __ATOMIC_RELAXED);
+      fuzz_profile_max(&profile_stats.curl_max_us[ii],
+                       profile_run.curl_us[ii]);
+    }
+  }
+
+  if(profile_report_requested) {
+    profile_report_requested = 0;
+    fuzz_profile_report();
+  }
+}
+
+/**
+ * Moves the current run on to its next phase.
+ */
+void fuzz_profile_phase(FUZZ_PROFILE_PHASE phase)
+{
+  if(profile_run.current != FUZZ_NUM_PHASES) {
+    fuzz_profile_stop(profile_run.current);
+  }
+
+  profile_run.current = phase;
+  fuzz_profile_start(phase);
+}
+
+/**
+ * Starts timing a phase of the current run.
+ */
+void fuzz_profile_start(FUZZ_PROFILE_PHASE phase)
+{
+  profile_run.phase_start_ns[phase] = fuzz_profile_now();
+}
+
+/**
+ * Stops timing a phase of the current run, adding the time since it started.
+ */
+void fuzz_profile_stop(FUZZ_PROFILE_PHASE phase)
+{
+  profile_run.phase_ns[phase] +=
+    fuzz_profile_now() - profile_run.phase_start_ns[phase];
+}
+
+/**
+ * Counts a call made during the current run.
+ */
+void fuzz_profile_count(FUZZ_PROFILE_CALL call)
+{
+  profile_run.calls[call]++;
+}
+
+/**
+ * Records the times libcurl measured for the current run's transfer. Must be
+ * called before the easy handle is reset or cleaned up.
+ */
+void fuzz_profile_curl_times(CURL *easy)
+{
+  curl_off_t value;
+  size_t ii;
+
+  profile_run.transferred = 1;
+
+  for(ii = 0; ii < FUZZ_NUM_CURL_TIMES; ii++) {
+    value = 0;
+    curl_easy_getinfo(easy, curl_times[ii].info, &value);
+    profile_run.curl_us[ii] = (uint64_t)FUZZ_MAX(value, 0);
+  }
+}
+
+#endif
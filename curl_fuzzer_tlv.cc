@@ -19,44 +19,68 @@
  * KIND, either express or implied.
  *
  ***************************************************************************/
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <curl/curl.h>
 #include "curl_fuzzer.h"
 
+/* Buffer that TLV strings are copied into, kept between runs so that it
+   only needs to grow when a longer string turns up. */
+static thread_local char *tlv_scratch;
+static thread_local size_t tlv_scratch_size;
+
+/* Key whose destructor frees a thread's scratch buffer when it exits. */
+static pthread_key_t tlv_scratch_key;
+static pthread_once_t tlv_scratch_once = PTHREAD_ONCE_INIT;
+
+/* Validation statistics, summed over all threads and reported at exit if
+   any input was rejected. */
+static FUZZ_VALIDATE_STATS validate_stats;
+static pthread_once_t validate_report_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Arrange for the validation statistics to be printed at exit.
+ */
+static void fuzz_validate_report_at_exit(void)
+{
+  atexit(fuzz_validate_report);
+}
+
 /**
  * TLV access function - gets the first TLV from a data stream.
  */
-int fuzz_get_first_tlv(FUZZ_DATA *fuzz,
+int fuzz_get_first_tlv(FUZZ_PARSE_STATE *state,
                        TLV *tlv)
 {
   /* Reset the cursor. */
-  fuzz->state.data_pos = 0;
-  return fuzz_get_tlv_comn(fuzz, tlv);
+  state->data_pos = 0;
+  return fuzz_get_tlv_comn(state, tlv);
 }
 
 /**
  * TLV access function - gets the next TLV from a data stream.
 */
-int fuzz_get_next_tlv(FUZZ_DATA *fuzz,
+int fuzz_get_next_tlv(FUZZ_PARSE_STATE *state,
                       TLV *tlv)
 {
   /* Advance the cursor by the full length of the previous TLV. */
-  fuzz->state.data_pos += sizeof(TLV_RAW) + tlv->length;
+  state->data_pos += sizeof(TLV_RAW) + tlv->length;
 
   /* Work out if there's a TLV's worth of data to read */
-  if(fuzz->state.data_pos + sizeof(TLV_RAW) > fuzz->state.data_len) {
+  if(state->data_pos + sizeof(TLV_RAW) > state->data_len) {
     /* No more TLVs to parse */
     return TLV_RC_NO_MORE_TLVS;
   }
 
-  return fuzz_get_tlv_comn(fuzz, tlv);
+  return fuzz_get_tlv_comn(state, tlv);
 }
 
 /**
  * Common TLV function for accessing TLVs in a data stream.
  */
-int fuzz_get_tlv_comn(FUZZ_DATA *fuzz,
+int fuzz_get_tlv_comn(FUZZ_PARSE_STATE *state,
                       TLV *tlv)
 {
   int rc = 0;
@@ -64,28 +88,28 @@ int fuzz_get_tlv_comn(FUZZ_DATA *fuzz,
   TLV_RAW *raw;
 
   /* Start by casting the data stream to a TLV. */
-  raw = (TLV_RAW *)&fuzz->state.data[fuzz->state.data_pos];
-  data_offset = fuzz->state.data_pos + sizeof(TLV_RAW);
+  raw = (TLV_RAW *)&state->data[state->data_pos];
+  data_offset = state->data_pos + sizeof(TLV_RAW);
 
   /* Set the TLV values. */
   tlv->type = to_u16(raw->raw_type);
   tlv->length = to_u32(raw->raw_length);
-  tlv->value = &fuzz->state.data[data_offset];
+  tlv->value = &state->data[data_offset];
 
-  FV_PRINTF(fuzz, "TLV: type %x length %u\n", tlv->type, tlv->length);
+  FV_PRINTF(state, "TLV: type %x length %u\n", tlv->type, tlv->length);
 
   /* Use uint64s to verify lengths of TLVs so that overflow problems don't
      matter. */
   uint64_t check_length = data_offset;
   check_length += tlv->length;
 
-  uint64_t remaining_len = fuzz->state.data_len;
-  FV_PRINTF(fuzz, "Check length of data: %lu \n", check_length);
-  FV_PRINTF(fuzz, "Remaining length of data: %lu \n", remaining_len);
+  uint64_t remaining_len = state->data_len;
+  FV_PRINTF(state, "Check length of data: %lu \n", check_length);
+  FV_PRINTF(state, "Remaining length of data: %lu \n", remaining_len);
 
   /* Sanity check that the TLV length is ok. */
   if(check_length > remaining_len) {
-    FV_PRINTF(fuzz, "Returning TLV_RC_SIZE_ERROR\n");
+    FV_PRINTF(state, "Returning TLV_RC_SIZE_ERROR\n");
     rc = TLV_RC_SIZE_ERROR;
   }
 
@@ -93,64 +117,360 @@ int fuzz_get_tlv_comn(FUZZ_DATA *fuzz,
 }
 
 /**
- * Do different actions on the CURL handle for different received TLVs.
+ * Schema entries for every TLV type, indexed by type - 1.
+ */
+static constexpr FUZZ_TLV_SCHEMA tlv_schema[] = {
+#define FUZZ_TLV(NAME, TYPE, KIND, OPTION, PROTOCOLS, CONN, RESPONSE, PYNAME, \
+                 DESC)                                                        \
+  {TYPE, FUZZ_TLV_##KIND, (CURLoption)(OPTION), FUZZ_TLV_PROTO_##PROTOCOLS,   \
+   CONN, RESPONSE},
+#include "curl_fuzzer_tlv.def"
+#undef FUZZ_TLV
+};
+
+/* Checks that the schema's types are numbered in order from 1, so that a
+   type can be looked up by index. */
+static constexpr bool fuzz_tlv_schema_dense(size_t ii)
+{
+  return ii == FUZZ_NUM_TLV_TYPES ||
+         (tlv_schema[ii].type == ii + 1 && fuzz_tlv_schema_dense(ii + 1));
+}
+
+static_assert(fuzz_tlv_schema_dense(0),
+              "TLV types in curl_fuzzer_tlv.def must be numbered in order");
+
+static_assert(sizeof(((FUZZ_VALIDATE_STATE *)0)->tlvs_seen) * 8 >
+              FUZZ_NUM_TLV_TYPES,
+              "TLV tracker is too small for the TLV schema");
+
+/**
+ * Looks up the schema entry for a TLV type, or NULL for an unknown type.
+ */
+const FUZZ_TLV_SCHEMA *fuzz_tlv_schema(uint16_t type)
+{
+  if(type == 0 || type > FUZZ_NUM_TLV_TYPES) {
+    return NULL;
+  }
+
+  return &tlv_schema[type - 1];
+}
+
+/**
+ * Counts an input checked by fuzz_validate_input(), and the reason it was
+ * rejected if it was.
+ */
+static void fuzz_count_input(FUZZ_REJECT reason)
+{
+  __atomic_fetch_add(&validate_stats.inputs, 1, __ATOMIC_RELAXED);
+
+  if(reason != FUZZ_REJECT_NONE) {
+    __atomic_fetch_add(&validate_stats.rejected[reason], 1, __ATOMIC_RELAXED);
+    pthread_once(&validate_report_once, fuzz_validate_report_at_exit);
+  }
+}
+
+/**
+ * Counts an input that passed validation but that libcurl wouldn't accept
+ * the options for.
+ */
+void fuzz_count_setup_failure(void)
+{
+  __atomic_fetch_add(&validate_stats.rejected[FUZZ_REJECT_SETUP],
+                     1,
+                     __ATOMIC_RELAXED);
+  pthread_once(&validate_report_once, fuzz_validate_report_at_exit);
+}
+
+/**
+ * Prints the number of inputs rejected for each reason.
+ */
+void fuzz_validate_report(void)
+{
+  fprintf(stderr,
+          "FUZZ: rejected inputs: %lu checked, %lu truncated, %lu unknown "
+          "TLV, %lu duplicate TLV, %lu bad TLV value, %lu wrong protocol, "
+          "%lu refused by libcurl\n",
+          validate_stats.inputs,
+          validate_stats.rejected[FUZZ_REJECT_SIZE],
+          validate_stats.rejected[FUZZ_REJECT_UNKNOWN],
+          validate_stats.rejected[FUZZ_REJECT_DUPLICATE],
+          validate_stats.rejected[FUZZ_REJECT_VALUE],
+          validate_stats.rejected[FUZZ_REJECT_PROTOCOL],
+          validate_stats.rejected[FUZZ_REJECT_SETUP]);
+}
+
+/**
+ * First pass over an input. Every TLV is checked without touching libcurl,
+ * so that malformed inputs are thrown away before any handles are set up.
+ * Returns FUZZ_REJECT_NONE if the input can be run.
+ */
+FUZZ_REJECT fuzz_validate_input(const uint8_t *data, size_t data_len)
+{
+  FUZZ_VALIDATE_STATE vstate;
+  FUZZ_PARSE_STATE state;
+  FUZZ_REJECT reason = FUZZ_REJECT_NONE;
+  TLV tlv;
+  int tlv_rc;
+
+  memset(&vstate, 0, sizeof(FUZZ_VALIDATE_STATE));
+  vstate.allowed_protocols = fuzz_allowed_protocols();
+
+  memset(&state, 0, sizeof(FUZZ_PARSE_STATE));
+  state.data = data;
+  state.data_len = data_len;
+
+  for(tlv_rc = fuzz_get_first_tlv(&state, &tlv);
+      tlv_rc == 0;
+      tlv_rc = fuzz_get_next_tlv(&state, &tlv)) {
+    reason = fuzz_validate_tlv(&vstate, &tlv);
+    if(reason != FUZZ_REJECT_NONE) {
+      goto EXIT_LABEL;
+    }
+  }
+
+  if(tlv_rc != TLV_RC_NO_MORE_TLVS) {
+    reason = FUZZ_REJECT_SIZE;
+  }
+
+EXIT_LABEL:
+
+  fuzz_count_input(reason);
+
+  return reason;
+}
+
+/**
+ * Checks a single TLV in the first pass.
+ */
+FUZZ_REJECT fuzz_validate_tlv(FUZZ_VALIDATE_STATE *vstate, TLV *tlv)
+{
+  const FUZZ_TLV_SCHEMA *schema;
+  unsigned long url_protocol;
+  FUZZ_REJECT reason;
+
+  schema = fuzz_tlv_schema(tlv->type);
+  if(schema == NULL || schema->kind == FUZZ_TLV_MIME_FIELD) {
+    /* The fuzzer generates lots of unknown TLVs - we don't want these in the
+       corpus so we reject any unknown TLVs. */
+    return FUZZ_REJECT_UNKNOWN;
+  }
+
+  /* TLVs that only mean something for other protocols can't reach new
+     code. */
+  if((schema->protocols & vstate->allowed_protocols) == 0) {
+    return FUZZ_REJECT_PROTOCOL;
+  }
+
+  switch(schema->kind) {
+    case FUZZ_TLV_STRING:
+      /* String options can only have their value set once. */
+      if(FUZZ_TLV_SEEN(vstate, tlv->type)) {
+        return FUZZ_REJECT_DUPLICATE;
+      }
+
+      if(tlv->type == TLV_TYPE_URL) {
+        url_protocol = fuzz_url_protocol(tlv->value, tlv->length);
+        if(url_protocol != 0 &&
+           (url_protocol & vstate->allowed_protocols) == 0) {
+          return FUZZ_REJECT_PROTOCOL;
+        }
+      }
+      break;
+
+    case FUZZ_TLV_U32:
+      if(tlv->length != 4) {
+        return FUZZ_REJECT_VALUE;
+      }
+      if(FUZZ_TLV_SEEN(vstate, tlv->type)) {
+        return FUZZ_REJECT_DUPLICATE;
+      }
+      break;
+
+    case FUZZ_TLV_RESPONSE:
+      break;
+
+    default:
+      reason = fuzz_validate_special_tlv(vstate, tlv);
+      if(reason != FUZZ_REJECT_NONE) {
+        return reason;
+      }
+      break;
+  }
+
+  FSET_TLV_SEEN(vstate, tlv->type);
+
+  return FUZZ_REJECT_NONE;
+}
+
+/**
+ * Checks the TLVs that don't just set an option or a response in the first
+ * pass.
+ */
+FUZZ_REJECT fuzz_validate_special_tlv(FUZZ_VALIDATE_STATE *vstate, TLV *tlv)
+{
+  switch(tlv->type) {
+    case TLV_TYPE_UPLOAD1:
+    case TLV_TYPE_POSTFIELDS:
+      if(FUZZ_TLV_SEEN(vstate, tlv->type)) {
+        return FUZZ_REJECT_DUPLICATE;
+      }
+      break;
+
+    case TLV_TYPE_HEADER:
+      /* Limit the number of headers that can be added to a message to prevent
+         timeouts. */
+      if(vstate->header_count >= TLV_MAX_NUM_CURLOPT_HEADER) {
+        return FUZZ_REJECT_VALUE;
+      }
+      vstate->header_count++;
+      break;
+
+    case TLV_TYPE_MAIL_RECIPIENT:
+    case TLV_TYPE_MIME_PART:
+      /* A MIME part keeps the TLVs inside it up to the first bad one, so
+         it's never rejected. */
+      break;
+
+    case TLV_TYPE_CONNECTION_RESPONSE:
+      /* A response for any connection: one byte for the connection number,
+         one byte for the response number, then the response data. */
+      if(tlv->length < 2 ||
+         tlv->value[0] >= FUZZ_MAX_CONNECTIONS ||
+         tlv->value[1] >= TLV_MAX_NUM_RESPONSES) {
+        return FUZZ_REJECT_VALUE;
+      }
+      break;
+
+    case TLV_TYPE_RESPONSE_TRIGGER:
+      /* One byte each for the connection number, response number and
+         trigger type, then the delimiter or a 32-bit byte count. Response 0
+         is sent on connection, so can't have a trigger. */
+      if(tlv->length < 4 ||
+         tlv->value[0] >= FUZZ_MAX_CONNECTIONS ||
+         tlv->value[1] == 0 ||
+         tlv->value[1] >= TLV_MAX_NUM_RESPONSES) {
+        return FUZZ_REJECT_VALUE;
+      }
+
+      if(tlv->value[2] == FUZZ_TRIGGER_DELIMITER) {
+        if(tlv->length - 3 > FUZZ_MAX_TRIGGER_LEN) {
+          return FUZZ_REJECT_VALUE;
+        }
+      }
+      else if(tlv->value[2] != FUZZ_TRIGGER_BYTE_COUNT ||
+              tlv->length != 7 ||
+              to_u32(tlv->value + 3) == 0) {
+        return FUZZ_REJECT_VALUE;
+      }
+      break;
+
+    default:
+      /* Every SPECIAL TLV in the schema should be handled above. */
+      return FUZZ_REJECT_UNKNOWN;
+  }
+
+  return FUZZ_REJECT_NONE;
+}
+
+/**
+ * Do different actions on the CURL handle for different received TLVs. The
+ * input has already been checked by fuzz_validate_input().
  */
 int fuzz_parse_tlv(FUZZ_DATA *fuzz, TLV *tlv)
 {
   int rc;
-  char *tmp = NULL;
-  uint32_t tmp_u32;
+  const FUZZ_TLV_SCHEMA *schema;
+  FUZZ_SOCKET_MANAGER *sman;
+
+  schema = fuzz_tlv_schema(tlv->type);
+
+  switch(schema->kind) {
+    case FUZZ_TLV_STRING:
+      FTRY(curl_easy_setopt(fuzz->easy,
+                            schema->option,
+                            fuzz_tlv_to_string(tlv)));
+      break;
+
+    case FUZZ_TLV_U32:
+      FTRY(curl_easy_setopt(fuzz->easy,
+                            schema->option,
+                            (long)to_u32(tlv->value)));
+      break;
+
+    case FUZZ_TLV_RESPONSE:
+      /* The pointers in response TLVs will always be valid as long as the
+         fuzz data is in scope, which is the entirety of this file. */
+      sman = fuzz_get_sockman(fuzz, schema->connection);
+      sman->responses[schema->response].data = tlv->value;
+      sman->responses[schema->response].data_len = tlv->length;
+      break;
+
+    default:
+      FTRY(fuzz_parse_special_tlv(fuzz, tlv));
+      break;
+  }
+
+  rc = 0;
+
+EXIT_LABEL:
+
+  return rc;
+}
+
+/**
+ * Handles the TLVs that don't just set an option or a response.
+ */
+int fuzz_parse_special_tlv(FUZZ_DATA *fuzz, TLV *tlv)
+{
+  int rc;
+  FUZZ_SOCKET_MANAGER *sman;
+  FUZZ_RESPONSE *rsp;
 
   switch(tlv->type) {
-    /* The pointers in response TLVs will always be valid as long as the fuzz
-       data is in scope, which is the entirety of this file. */
-    FRESPONSETLV(&fuzz->sockman[0], TLV_TYPE_RESPONSE0, 0);
-    FRESPONSETLV(&fuzz->sockman[0], TLV_TYPE_RESPONSE1, 1);
-    FRESPONSETLV(&fuzz->sockman[0], TLV_TYPE_RESPONSE2, 2);
-    FRESPONSETLV(&fuzz->sockman[0], TLV_TYPE_RESPONSE3, 3);
-    FRESPONSETLV(&fuzz->sockman[0], TLV_TYPE_RESPONSE4, 4);
-    FRESPONSETLV(&fuzz->sockman[0], TLV_TYPE_RESPONSE5, 5);
-    FRESPONSETLV(&fuzz->sockman[0], TLV_TYPE_RESPONSE6, 6);
-    FRESPONSETLV(&fuzz->sockman[0], TLV_TYPE_RESPONSE7, 7);
-    FRESPONSETLV(&fuzz->sockman[0], TLV_TYPE_RESPONSE8, 8);
-    FRESPONSETLV(&fuzz->sockman[0], TLV_TYPE_RESPONSE9, 9);
-    FRESPONSETLV(&fuzz->sockman[0], TLV_TYPE_RESPONSE10, 10);
-
-    FRESPONSETLV(&fuzz->sockman[1], TLV_TYPE_SECOND_RESPONSE0, 0);
-    FRESPONSETLV(&fuzz->sockman[1], TLV_TYPE_SECOND_RESPONSE1, 1);
+    case TLV_TYPE_CONNECTION_RESPONSE:
+      sman = fuzz_get_sockman(fuzz, tlv->value[0]);
+      sman->responses[tlv->value[1]].data = tlv->value + 2;
+      sman->responses[tlv->value[1]].data_len = tlv->length - 2;
+      break;
+
+    case TLV_TYPE_RESPONSE_TRIGGER:
+      sman = fuzz_get_sockman(fuzz, tlv->value[0]);
+      rsp = &sman->responses[tlv->value[1]];
+
+      if(tlv->value[2] == FUZZ_TRIGGER_DELIMITER) {
+        rsp->trigger = tlv->value + 3;
+        rsp->trigger_len = tlv->length - 3;
+        rsp->trigger_bytes = 0;
+      }
+      else {
+        rsp->trigger = NULL;
+        rsp->trigger_len = 0;
+        rsp->trigger_bytes = to_u32(tlv->value + 3);
+      }
+      break;
 
     case TLV_TYPE_UPLOAD1:
       /* The pointers in the TLV will always be valid as long as the fuzz data
          is in scope, which is the entirety of this file. */
-
-      FCHECK_OPTION_UNSET(fuzz, CURLOPT_UPLOAD);
-
       fuzz->upload1_data = tlv->value;
       fuzz->upload1_data_len = tlv->length;
 
-      FSET_OPTION(fuzz, CURLOPT_UPLOAD, 1L);
-      FSET_OPTION(fuzz,
-                  CURLOPT_INFILESIZE_LARGE,
-                  (curl_off_t)fuzz->upload1_data_len);
+      FTRY(curl_easy_setopt(fuzz->easy, CURLOPT_UPLOAD, 1L));
+      FTRY(curl_easy_setopt(fuzz->easy,
+                            CURLOPT_INFILESIZE_LARGE,
+                            (curl_off_t)fuzz->upload1_data_len));
       break;
 
     case TLV_TYPE_HEADER:
-      /* Limit the number of headers that can be added to a message to prevent
-         timeouts. */
-      if(fuzz->header_list_count >= TLV_MAX_NUM_CURLOPT_HEADER) {
-        rc = 255;
-        goto EXIT_LABEL;
-      }
-
-      tmp = fuzz_tlv_to_string(tlv);
-      fuzz->header_list = curl_slist_append(fuzz->header_list, tmp);
-      fuzz->header_list_count++;
+      fuzz_slist_append(&fuzz->header_list,
+                        &fuzz->header_list_tail,
+                        fuzz_tlv_to_string(tlv));
       break;
 
     case TLV_TYPE_MAIL_RECIPIENT:
-      tmp = fuzz_tlv_to_string(tlv);
-      fuzz->mail_recipients_list =
-                            curl_slist_append(fuzz->mail_recipients_list, tmp);
+      fuzz_slist_append(&fuzz->mail_recipients_list,
+                        &fuzz->mail_recipients_tail,
+                        fuzz_tlv_to_string(tlv));
       break;
 
     case TLV_TYPE_MIME_PART:
@@ -165,42 +485,16 @@ int fuzz_parse_tlv(FUZZ_DATA *fuzz, TLV *tlv)
       break;
 
     case TLV_TYPE_POSTFIELDS:
-      FCHECK_OPTION_UNSET(fuzz, CURLOPT_POSTFIELDS);
-      fuzz->postfields = fuzz_tlv_to_string(tlv);
-      FSET_OPTION(fuzz, CURLOPT_POSTFIELDS, fuzz->postfields);
+      /* libcurl doesn't copy CURLOPT_POSTFIELDS, but the fuzz data stays in
+         scope for the whole transfer, so the data is sent straight from
+         there. */
+      FTRY(curl_easy_setopt(fuzz->easy,
+                            CURLOPT_POSTFIELDSIZE_LARGE,
+                            (curl_off_t)tlv->length));
+      FTRY(curl_easy_setopt(fuzz->easy, CURLOPT_POSTFIELDS, tlv->value));
       break;
 
-    /* Define a set of u32 options. */
-    FU32TLV(fuzz, TLV_TYPE_HTTPAUTH, CURLOPT_HTTPAUTH);
-    FU32TLV(fuzz, TLV_TYPE_OPTHEADER, CURLOPT_HEADER);
-    FU32TLV(fuzz, TLV_TYPE_NOBODY, CURLOPT_NOBODY);
-    FU32TLV(fuzz, TLV_TYPE_FOLLOWLOCATION, CURLOPT_FOLLOWLOCATION);
-    FU32TLV(fuzz, TLV_TYPE_WILDCARDMATCH, CURLOPT_WILDCARDMATCH);
-    FU32TLV(fuzz, TLV_TYPE_RTSP_REQUEST, CURLOPT_RTSP_REQUEST);
-    FU32TLV(fuzz, TLV_TYPE_RTSP_CLIENT_CSEQ, CURLOPT_RTSP_CLIENT_CSEQ);
-    FU32TLV(fuzz, TLV_TYPE_HTTP_VERSION, CURLOPT_HTTP_VERSION);
-
-    /* Define a set of singleton TLVs - they can only have their value set once
-       and all follow the same pattern. */
-    FSINGLETONTLV(fuzz, TLV_TYPE_URL, CURLOPT_URL);
-    FSINGLETONTLV(fuzz, TLV_TYPE_DOH_URL, CURLOPT_DOH_URL);
-    FSINGLETONTLV(fuzz, TLV_TYPE_USERNAME, CURLOPT_USERNAME);
-    FSINGLETONTLV(fuzz, TLV_TYPE_PASSWORD, CURLOPT_PASSWORD);
-    FSINGLETONTLV(fuzz, TLV_TYPE_COOKIE, CURLOPT_COOKIE);
-    FSINGLETONTLV(fuzz, TLV_TYPE_RANGE, CURLOPT_RANGE);
-    FSINGLETONTLV(fuzz, TLV_TYPE_CUSTOMREQUEST, CURLOPT_CUSTOMREQUEST);
-    FSINGLETONTLV(fuzz, TLV_TYPE_MAIL_FROM, CURLOPT_MAIL_FROM);
-    FSINGLETONTLV(fuzz, TLV_TYPE_ACCEPTENCODING, CURLOPT_ACCEPT_ENCODING);
-    FSINGLETONTLV(fuzz, TLV_TYPE_RTSP_SESSION_ID, CURLOPT_RTSP_SESSION_ID);
-    FSINGLETONTLV(fuzz, TLV_TYPE_RTSP_STREAM_URI, CURLOPT_RTSP_STREAM_URI);
-    FSINGLETONTLV(fuzz, TLV_TYPE_RTSP_TRANSPORT, CURLOPT_RTSP_TRANSPORT);
-    FSINGLETONTLV(fuzz, TLV_TYPE_MAIL_AUTH, CURLOPT_MAIL_AUTH);
-
     default:
-      /* The fuzzer generates lots of unknown TLVs - we don't want these in the
-         corpus so we reject any unknown TLVs. */
-      rc = 127;
-      goto EXIT_LABEL;
       break;
   }
 
@@ -208,27 +502,68 @@ int fuzz_parse_tlv(FUZZ_DATA *fuzz, TLV *tlv)
 
 EXIT_LABEL:
 
-  fuzz_free((void **)&tmp);
-
   return rc;
 }
 
 /**
- * Converts a TLV data and length into an allocated string.
+ * Create the key that frees each thread's scratch buffer as it exits.
+ */
+static void fuzz_tlv_scratch_key_create(void)
+{
+  pthread_key_create(&tlv_scratch_key, free);
+}
+
+/**
+ * Converts a TLV data and length into a string. The string is held in a
+ * scratch buffer and is only valid until the next call, which is fine for
+ * everything libcurl copies.
  */
 char *fuzz_tlv_to_string(TLV *tlv)
 {
   char *tlvstr;
 
-  /* Allocate enough space, plus a null terminator */
-  tlvstr = (char *)malloc(tlv->length + 1);
+  /* Make enough space, plus a null terminator */
+  if(tlv->length + 1 > tlv_scratch_size) {
+    tlvstr = (char *)realloc(tlv_scratch, tlv->length + 1);
+    if(tlvstr == NULL) {
+      return NULL;
+    }
+    tlv_scratch = tlvstr;
+    tlv_scratch_size = tlv->length + 1;
+
+    pthread_once(&tlv_scratch_once, fuzz_tlv_scratch_key_create);
+    pthread_setspecific(tlv_scratch_key, tlv_scratch);
+  }
+
+  memcpy(tlv_scratch, tlv->value, tlv->length);
+  tlv_scratch[tlv->length] = 0;
 
-  if(tlvstr != NULL) {
-    memcpy(tlvstr, tlv->value, tlv->length);
-    tlvstr[tlv->length] = 0;
+  return tlv_scratch;
+}
+
+/**
+ * Appends a copy of a string to a list, keeping track of the end of the list
+ * so that appending doesn't have to walk the whole list like
+ * curl_slist_append() does.
+ */
+void fuzz_slist_append(struct curl_slist **list,
+                       struct curl_slist **tail,
+                       const char *string)
+{
+  struct curl_slist *item;
+
+  item = curl_slist_append(NULL, string);
+  if(item == NULL) {
+    return;
   }
 
-  return tlvstr;
+  if(*list == NULL) {
+    *list = item;
+  }
+  else {
+    (*tail)->next = item;
+  }
+  *tail = item;
 }
 
 /**
@@ -236,12 +571,12 @@ char *fuzz_tlv_to_string(TLV *tlv)
  */
 int fuzz_add_mime_part(TLV *src_tlv, curl_mimepart *part)
 {
-  FUZZ_DATA part_fuzz;
+  FUZZ_PARSE_STATE part_state;
   TLV tlv;
   int rc = 0;
   int tlv_rc;
 
-  memset(&part_fuzz, 0, sizeof(FUZZ_DATA));
+  memset(&part_state, 0, sizeof(FUZZ_PARSE_STATE));
 
   if(src_tlv->length < sizeof(TLV_RAW)) {
     /* Not enough data for a single TLV - don't continue */
@@ -249,12 +584,12 @@ int fuzz_add_mime_part(TLV *src_tlv, curl_mimepart *part)
   }
 
   /* Set up the state parser */
-  part_fuzz.state.data = src_tlv->value;
-  part_fuzz.state.data_len = src_tlv->length;
+  part_state.data = src_tlv->value;
+  part_state.data_len = src_tlv->length;
 
-  for(tlv_rc = fuzz_get_first_tlv(&part_fuzz, &tlv);
+  for(tlv_rc = fuzz_get_first_tlv(&part_state, &tlv);
       tlv_rc == 0;
-      tlv_rc = fuzz_get_next_tlv(&part_fuzz, &tlv)) {
+      tlv_rc = fuzz_get_next_tlv(&part_state, &tlv)) {
 
     /* Have the TLV in hand. Parse the TLV. */
     rc = fuzz_parse_mime_tlv(part, &tlv);
@@ -287,7 +622,6 @@ int fuzz_parse_mime_tlv(curl_mimepart *part, TLV *tlv)
     case TLV_TYPE_MIME_PART_NAME:
       tmp = fuzz_tlv_to_string(tlv);
       curl_mime_name(part, tmp);
-      fuzz_free((void **)&tmp);
       break;
 
     case TLV_TYPE_MIME_PART_DATA:
@@ -0,0 +1,989 @@
+/***************************************************************************
+ *                                  _   _ ____  _
+ *  Project                     ___| | | |  _ \| |
+ *                             / __| | | | |_) | |
+ *                            | (__| |_| |  _ <| |___
+ *                             \___|\___/|_| \_\_____|
+ *
+ * Copyright (C) 2017, Max Dymond, <cmeister2@gmail.com>, et al.
+ *
+ * This software is licensed as described in the file COPYING, which
+ * you should have received as part of this distribution. The terms
+ * are also available at https://curl.haxx.se/docs/copyright.html.
+ *
+ * You may opt to use, copy, modify, merge, publish, distribute and/or sell
+ * copies of the Software, and permit persons to whom the Software is
+ * furnished to do so, under the terms of the COPYING file.
+ *
+ * This software is distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY
+ * KIND, either express or implied.
+ *
+ ***************************************************************************/
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <curl/curl.h>
+#include "curl_fuzzer.h"
+
+/**
+ * Define a macro which checks to see that allocated file descriptors are
+ * valid and won't cause issue with FD_SETs.  Taken from lib/select.h
+ */
+#define FUZZ_VALID_SOCK(s) (((s) >= 0) && ((s) < FD_SETSIZE))
+
+typedef ssize_t (*read_func)(int, void *, size_t);
+typedef ssize_t (*recv_func)(int, void *, size_t, int);
+typedef ssize_t (*send_func)(int, const void *, size_t, int);
+typedef ssize_t (*recvfrom_func)(int, void *, size_t, int,
+                                 struct sockaddr *, socklen_t *);
+typedef ssize_t (*sendto_func)(int, const void *, size_t, int,
+                               const struct sockaddr *, socklen_t);
+typedef int (*poll_func)(struct pollfd *, nfds_t, int);
+typedef int (*close_func)(int);
+typedef int (*connect_func)(int, const struct sockaddr *, socklen_t);
+typedef int (*getname_func)(int, struct sockaddr *, socklen_t *);
+
+/* In-memory sockets, and how many of them are in use. libcurl only touches a
+   socket from the thread that opened it, so each thread has its own. */
+static thread_local FUZZ_MEMSOCK memsocks[FUZZ_MAX_MEMSOCKS];
+static thread_local int memsock_count;
+
+/* Socket whose file descriptor is duplicated to give each in-memory socket a
+   file descriptor number of its own. */
+static thread_local int memsock_template = -1;
+
+/* Socket pairs kept for reuse by the socketpair transport, and how many of
+   them are handed out to the current run. */
+static thread_local FUZZ_SOCKPAIR sockpairs[FUZZ_SOCKPAIR_POOL_SIZE];
+static thread_local int sockpair_count;
+
+/* Socket pair pool statistics, summed over all threads. */
+static unsigned long sockpair_hits;
+static unsigned long sockpair_misses;
+static pthread_once_t sockpair_report_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * Look up the real implementation of an interposed function.
+ */
+static void *fuzz_real_func(void **cache, const char *name)
+{
+  void *func = __atomic_load_n(cache, __ATOMIC_RELAXED);
+
+  if(func == NULL) {
+    func = dlsym(RTLD_NEXT, name);
+    __atomic_store_n(cache, func, __ATOMIC_RELAXED);
+  }
+  return func;
+}
+
+#define FUZZ_REAL(TYPE, NAME)                                                 \
+        ((TYPE)fuzz_real_func(&real_##NAME, #NAME))
+
+static void *real_read;
+static void *real_recv;
+static void *real_send;
+static void *real_recvfrom;
+static void *real_sendto;
+static void *real_poll;
+static void *real_close;
+static void *real_connect;
+static void *real_getpeername;
+
+/**
+ * Find the in-memory socket for a file descriptor, if there is one.
+ */
+static FUZZ_MEMSOCK *fuzz_memsock_find(int fd)
+{
+  int ii;
+
+  if(memsock_count == 0 || fd < 0) {
+    return NULL;
+  }
+
+  /* Once libcurl has closed the client end, the file descriptor number can
+     be handed out again, for example to the next connection. */
+  for(ii = 0; ii < FUZZ_MAX_MEMSOCKS; ii++) {
+    if(memsocks[ii].fd == fd && !memsocks[ii].client_closed) {
+      return &memsocks[ii];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Stop using an in-memory socket once both ends have been closed.
+ */
+static void fuzz_memsock_free(FUZZ_MEMSOCK *ms)
+{
+  ms->fd = CURL_SOCKET_BAD;
+  ms->responses = NULL;
+  memsock_count--;
+}
+
+/**
+ * Create an in-memory socket for a socket manager.
+ */
+static curl_socket_t fuzz_memsock_open(FUZZ_SOCKET_MANAGER *sman)
+{
+  FUZZ_MEMSOCK *ms = NULL;
+  int fd;
+  int ii;
+
+  for(ii = 0; ii < FUZZ_MAX_MEMSOCKS; ii++) {
+    if(memsocks[ii].fd == CURL_SOCKET_BAD || memsock_count == 0) {
+      ms = &memsocks[ii];
+      break;
+    }
+  }
+
+  if(ms == NULL) {
+    /* Too many in-memory sockets. This ought to be quite rare. */
+    printf("FUZZ[%d]: Not opening socket as %d in-memory sockets are open\n",
+           sman->index,
+           FUZZ_MAX_MEMSOCKS);
+    return CURL_SOCKET_BAD;
+  }
+
+  if(memsock_template == -1) {
+    memsock_template = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(memsock_template == -1) {
+      return CURL_SOCKET_BAD;
+    }
+  }
+
+  /* libcurl still needs a real file descriptor so that nothing else can be
+     given the same number while the socket is in use. */
+  fd = dup(memsock_template);
+  if(fd == -1) {
+    return CURL_SOCKET_BAD;
+  }
+
+  if(!FUZZ_VALID_SOCK(fd)) {
+    printf("FUZZ[%d]: Not using file descriptor %d as FD_SETSIZE is %d\n",
+           sman->index,
+           fd,
+           FD_SETSIZE);
+    FUZZ_REAL(close_func, close)(fd);
+    return CURL_SOCKET_BAD;
+  }
+
+  if(memsock_count == 0) {
+    /* Nothing is in use, so reset every slot. */
+    for(ii = 0; ii < FUZZ_MAX_MEMSOCKS; ii++) {
+      memsocks[ii].fd = CURL_SOCKET_BAD;
+    }
+  }
+
+  ms->fd = fd;
+  ms->responses = sman->responses;
+  ms->rx_queued = 0;
+  ms->rx_index = 0;
+  ms->rx_offset = 0;
+  ms->rx_shutdown = 0;
+  ms->tx_len = 0;
+  ms->server_closed = 0;
+  ms->client_closed = 0;
+  memsock_count++;
+
+  sman->memsock = ms;
+  sman->fd = -1;
+
+  return fd;
+}
+
+/**
+ * Read data the server has sent to the client over an in-memory socket.
+ */
+static ssize_t fuzz_memsock_recv(FUZZ_MEMSOCK *ms,
+                                 void *buf,
+                                 size_t len,
+                                 int flags)
+{
+  uint8_t *out = (uint8_t *)buf;
+  size_t copied = 0;
+  size_t chunk;
+  int index = ms->rx_index;
+  size_t offset = ms->rx_offset;
+  const FUZZ_RESPONSE *rsp;
+
+  while(copied < len && ms->responses != NULL && index < ms->rx_queued) {
+    rsp = &ms->responses[index];
+
+    if(rsp->data == NULL || offset >= rsp->data_len) {
+      /* Move on to the next response. */
+      index++;
+      offset = 0;
+      continue;
+    }
+
+    chunk = FUZZ_MIN(len - copied, rsp->data_len - offset);
+    memcpy(&out[copied], &rsp->data[offset], chunk);
+    copied += chunk;
+    offset += chunk;
+  }
+
+  if(!(flags & MSG_PEEK)) {
+    ms->rx_index = index;
+    ms->rx_offset = offset;
+  }
+
+  if(copied > 0 || len == 0) {
+    return (ssize_t)copied;
+  }
+
+  if(ms->rx_shutdown || ms->server_closed) {
+    /* End of file. */
+    return 0;
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+/**
+ * Returns whether the client has data waiting on an in-memory socket.
+ */
+static int fuzz_memsock_rx_pending(FUZZ_MEMSOCK *ms)
+{
+  uint8_t peek;
+
+  return fuzz_memsock_recv(ms, &peek, 1, MSG_PEEK) > 0;
+}
+
+/**
+ * Send data from the client to the server over an in-memory socket.
+ */
+static ssize_t fuzz_memsock_send(FUZZ_MEMSOCK *ms,
+                                 const void *buf,
+                                 size_t len)
+{
+  size_t space;
+
+  if(ms->server_closed) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  space = sizeof(ms->tx_buf) - ms->tx_len;
+  if(space == 0 && len > 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  len = FUZZ_MIN(len, space);
+  memcpy(&ms->tx_buf[ms->tx_len], buf, len);
+  ms->tx_len += len;
+
+  return (ssize_t)len;
+}
+
+/**
+ * Work out poll() events for the client end of an in-memory socket.
+ */
+static short fuzz_memsock_revents(FUZZ_MEMSOCK *ms, short events)
+{
+  short revents = 0;
+
+  if((events & POLLIN) &&
+     (ms->rx_shutdown || ms->server_closed || fuzz_memsock_rx_pending(ms))) {
+    revents |= POLLIN;
+  }
+
+  if(ms->server_closed) {
+    revents |= POLLHUP;
+  }
+  else if((events & POLLOUT) && ms->tx_len < sizeof(ms->tx_buf)) {
+    revents |= POLLOUT;
+  }
+
+  return revents;
+}
+
+/**
+ * Create a non-blocking socket pair whose file descriptors fit in an fd_set.
+ * fds[0] is the server end and fds[1] the client end.
+ */
+static int fuzz_sockpair_create(FUZZ_SOCKET_MANAGER *sman, int fds[2])
+{
+  FUZZ_PROFILE_COUNT(FUZZ_CALL_SOCKETPAIR);
+  if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds)) {
+    /* Failed to create a pair of sockets. */
+    return -1;
+  }
+
+  if(!FUZZ_VALID_SOCK(fds[0]) || !FUZZ_VALID_SOCK(fds[1])) {
+    /* One or more of the file descriptors is too large to fit in an fd_set,
+       so reject it here. Print out a message because this ought to be quite
+       rare. */
+    printf("FUZZ[%d]: Not using file descriptors %d,%d as FD_SETSIZE is %d\n",
+           sman->index,
+           fds[0],
+           fds[1],
+           FD_SETSIZE);
+
+    /* Close the file descriptors so they don't leak. */
+    close(fds[0]);
+    close(fds[1]);
+
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Print socket pair pool statistics.
+ */
+static void fuzz_sockpair_report(void)
+{
+  fprintf(stderr,
+          "FUZZ: socket pair pool: %lu hits, %lu misses\n",
+          sockpair_hits,
+          sockpair_misses);
+}
+
+/**
+ * Arrange for the socket pair pool statistics to be printed at exit.
+ */
+static void fuzz_sockpair_report_at_exit(void)
+{
+  atexit(fuzz_sockpair_report);
+}
+
+/**
+ * Hand out a socket pair from the pool, creating it if need be. Returns NULL
+ * if every pair is in use.
+ */
+static FUZZ_SOCKPAIR *fuzz_sockpair_take(FUZZ_SOCKET_MANAGER *sman)
+{
+  FUZZ_SOCKPAIR *pair = NULL;
+  int fds[2];
+  int ii;
+
+  pthread_once(&sockpair_report_once, fuzz_sockpair_report_at_exit);
+
+  for(ii = 0; ii < FUZZ_SOCKPAIR_POOL_SIZE; ii++) {
+    if(!sockpairs[ii].in_use) {
+      pair = &sockpairs[ii];
+      break;
+    }
+  }
+
+  if(pair == NULL) {
+    __atomic_fetch_add(&sockpair_misses, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  if(pair->created) {
+    __atomic_fetch_add(&sockpair_hits, 1, __ATOMIC_RELAXED);
+  }
+  else {
+    __atomic_fetch_add(&sockpair_misses, 1, __ATOMIC_RELAXED);
+    if(fuzz_sockpair_create(sman, fds) != 0) {
+      return NULL;
+    }
+
+    pair->server_fd = fds[0];
+    pair->client_fd = fds[1];
+    pair->created = 1;
+  }
+
+  pair->in_use = 1;
+  pair->eof = 0;
+  pair->client_closed = 0;
+  sockpair_count++;
+
+  return pair;
+}
+
+/**
+ * Find the pooled socket pair a file descriptor belongs to in this run, if
+ * there is one.
+ */
+static FUZZ_SOCKPAIR *fuzz_sockpair_find(int fd)
+{
+  int ii;
+
+  if(sockpair_count == 0 || fd < 0) {
+    return NULL;
+  }
+
+  for(ii = 0; ii < FUZZ_SOCKPAIR_POOL_SIZE; ii++) {
+    if(sockpairs[ii].in_use &&
+       (sockpairs[ii].server_fd == fd || sockpairs[ii].client_fd == fd)) {
+      return &sockpairs[ii];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Returns whether a read from a pooled socket pair file descriptor should
+ * see the end of file the pair never really signals: the client once the
+ * server has sent everything, and the server once libcurl has closed the
+ * client end.
+ */
+static int fuzz_sockpair_at_eof(int fd)
+{
+  FUZZ_SOCKPAIR *pair = fuzz_sockpair_find(fd);
+
+  if(pair == NULL) {
+    return 0;
+  }
+
+  if(fd == pair->client_fd) {
+    return pair->eof && !pair->client_closed;
+  }
+
+  return pair->client_closed;
+}
+
+/**
+ * Mark file descriptors in readfds that are at an emulated end of file in
+ * pending, for select(), which can't see it. Returns how many there are.
+ */
+int fuzz_sockpair_select_pending(int nfds, fd_set *readfds, fd_set *pending)
+{
+  FUZZ_SOCKPAIR *pair;
+  curl_socket_t fds[2];
+  int count = 0;
+  int ii;
+  int jj;
+
+  FD_ZERO(pending);
+
+  for(ii = 0; ii < FUZZ_SOCKPAIR_POOL_SIZE && sockpair_count > 0; ii++) {
+    pair = &sockpairs[ii];
+    if(!pair->in_use) {
+      continue;
+    }
+
+    fds[0] = pair->server_fd;
+    fds[1] = pair->client_fd;
+
+    for(jj = 0; jj < 2; jj++) {
+      if(fds[jj] < nfds &&
+         FD_ISSET(fds[jj], readfds) &&
+         fuzz_sockpair_at_eof(fds[jj])) {
+        FD_SET(fds[jj], pending);
+        count++;
+      }
+    }
+  }
+
+  return count;
+}
+
+/**
+ * Read and throw away anything waiting on one end of a socket pair. Returns
+ * non-zero if the pair has been broken, so it can't be reused.
+ */
+static int fuzz_sockpair_drain(curl_socket_t fd)
+{
+  char buffer[4096];
+  ssize_t got;
+
+  do {
+    got = FUZZ_REAL(recv_func, recv)(fd, buffer, sizeof(buffer), 0);
+  } while(got > 0);
+
+  return got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+/**
+ * Return the socket pairs used by a run to the pool. A pair whose client end
+ * libcurl still holds, for example in a connection cache, belongs to libcurl
+ * now: the server end is closed so libcurl sees the connection drop, and the
+ * slot gets a new pair next time.
+ */
+static void fuzz_sockpair_end_run(void)
+{
+  FUZZ_SOCKPAIR *pair;
+  int ii;
+
+  for(ii = 0; ii < FUZZ_SOCKPAIR_POOL_SIZE && sockpair_count > 0; ii++) {
+    pair = &sockpairs[ii];
+    if(!pair->in_use) {
+      continue;
+    }
+
+    if(!pair->client_closed) {
+      FUZZ_REAL(close_func, close)(pair->server_fd);
+      pair->created = 0;
+    }
+    else if(fuzz_sockpair_drain(pair->server_fd) ||
+            fuzz_sockpair_drain(pair->client_fd)) {
+      FUZZ_REAL(close_func, close)(pair->server_fd);
+      FUZZ_REAL(close_func, close)(pair->client_fd);
+      pair->created = 0;
+    }
+
+    pair->in_use = 0;
+    sockpair_count--;
+  }
+}
+
+/**
+ * Open the server side of a connection and return the client side for
+ * libcurl to use.
+ */
+curl_socket_t fuzz_sman_open(FUZZ_DATA *fuzz, FUZZ_SOCKET_MANAGER *sman)
+{
+  int fds[2];
+
+  sman->memsock = NULL;
+  sman->sockpair = NULL;
+
+  if(fuzz->transport == FUZZ_TRANSPORT_MEMORY) {
+    return fuzz_memsock_open(sman);
+  }
+
+  sman->sockpair = fuzz_sockpair_take(sman);
+  if(sman->sockpair != NULL) {
+    sman->fd = sman->sockpair->server_fd;
+    return sman->sockpair->client_fd;
+  }
+
+  /* The pool is used up, so fall back to a pair of the connection's own. */
+  if(fuzz_sockpair_create(sman, fds) != 0) {
+    return CURL_SOCKET_BAD;
+  }
+
+  sman->fd = fds[0];
+
+  /* Return the other half of the socket pair. */
+  return fds[1];
+}
+
+/**
+ * Send a response from the server to the client. Returns 0 if the whole
+ * response was sent.
+ */
+int fuzz_sman_send(FUZZ_SOCKET_MANAGER *sman, int index)
+{
+  const uint8_t *data = sman->responses[index].data;
+  size_t data_len = sman->responses[index].data_len;
+  FUZZ_MEMSOCK *ms = sman->memsock;
+
+  if(data == NULL) {
+    return 0;
+  }
+
+  if(ms != NULL) {
+    if(ms->client_closed) {
+      return -1;
+    }
+
+    /* The response is read by the client straight from the fuzzing data. */
+    ms->rx_queued = FUZZ_MAX(ms->rx_queued, index + 1);
+    return 0;
+  }
+
+  if(sman->sockpair != NULL && sman->sockpair->client_closed) {
+    /* The client end is still open in the pool, but not to libcurl. */
+    errno = EPIPE;
+    return -1;
+  }
+
+  FUZZ_PROFILE_COUNT(FUZZ_CALL_WRITE);
+  if(write(sman->fd, data, data_len) != (ssize_t)data_len) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Read data the client has sent to the server. Behaves like read() on a
+ * non-blocking socket.
+ */
+ssize_t fuzz_sman_read(FUZZ_SOCKET_MANAGER *sman, char *buffer, size_t len)
+{
+  FUZZ_MEMSOCK *ms = sman->memsock;
+
+  if(ms == NULL) {
+    FUZZ_PROFILE_COUNT(FUZZ_CALL_READ);
+    return read(sman->fd, buffer, len);
+  }
+
+  if(ms->tx_len > 0) {
+    len = FUZZ_MIN(len, ms->tx_len);
+    memcpy(buffer, ms->tx_buf, len);
+    memmove(ms->tx_buf, &ms->tx_buf[len], ms->tx_len - len);
+    ms->tx_len -= len;
+    return (ssize_t)len;
+  }
+
+  if(ms->client_closed) {
+    return 0;
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+/**
+ * Returns whether the server side of an in-memory socket has anything to
+ * read. Socket pairs are polled by the transfer engines instead.
+ */
+int fuzz_sman_readable(FUZZ_SOCKET_MANAGER *sman)
+{
+  FUZZ_MEMSOCK *ms = sman->memsock;
+
+  return ms != NULL && (ms->tx_len > 0 || ms->client_closed);
+}
+
+/**
+ * Shut down the server side for writing, so the client sees end of file once
+ * it has read all the responses. A pooled socket pair is left open so it can
+ * be reused, and the end of file is emulated instead.
+ */
+void fuzz_sman_shutdown(FUZZ_SOCKET_MANAGER *sman)
+{
+  if(sman->memsock != NULL) {
+    sman->memsock->rx_shutdown = 1;
+  }
+  else if(sman->sockpair != NULL) {
+    sman->sockpair->eof = 1;
+  }
+  else {
+    shutdown(sman->fd, SHUT_WR);
+  }
+}
+
+/**
+ * Close the server side of a connection.
+ */
+void fuzz_sman_close(FUZZ_SOCKET_MANAGER *sman)
+{
+  FUZZ_MEMSOCK *ms = sman->memsock;
+
+  if(sman->sockpair != NULL) {
+    /* The server end stays open in the pool. */
+    sman->sockpair = NULL;
+    return;
+  }
+
+  if(ms == NULL) {
+    close(sman->fd);
+    return;
+  }
+
+  ms->server_closed = 1;
+  if(ms->client_closed) {
+    fuzz_memsock_free(ms);
+  }
+  sman->memsock = NULL;
+}
+
+/**
+ * Called when a fuzzing run has finished with libcurl. Any in-memory socket
+ * libcurl hasn't closed yet must not refer to the run's data any more, and
+ * pooled socket pairs are made ready for the next run.
+ */
+void fuzz_transport_end_run(void)
+{
+  int ii;
+
+  fuzz_sockpair_end_run();
+
+  for(ii = 0; ii < FUZZ_MAX_MEMSOCKS && memsock_count > 0; ii++) {
+    if(memsocks[ii].fd != CURL_SOCKET_BAD) {
+      memsocks[ii].responses = NULL;
+      memsocks[ii].server_closed = 1;
+    }
+  }
+}
+
+/**
+ * Wait in poll() for real file descriptors, using the virtual clock if it is
+ * in use. If no file descriptor is ready straight away when using virtual
+ * time, nothing else can make one ready during the wait: the clock is moved
+ * forward by the whole timeout and the wait returns as if it had timed out.
+ */
+static int fuzz_poll_wait(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+  int rc;
+
+  FUZZ_PROFILE_COUNT(FUZZ_CALL_POLL);
+
+  if(!fuzz_vclock_is_active() || timeout <= 0) {
+    /* Non-blocking and infinite waits are left alone. */
+    return FUZZ_REAL(poll_func, poll)(fds, nfds, timeout);
+  }
+
+  rc = FUZZ_REAL(poll_func, poll)(fds, nfds, 0);
+
+  if(rc == 0) {
+    fuzz_vclock_advance(timeout);
+  }
+
+  return rc;
+}
+
+/**
+ * Interposes poll(). In-memory sockets are answered without entering the
+ * kernel, and the remaining file descriptors are passed on to the real
+ * poll(). Pooled socket pairs at an emulated end of file are readable
+ * whatever the real poll() says.
+ */
+extern "C" int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+  FUZZ_MEMSOCK *ms;
+  nfds_t ii;
+  nfds_t emulated = 0;
+  int ready = 0;
+  int at_eof = 0;
+  int rc = 0;
+
+  for(ii = 0; ii < nfds && memsock_count > 0; ii++) {
+    ms = fuzz_memsock_find(fds[ii].fd);
+    if(ms != NULL) {
+      emulated++;
+      if(fuzz_memsock_revents(ms, fds[ii].events) != 0) {
+        ready++;
+      }
+
+      /* Hide the file descriptor from the real poll(). */
+      fds[ii].fd = ~fds[ii].fd;
+    }
+  }
+
+  for(ii = 0; ii < nfds && sockpair_count > 0; ii++) {
+    if((fds[ii].events & POLLIN) && fuzz_sockpair_at_eof(fds[ii].fd)) {
+      at_eof++;
+    }
+  }
+
+  if(emulated == 0 && at_eof == 0) {
+    return fuzz_poll_wait(fds, nfds, timeout);
+  }
+
+  if(emulated == nfds && timeout < 0) {
+    /* Only this thread can make its in-memory sockets ready, so an infinite
+       wait on nothing but them would never return. */
+    timeout = 0;
+  }
+
+  if(emulated < nfds || (ready == 0 && timeout != 0)) {
+    /* Poll the real file descriptors, or wait for the timeout. */
+    rc = fuzz_poll_wait(fds, nfds, ready + at_eof > 0 ? 0 : timeout);
+  }
+  else {
+    FUZZ_PROFILE_COUNT(FUZZ_CALL_EMULATED);
+  }
+
+  for(ii = 0; ii < nfds; ii++) {
+    if(fds[ii].fd < 0 && (ms = fuzz_memsock_find(~fds[ii].fd)) != NULL) {
+      fds[ii].fd = ~fds[ii].fd;
+      fds[ii].revents = fuzz_memsock_revents(ms, fds[ii].events);
+    }
+  }
+
+  if(rc < 0) {
+    return rc;
+  }
+
+  for(ii = 0; ii < nfds && at_eof > 0; ii++) {
+    if((fds[ii].events & POLLIN) && fuzz_sockpair_at_eof(fds[ii].fd)) {
+      if(fds[ii].revents == 0) {
+        rc++;
+      }
+      fds[ii].revents |= POLLIN;
+    }
+  }
+
+  return rc + ready;
+}
+
+/**
+ * Interposes recv() for in-memory sockets, and for pooled socket pairs at an
+ * emulated end of file once their real data has been read.
+ */
+extern "C" ssize_t recv(int sockfd, void *buf, size_t len, int flags)
+{
+  FUZZ_MEMSOCK *ms = fuzz_memsock_find(sockfd);
+  int saved_errno = errno;
+  ssize_t rc;
+
+  if(ms == NULL) {
+    FUZZ_PROFILE_COUNT(FUZZ_CALL_READ);
+    rc = FUZZ_REAL(recv_func, recv)(sockfd, buf, len, flags);
+
+    if(rc == -1 && errno == EAGAIN && fuzz_sockpair_at_eof(sockfd)) {
+      /* A real end of file leaves errno alone. */
+      errno = saved_errno;
+      return 0;
+    }
+    return rc;
+  }
+
+  FUZZ_PROFILE_COUNT(FUZZ_CALL_EMULATED);
+  return fuzz_memsock_recv(ms, buf, len, flags);
+}
+
+/**
+ * Interposes read() for pooled socket pairs at an emulated end of file. The
+ * server end is read this way, and so are LDAP connections.
+ */
+extern "C" ssize_t read(int fd, void *buf, size_t count)
+{
+  int saved_errno = errno;
+  ssize_t rc = FUZZ_REAL(read_func, read)(fd, buf, count);
+
+  if(rc == -1 && errno == EAGAIN && fuzz_sockpair_at_eof(fd)) {
+    errno = saved_errno;
+    return 0;
+  }
+
+  return rc;
+}
+
+/**
+ * Interposes send() for in-memory sockets.
+ */
+extern "C" ssize_t send(int sockfd, const void *buf, size_t len, int flags)
+{
+  FUZZ_MEMSOCK *ms = fuzz_memsock_find(sockfd);
+
+  if(ms == NULL) {
+    FUZZ_PROFILE_COUNT(FUZZ_CALL_WRITE);
+    return FUZZ_REAL(send_func, send)(sockfd, buf, len, flags);
+  }
+
+  FUZZ_PROFILE_COUNT(FUZZ_CALL_EMULATED);
+  return fuzz_memsock_send(ms, buf, len);
+}
+
+/**
+ * Interposes recvfrom() for in-memory sockets. Like a socket pair, the peer
+ * has no address.
+ */
+extern "C" ssize_t recvfrom(int sockfd,
+                            void *buf,
+                            size_t len,
+                            int flags,
+                            struct sockaddr *src_addr,
+                            socklen_t *addrlen)
+{
+  FUZZ_MEMSOCK *ms = fuzz_memsock_find(sockfd);
+  int saved_errno = errno;
+  ssize_t rc;
+
+  if(ms == NULL) {
+    FUZZ_PROFILE_COUNT(FUZZ_CALL_READ);
+    rc = FUZZ_REAL(recvfrom_func, recvfrom)(sockfd, buf, len, flags,
+                                            src_addr, addrlen);
+
+    if(rc == -1 && errno == EAGAIN && fuzz_sockpair_at_eof(sockfd)) {
+      errno = saved_errno;
+      return 0;
+    }
+    return rc;
+  }
+
+  FUZZ_PROFILE_COUNT(FUZZ_CALL_EMULATED);
+  rc = fuzz_memsock_recv(ms, buf, len, flags);
+
+  if(rc >= 0 && src_addr != NULL && addrlen != NULL &&
+     *addrlen >= sizeof(sa_family_t)) {
+    src_addr->sa_family = AF_UNIX;
+    *addrlen = sizeof(sa_family_t);
+  }
+
+  return rc;
+}
+
+/**
+ * Interposes sendto() for in-memory sockets. Like a socket pair, they are
+ * already connected so a destination address is refused.
+ */
+extern "C" ssize_t sendto(int sockfd,
+                          const void *buf,
+                          size_t len,
+                          int flags,
+                          const struct sockaddr *dest_addr,
+                          socklen_t addrlen)
+{
+  FUZZ_MEMSOCK *ms = fuzz_memsock_find(sockfd);
+
+  if(ms == NULL) {
+    FUZZ_PROFILE_COUNT(FUZZ_CALL_WRITE);
+    return FUZZ_REAL(sendto_func, sendto)(sockfd, buf, len, flags,
+                                          dest_addr, addrlen);
+  }
+
+  FUZZ_PROFILE_COUNT(FUZZ_CALL_EMULATED);
+
+  if(dest_addr != NULL && addrlen > 0) {
+    errno = EISCONN;
+    return -1;
+  }
+
+  return fuzz_memsock_send(ms, buf, len);
+}
+
+/**
+ * Interposes connect(). In-memory sockets are already connected.
+ */
+extern "C" int connect(int sockfd, const struct sockaddr *addr,
+                       socklen_t addrlen)
+{
+  if(fuzz_memsock_find(sockfd) != NULL) {
+    return 0;
+  }
+
+  return FUZZ_REAL(connect_func, connect)(sockfd, addr, addrlen);
+}
+
+/**
+ * Interposes getpeername() for in-memory sockets. The template socket was
+ * never connected, so report an unnamed peer like a socket pair does.
+ */
+extern "C" int getpeername(int sockfd, struct sockaddr *addr,
+                           socklen_t *addrlen) __THROW
+{
+  if(fuzz_memsock_find(sockfd) == NULL) {
+    return FUZZ_REAL(getname_func, getpeername)(sockfd, addr, addrlen);
+  }
+
+  if(*addrlen >= sizeof(sa_family_t)) {
+    addr->sa_family = AF_UNIX;
+  }
+  *addrlen = sizeof(sa_family_t);
+  return 0;
+}
+
+/**
+ * Interposes close() so the harness knows when libcurl has closed the client
+ * end of an in-memory socket or pooled socket pair. The client end of a
+ * pooled pair stays open for the next run.
+ */
+extern "C" int close(int fd)
+{
+  FUZZ_MEMSOCK *ms = fuzz_memsock_find(fd);
+  FUZZ_SOCKPAIR *pair = fuzz_sockpair_find(fd);
+
+  if(pair != NULL && fd == pair->client_fd) {
+    pair->client_closed = 1;
+    return 0;
+  }
+
+  if(ms != NULL) {
+    ms->client_closed = 1;
+    if(ms->server_closed) {
+      fuzz_memsock_free(ms);
+    }
+  }
+
+  return FUZZ_REAL(close_func, close)(fd);
+}
@@ -0,0 +1,246 @@
+#!/usr/bin/env python
+#
+# Script which shrinks each fuzzer's seed corpus to a subset of inputs that
+# still hits every coverage feature the whole corpus hits, preferring small
+# and fast inputs.
+
+import argparse
+import heapq
+import json
+import logging
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+log = logging.getLogger(__name__)
+
+
+class CorpusInput(object):
+    """An input along with its size, run time and coverage features."""
+    def __init__(self, path, size, wall_us, features):
+        self.path = path
+        self.size = size
+        self.wall_us = wall_us
+        self.features = features
+
+
+def collect_features(binary, files):
+    """
+    Run a corpus through a fuzzer built with SanitizerCoverage, and return a
+    CorpusInput for each input that ran.
+    """
+    fd, features_path = tempfile.mkstemp(suffix=".txt")
+    os.close(fd)
+
+    try:
+        with open(os.devnull, "wb") as devnull:
+            rc = subprocess.call([binary, "-k", "0", "-f", features_path] +
+                                 files,
+                                 stdout=devnull)
+
+        if rc != 0:
+            raise ScriptException("{0} exited with status {1}"
+                                  .format(binary, rc))
+
+        inputs = []
+        with open(features_path, "r") as f:
+            for line in f:
+                path, size, wall_ns, features = line.rstrip("\n").split("\t")
+                inputs.append(CorpusInput(path,
+                                          int(size),
+                                          int(wall_ns) / 1000.0,
+                                          frozenset(features.split())))
+    finally:
+        os.unlink(features_path)
+
+    return inputs
+
+
+def set_cover(options, inputs):
+    """
+    Pick a subset of the inputs covering every feature. Inputs are picked
+    greedily by new features per unit of cost, where cost is the input's
+    size plus its run time weighted by --us_cost. Inputs made redundant by
+    later picks are then dropped again.
+    """
+    def cost(corpus_input):
+        return 1 + corpus_input.size + corpus_input.wall_us * options.us_cost
+
+    covered = set()
+    chosen = []
+
+    # Gains only go down as features are covered, so an input whose gain is
+    # still the best after being brought up to date can be picked without
+    # looking at the rest.
+    heap = [(-len(i.features) / cost(i), n) for n, i in enumerate(inputs)]
+    heapq.heapify(heap)
+
+    while heap:
+        _, n = heapq.heappop(heap)
+        gain = len(inputs[n].features - covered)
+        if gain == 0:
+            continue
+
+        score = -gain / cost(inputs[n])
+        if heap and score > heap[0][0]:
+            heapq.heappush(heap, (score, n))
+            continue
+
+        chosen.append(n)
+        covered |= inputs[n].features
+
+    # Count how many chosen inputs hit each feature, and drop inputs whose
+    # features are all hit by another, most expensive first.
+    counts = {}
+    for n in chosen:
+        for feature in inputs[n].features:
+            counts[feature] = counts.get(feature, 0) + 1
+
+    kept = []
+    for n in sorted(chosen, key=lambda n: cost(inputs[n]), reverse=True):
+        if all(counts[feature] > 1 for feature in inputs[n].features):
+            for feature in inputs[n].features:
+                counts[feature] -= 1
+        else:
+            kept.append(n)
+
+    return [inputs[n] for n in sorted(kept)]
+
+
+def distill_target(options, target):
+    """
+    Distill a target's corpus into the output directory, and summarise what
+    was kept.
+    """
+    binary = os.path.join(options.build_root, target)
+    corpus_dir = os.path.join(options.build_root, "corpora", target)
+    output_dir = os.path.join(options.output, target)
+    files = sorted(os.path.join(corpus_dir, name)
+                   for name in os.listdir(corpus_dir))
+
+    if os.path.exists(output_dir) and os.listdir(output_dir):
+        raise ScriptException("{0} is not empty".format(output_dir))
+
+    inputs = collect_features(binary, files)
+    all_features = frozenset().union(*[i.features for i in inputs])
+    kept = set_cover(options, inputs)
+
+    if not os.path.exists(output_dir):
+        os.makedirs(output_dir)
+    for corpus_input in kept:
+        shutil.copy(corpus_input.path, output_dir)
+
+    # Run the distilled corpus again to check what coverage it really gets;
+    # some features depend on timing rather than the input.
+    rerun = collect_features(binary, [os.path.join(output_dir,
+                                                   os.path.basename(i.path))
+                                      for i in kept])
+    retained = frozenset().union(*[i.features for i in rerun]) & all_features
+
+    return {
+        "inputs": len(inputs),
+        "inputs_kept": len(kept),
+        "features": len(all_features),
+        "features_retained": len(retained),
+        "bytes": sum(i.size for i in inputs),
+        "bytes_kept": sum(i.size for i in kept),
+        "wall_us": sum(i.wall_us for i in inputs),
+        "wall_us_kept": sum(i.wall_us for i in kept),
+    }
+
+
+def percent(part, whole):
+    return 100.0 * part / whole if whole else 100.0
+
+
+def distill(options):
+    results = {}
+
+    log.info("%-20s %13s %17s %21s %17s",
+             "target", "inputs", "features kept", "bytes", "exec ms")
+
+    for target in options.targets:
+        result = distill_target(options, target)
+        results[target] = result
+
+        log.info("%-20s %6d %6d %8d %7.2f%% %10d %9.1f%% %8.1f %7.1f%%",
+                 target,
+                 result["inputs"],
+                 result["inputs_kept"],
+                 result["features_retained"],
+                 percent(result["features_retained"], result["features"]),
+                 result["bytes_kept"],
+                 100 - percent(result["bytes_kept"], result["bytes"]),
+                 result["wall_us_kept"] / 1000.0,
+                 100 - percent(result["wall_us_kept"], result["wall_us"]))
+
+    if options.report:
+        with open(options.report, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+        log.info("Saved report to %s", options.report)
+
+    log.info("Distilled corpora written to %s; bytes and exec time are "
+             "what is kept and the percentage saved", options.output)
+
+    return ScriptRC.SUCCESS
+
+
+def get_options():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--build_root", required=True)
+    parser.add_argument("--targets", nargs="+", required=True)
+    parser.add_argument("--output", required=True,
+                        help="Directory to write a distilled corpus to for "
+                             "each target")
+    parser.add_argument("--us_cost", type=float, default=10.0,
+                        help="Cost of a microsecond of run time, in bytes, "
+                             "when choosing between inputs")
+    parser.add_argument("--report",
+                        help="Also write the results to this file as JSON")
+    return parser.parse_args()
+
+
+def setup_logging():
+    """
+    Set up logging from the command line options
+    """
+    root_logger = logging.getLogger()
+    formatter = logging.Formatter("%(asctime)s %(levelname)-5.5s %(message)s")
+    stdout_handler = logging.StreamHandler(sys.stdout)
+    stdout_handler.setFormatter(formatter)
+    stdout_handler.setLevel(logging.DEBUG)
+    root_logger.addHandler(stdout_handler)
+    root_logger.setLevel(logging.DEBUG)
+
+
+class ScriptRC(object):
+    """Enum for script return codes"""
+    SUCCESS = 0
+    FAILURE = 1
+    EXCEPTION = 2
+
+
+class ScriptException(Exception):
+    pass
+
+
+def main():
+    # Get the options from the user.
+    options = get_options()
+
+    setup_logging()
+
+    # Run main script.
+    try:
+        rc = distill(options)
+    except Exception as e:
+        log.exception(e)
+        rc = ScriptRC.EXCEPTION
+
+    log.info("Returning %d", rc)
+    return rc
+
+
+if __name__ == '__main__':
+    sys.exit(main())
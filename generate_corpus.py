@@ -40,28 +40,31 @@ def generate_corpus(options):
         enc.maybe_write_response(enc.TYPE_SECRSP0, options.secrsp0, options.secrsp0file, options.secrsp0test)
         enc.maybe_write_response(enc.TYPE_SECRSP1, options.secrsp1, options.secrsp1file, options.secrsp1test)
 
+        # Write any responses for other connections to the file.
+        if options.connrsp:
+            for connrsp in options.connrsp:
+                enc.write_connection_response(connrsp)
+        if options.connrspfile:
+            for connrsp in options.connrspfile:
+                enc.write_connection_response(connrsp, from_file=True)
+
+        # Write any response triggers to the file.
+        if options.rsptrigger:
+            for trigger in options.rsptrigger:
+                enc.write_response_trigger(trigger)
+        if options.rsptriggerbytes:
+            for trigger in options.rsptriggerbytes:
+                enc.write_response_trigger(trigger, byte_count=True)
+
         # Write other options to file.
-        enc.maybe_write_string(enc.TYPE_USERNAME, options.username)
-        enc.maybe_write_string(enc.TYPE_PASSWORD, options.password)
         enc.maybe_write_string(enc.TYPE_POSTFIELDS, options.postfields)
-        enc.maybe_write_string(enc.TYPE_COOKIE, options.cookie)
-        enc.maybe_write_string(enc.TYPE_RANGE, options.range)
-        enc.maybe_write_string(enc.TYPE_CUSTOMREQUEST, options.customrequest)
-        enc.maybe_write_string(enc.TYPE_MAIL_FROM, options.mailfrom)
-        enc.maybe_write_string(enc.TYPE_ACCEPT_ENCODING, options.acceptencoding)
-        enc.maybe_write_string(enc.TYPE_RTSP_SESSION_ID, options.rtspsessionid)
-        enc.maybe_write_string(enc.TYPE_RTSP_STREAM_URI, options.rtspstreamuri)
-        enc.maybe_write_string(enc.TYPE_RTSP_TRANSPORT, options.rtsptransport)
-        enc.maybe_write_string(enc.TYPE_MAIL_AUTH, options.mailauth)
-
-        enc.maybe_write_u32(enc.TYPE_HTTPAUTH, options.httpauth)
-        enc.maybe_write_u32(enc.TYPE_OPTHEADER, options.optheader)
-        enc.maybe_write_u32(enc.TYPE_NOBODY, options.nobody)
-        enc.maybe_write_u32(enc.TYPE_FOLLOWLOCATION, options.followlocation)
-        enc.maybe_write_u32(enc.TYPE_WILDCARDMATCH, options.wildcardmatch)
-        enc.maybe_write_u32(enc.TYPE_RTSP_REQUEST, options.rtsprequest)
-        enc.maybe_write_u32(enc.TYPE_RTSP_CLIENT_CSEQ, options.rtspclientcseq)
-        enc.maybe_write_u32(enc.TYPE_HTTP_VERSION, options.httpversion)
+
+        for entry in option_tlvs():
+            value = getattr(options, option_dest(entry))
+            if entry.kind == "STRING":
+                enc.maybe_write_string(entry.type, value)
+            else:
+                enc.maybe_write_u32(entry.type, value)
 
         # Write the first upload to the file.
         if options.upload1:
@@ -88,34 +91,32 @@ def generate_corpus(options):
     return ScriptRC.SUCCESS
 
 
+def option_tlvs():
+    """
+    TLVs that set a CURLOPT from a string or a number, other than the URL.
+    """
+    return [entry for entry in corpus.TLV_SCHEMA
+            if entry.kind in ("STRING", "U32") and entry.name != "URL"]
+
+
+def option_dest(entry):
+    return entry.pyname.lower().replace("_", "")
+
+
 def get_options():
     parser = argparse.ArgumentParser()
     parser.add_argument("--output", required=True)
     parser.add_argument("--url", required=True)
     parser.add_argument("--curl_test_dir", required=True)
-    parser.add_argument("--username")
-    parser.add_argument("--password")
     parser.add_argument("--postfields")
     parser.add_argument("--header", action="append")
-    parser.add_argument("--cookie")
-    parser.add_argument("--range")
-    parser.add_argument("--customrequest")
-    parser.add_argument("--mailfrom")
     parser.add_argument("--mailrecipient", action="append")
     parser.add_argument("--mimepart", action="append")
-    parser.add_argument("--httpauth", type=int)
-    parser.add_argument("--optheader", type=int)
-    parser.add_argument("--nobody", type=int)
-    parser.add_argument("--followlocation", type=int)
-    parser.add_argument("--acceptencoding")
-    parser.add_argument("--wildcardmatch", type=int)
-    parser.add_argument("--rtsprequest", type=int)
-    parser.add_argument("--rtspsessionid")
-    parser.add_argument("--rtspstreamuri")
-    parser.add_argument("--rtsptransport")
-    parser.add_argument("--rtspclientcseq", type=int)
-    parser.add_argument("--mailauth")
-    parser.add_argument("--httpversion", type=int)
+
+    # Options that just set a CURLOPT get an argument each from the schema.
+    for entry in option_tlvs():
+        parser.add_argument("--" + option_dest(entry),
+                            type=int if entry.kind == "U32" else None)
 
     upload1 = parser.add_mutually_exclusive_group()
     upload1.add_argument("--upload1")
@@ -133,6 +134,15 @@ def get_options():
         group.add_argument("--secrsp{0}file".format(ii))
         group.add_argument("--secrsp{0}test".format(ii), type=int)
 
+    # Responses for any connection, as <connection>:<response>:<value>.
+    parser.add_argument("--connrsp", action="append")
+    parser.add_argument("--connrspfile", action="append")
+
+    # Response triggers, as <connection>:<response>:<delimiter> or
+    # <connection>:<response>:<byte count>.
+    parser.add_argument("--rsptrigger", action="append")
+    parser.add_argument("--rsptriggerbytes", action="append")
+
     return parser.parse_args()
 
 
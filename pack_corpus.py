@@ -0,0 +1,213 @@
+#!/usr/bin/env python
+#
+# Script which converts corpora between directories, zip files and packed
+# corpus files. The standalone engine maps packed corpora and runs their
+# entries in place, rather than opening a file for every input.
+
+import argparse
+import logging
+import os
+import struct
+import sys
+import zipfile
+log = logging.getLogger(__name__)
+
+# Layout shared with standalone_fuzz_target_runner.cc. The header holds the
+# magic, version, entry count and file size; each index entry holds the
+# data offset and length, and the name offset and length.
+PACK_MAGIC = b"CURLFZPK"
+PACK_VERSION = 1
+PACK_HEADER = struct.Struct("<8sIIQQ")
+PACK_ENTRY = struct.Struct("<QIIII")
+
+# Contents are aligned to DATA_ALIGN, or to a page if they're at least a
+# page long, so that larger inputs start on a page of their own.
+DATA_ALIGN = 16
+PAGE_SIZE = 4096
+
+
+def align(offset, size):
+    boundary = PAGE_SIZE if size >= PAGE_SIZE else DATA_ALIGN
+    return (offset + boundary - 1) // boundary * boundary
+
+
+def read_source(source):
+    """
+    Yield (name, data) for each input in a directory, zip file or packed
+    corpus.
+    """
+    if os.path.isdir(source):
+        for root, dirs, files in os.walk(source):
+            dirs.sort()
+            for name in sorted(files):
+                path = os.path.join(root, name)
+                with open(path, "rb") as f:
+                    yield os.path.relpath(path, source), f.read()
+    elif zipfile.is_zipfile(source):
+        with zipfile.ZipFile(source) as z:
+            for info in sorted(z.infolist(), key=lambda i: i.filename):
+                if not info.filename.endswith("/"):
+                    yield info.filename, z.read(info)
+    else:
+        for name, data in read_pack(source):
+            yield name, data
+
+
+def read_pack(path):
+    """
+    Yield (name, data) for each entry in a packed corpus.
+    """
+    with open(path, "rb") as f:
+        pack = f.read()
+
+    magic, version, count, size, _ = PACK_HEADER.unpack_from(pack, 0)
+    if magic != PACK_MAGIC or version != PACK_VERSION or size != len(pack):
+        raise ScriptException("{0} is not a packed corpus".format(path))
+
+    for ii in range(count):
+        data_offset, data_len, name_offset, name_len, _ = \
+            PACK_ENTRY.unpack_from(pack,
+                                   PACK_HEADER.size + ii * PACK_ENTRY.size)
+        name = pack[name_offset:name_offset + name_len].decode("utf-8")
+        yield name, pack[data_offset:data_offset + data_len]
+
+
+def write_pack(path, inputs):
+    """
+    Write a list of (name, data) as a packed corpus.
+    """
+    names = [name.encode("utf-8") for name, _ in inputs]
+
+    # The names follow the index, and the contents follow the names.
+    name_offset = PACK_HEADER.size + len(inputs) * PACK_ENTRY.size
+    data_offset = name_offset + sum(len(name) + 1 for name in names)
+
+    index = []
+    for name, (_, data) in zip(names, inputs):
+        data_offset = align(data_offset, len(data))
+        index.append((data_offset, len(data), name_offset, len(name), 0))
+        name_offset += len(name) + 1
+        data_offset += len(data)
+
+    with open(path, "wb") as f:
+        f.write(PACK_HEADER.pack(PACK_MAGIC,
+                                 PACK_VERSION,
+                                 len(inputs),
+                                 data_offset,
+                                 0))
+        for entry in index:
+            f.write(PACK_ENTRY.pack(*entry))
+        for name in names:
+            f.write(name + b"\0")
+        for entry, (_, data) in zip(index, inputs):
+            f.write(b"\0" * (entry[0] - f.tell()))
+            f.write(data)
+
+
+def pack(options):
+    inputs = []
+    seen = set()
+
+    for source in options.sources:
+        for name, data in read_source(source):
+            if name in seen:
+                raise ScriptException("{0} appears more than once"
+                                      .format(name))
+            seen.add(name)
+            inputs.append((name, data))
+
+    write_pack(options.output, inputs)
+    log.info("Packed %d inputs (%d bytes) into %s",
+             len(inputs),
+             sum(len(data) for _, data in inputs),
+             options.output)
+
+    return ScriptRC.SUCCESS
+
+
+def unpack(options):
+    inputs = list(read_pack(options.input))
+
+    if options.output.endswith(".zip"):
+        with zipfile.ZipFile(options.output, "w") as z:
+            for name, data in inputs:
+                z.writestr(name, data)
+    else:
+        for name, data in inputs:
+            path = os.path.join(options.output, name)
+            if not os.path.isdir(os.path.dirname(path)):
+                os.makedirs(os.path.dirname(path))
+            with open(path, "wb") as f:
+                f.write(data)
+
+    log.info("Unpacked %d inputs into %s", len(inputs), options.output)
+
+    return ScriptRC.SUCCESS
+
+
+def get_options():
+    parser = argparse.ArgumentParser()
+    subparsers = parser.add_subparsers(dest="command")
+    subparsers.required = True
+
+    pack_parser = subparsers.add_parser(
+        "pack",
+        help="Pack directories, zip files or packed corpora into one file")
+    pack_parser.add_argument("--output", required=True)
+    pack_parser.add_argument("sources", nargs="+")
+    pack_parser.set_defaults(func=pack)
+
+    unpack_parser = subparsers.add_parser(
+        "unpack",
+        help="Unpack a packed corpus into a directory, or a zip file if the "
+             "output ends in .zip")
+    unpack_parser.add_argument("--input", required=True)
+    unpack_parser.add_argument("--output", required=True)
+    unpack_parser.set_defaults(func=unpack)
+
+    return parser.parse_args()
+
+
+def setup_logging():
+    """
+    Set up logging from the command line options
+    """
+    root_logger = logging.getLogger()
+    formatter = logging.Formatter("%(asctime)s %(levelname)-5.5s %(message)s")
+    stdout_handler = logging.StreamHandler(sys.stdout)
+    stdout_handler.setFormatter(formatter)
+    stdout_handler.setLevel(logging.DEBUG)
+    root_logger.addHandler(stdout_handler)
+    root_logger.setLevel(logging.DEBUG)
+
+
+class ScriptRC(object):
+    """Enum for script return codes"""
+    SUCCESS = 0
+    FAILURE = 1
+    EXCEPTION = 2
+
+
+class ScriptException(Exception):
+    pass
+
+
+def main():
+    # Get the options from the user.
+    options = get_options()
+
+    setup_logging()
+
+    # Run main script.
+    try:
+        rc = options.func(options)
+    except Exception as e:
+        log.exception(e)
+        rc = ScriptRC.EXCEPTION
+
+    log.info("Returning %d", rc)
+    return rc
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,193 @@
+#!/usr/bin/env python
+#
+# Script which reads the binary coverage files written by the standalone
+# engine's -c option, and ranks, deduplicates and summarises the inputs in
+# them.
+
+import argparse
+import logging
+import struct
+import sys
+log = logging.getLogger(__name__)
+
+# Layout shared with standalone_fuzz_target_runner.cc. The header holds the
+# magic, version and number of feature bits; each record holds the name
+# length, feature count, new feature count, input size and wall time, and is
+# followed by the name and the features.
+COV_MAGIC = b"CURLFZCV"
+COV_VERSION = 1
+COV_FILE_HEADER = struct.Struct("<8sII")
+COV_RECORD = struct.Struct("<IIIIQQ")
+
+
+class CoverageRecord(object):
+    """An input along with its size, run time and coverage features."""
+    def __init__(self, name, size, wall_ns, new_features, features):
+        self.name = name
+        self.size = size
+        self.wall_ns = wall_ns
+        self.new_features = new_features
+        self.features = features
+
+
+def read_coverage(path):
+    """
+    Return a CoverageRecord for each input in a binary coverage file, in the
+    order the inputs ran.
+    """
+    with open(path, "rb") as f:
+        data = f.read()
+
+    magic, version, _ = COV_FILE_HEADER.unpack_from(data, 0)
+    if magic != COV_MAGIC or version != COV_VERSION:
+        raise ScriptException("{0} is not a coverage file".format(path))
+
+    records = []
+    pos = COV_FILE_HEADER.size
+    while pos < len(data):
+        name_len, num_features, new_features, _, size, wall_ns = \
+            COV_RECORD.unpack_from(data, pos)
+        pos += COV_RECORD.size
+        name = data[pos:pos + name_len].decode("utf-8", "replace")
+        pos += name_len
+
+        # Features are LEB128 differences from the previous feature.
+        features = []
+        feature = 0
+        for _ in range(num_features):
+            delta = 0
+            shift = 0
+            while True:
+                byte = bytearray(data[pos:pos + 1])[0]
+                pos += 1
+                delta |= (byte & 0x7f) << shift
+                shift += 7
+                if byte < 0x80:
+                    break
+            feature += delta
+            features.append(feature)
+
+        records.append(CoverageRecord(name,
+                                      size,
+                                      wall_ns,
+                                      new_features,
+                                      frozenset(features)))
+
+    return records
+
+
+def show_coverage(options):
+    records = []
+    for path in options.inputs:
+        records.extend(read_coverage(path))
+
+    # When files from different runs are merged, work out again which
+    # features each input was first to hit.
+    seen = set()
+    for record in records:
+        if len(options.inputs) > 1:
+            record.new_features = len(record.features - seen)
+        seen |= record.features
+
+    sort_keys = {
+        "order": None,
+        "new": lambda r: -r.new_features,
+        "features": lambda r: -len(r.features),
+        "size": lambda r: r.size,
+        "time": lambda r: -r.wall_ns,
+    }
+    if sort_keys[options.sort]:
+        records_shown = sorted(records, key=sort_keys[options.sort])
+    else:
+        records_shown = records
+
+    log.info("%8s %8s %8s %10s  %s",
+             "features", "new", "bytes", "exec us", "input")
+    for record in records_shown[:options.limit]:
+        log.info("%8d %8d %8d %10.1f  %s",
+                 len(record.features),
+                 record.new_features,
+                 record.size,
+                 record.wall_ns / 1000.0,
+                 record.name)
+
+    # Group inputs which hit exactly the same features.
+    groups = {}
+    for record in records:
+        groups.setdefault(record.features, []).append(record)
+    duplicates = [group for group in groups.values() if len(group) > 1]
+
+    if options.duplicates:
+        for group in duplicates:
+            log.info("Same coverage: %s",
+                     " ".join(record.name for record in group))
+
+    log.info("%d inputs hit %d features; %d add nothing to the inputs "
+             "before them, and %d are in %d groups with the same coverage",
+             len(records),
+             len(seen),
+             sum(1 for record in records if record.new_features == 0),
+             sum(len(group) for group in duplicates),
+             len(duplicates))
+
+    return ScriptRC.SUCCESS
+
+
+def get_options():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("inputs", nargs="+",
+                        help="Coverage files written by the standalone "
+                             "engine's -c option")
+    parser.add_argument("--sort", default="order",
+                        choices=["order", "new", "features", "size", "time"],
+                        help="Order to list inputs in")
+    parser.add_argument("--limit", type=int,
+                        help="Only list this many inputs")
+    parser.add_argument("--duplicates", action="store_true",
+                        help="List the inputs with the same coverage")
+    return parser.parse_args()
+
+
+def setup_logging():
+    """
+    Set up logging from the command line options
+    """
+    root_logger = logging.getLogger()
+    formatter = logging.Formatter("%(asctime)s %(levelname)-5.5s %(message)s")
+    stdout_handler = logging.StreamHandler(sys.stdout)
+    stdout_handler.setFormatter(formatter)
+    stdout_handler.setLevel(logging.DEBUG)
+    root_logger.addHandler(stdout_handler)
+    root_logger.setLevel(logging.DEBUG)
+
+
+class ScriptRC(object):
+    """Enum for script return codes"""
+    SUCCESS = 0
+    FAILURE = 1
+    EXCEPTION = 2
+
+
+class ScriptException(Exception):
+    pass
+
+
+def main():
+    # Get the options from the user.
+    options = get_options()
+
+    setup_logging()
+
+    # Run main script.
+    try:
+        rc = show_coverage(options)
+    except Exception as e:
+        log.exception(e)
+        rc = ScriptRC.EXCEPTION
+
+    log.info("Returning %d", rc)
+    return rc
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,30 @@
+#!/bin/bash
+
+# Measure how fast each fuzzer replays its seed corpus. Set BENCH_SAVE=1 to
+# record the results as the new baseline.
+
+set -e
+
+# Exit if the build root has not been defined.
+[[ -d ${BUILD_ROOT} ]] || exit 1
+
+. ${BUILD_ROOT}/scripts/fuzz_targets
+
+BENCH_ROUNDS=${BENCH_ROUNDS:-5}
+BENCH_THRESHOLD=${BENCH_THRESHOLD:-10}
+BENCH_BASELINE=${BENCH_BASELINE:-${BUILD_ROOT}/bench_baseline.json}
+
+if [[ ${BENCH_SAVE} == 1 ]]
+then
+  SAVE_BASELINE=--save_baseline
+else
+  SAVE_BASELINE=
+fi
+
+python3 ${BUILD_ROOT}/bench.py \
+  --build_root ${BUILD_ROOT} \
+  --targets ${FUZZ_TARGETS} \
+  --rounds ${BENCH_ROUNDS} \
+  --threshold ${BENCH_THRESHOLD} \
+  --baseline ${BENCH_BASELINE} \
+  ${SAVE_BASELINE}
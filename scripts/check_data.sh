@@ -27,22 +27,38 @@ else
     EXTRA_CORPUS=
 fi
 
+# Where the supervisor puts quarantined inputs and its summaries, and how
+# long an input may run before it counts as hung or slow.
+CHECK_OUT=${CHECK_OUT:-${BUILD_ROOT}/check_output}
+export FUZZ_FORK_TIMEOUT=${FUZZ_FORK_TIMEOUT:-30}
+CHECK_SLOW_MS=${CHECK_SLOW_MS:-5000}
+CHECK_JOBS=${CHECK_JOBS:-$(nproc)}
+
+RC=0
+
 for TARGET in ${FUZZ_TARGETS}
 do
-  if [[ ${TARGET} == "curl_fuzzer_ftp" ]] || [[ ${TARGET} == "curl_fuzzer_smtp" ]] || [[ ${TARGET} == "curl_fuzzer_smtp" ]] || [[ ${TARGET} == "curl_fuzzer" ]]
+  if [[ ${DEBUG} == 1 ]]
   then
-    # For the moment, disable some problematic corpuses
-    echo "Skipping ${TARGET}"
+    # Call tests individually
+    find ${BUILD_ROOT}/corpora/${TARGET}/ ${EXTRA_CORPUS} -type f -print0 | xargs -0 -L1 ${BUILD_ROOT}/${TARGET}
   else
-    if [[ ${DEBUG} == 1 ]]
-    then
-      # Call tests individually
-      PERCALL=1
-    else
-      # Call tests 100 at a time for speed.
-      PERCALL=100
-    fi
-
-    find ${BUILD_ROOT}/corpora/${TARGET}/ ${EXTRA_CORPUS} -type f -print0 | xargs -0 -L${PERCALL} ${BUILD_ROOT}/${TARGET}
+    # Spread the tests over worker processes on all CPUs. Inputs which crash
+    # or hang are quarantined and fail the check once every input has been
+    # run. Each option is a single argument so that libFuzzer builds just
+    # warn about them.
+    rm -rf ${CHECK_OUT}/${TARGET}
+    mkdir -p ${CHECK_OUT}/${TARGET}
+
+    mapfile -d '' INPUTS < <(find ${BUILD_ROOT}/corpora/${TARGET}/ ${EXTRA_CORPUS} -type f -print0)
+
+    ${BUILD_ROOT}/${TARGET} \
+      -w${CHECK_JOBS} \
+      -s${CHECK_SLOW_MS} \
+      -q${CHECK_OUT}/${TARGET}/quarantine \
+      -r${CHECK_OUT}/${TARGET}/summary.json \
+      "${INPUTS[@]}" || RC=1
   fi
 done
+
+exit ${RC}
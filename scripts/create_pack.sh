@@ -0,0 +1,18 @@
+#!/bin/bash
+
+# Pack each fuzzer's seed corpus into a single file that the standalone
+# engine can replay without opening a file per input.
+
+set -e
+
+# Exit if the build root has not been defined.
+[[ -d ${BUILD_ROOT} ]] || exit 1
+
+. ${BUILD_ROOT}/scripts/fuzz_targets
+
+for TARGET in ${FUZZ_TARGETS}
+do
+  python3 ${BUILD_ROOT}/pack_corpus.py pack \
+    --output ${BUILD_ROOT}/${TARGET}_seed_corpus.pack \
+    ${BUILD_ROOT}/corpora/${TARGET}
+done
@@ -0,0 +1,22 @@
+#!/bin/bash
+
+# Distill each fuzzer's seed corpus down to the inputs needed to keep its
+# coverage. The fuzzers must be built with SanitizerCoverage. Distilled
+# corpora are written to DISTILL_OUT, which defaults to distilled/.
+
+set -e
+
+# Exit if the build root has not been defined.
+[[ -d ${BUILD_ROOT} ]] || exit 1
+
+. ${BUILD_ROOT}/scripts/fuzz_targets
+
+DISTILL_OUT=${DISTILL_OUT:-${BUILD_ROOT}/distilled}
+DISTILL_US_COST=${DISTILL_US_COST:-10}
+
+python3 ${BUILD_ROOT}/distill.py \
+  --build_root ${BUILD_ROOT} \
+  --targets ${FUZZ_TARGETS} \
+  --output ${DISTILL_OUT} \
+  --us_cost ${DISTILL_US_COST} \
+  --report ${DISTILL_OUT}/report.json
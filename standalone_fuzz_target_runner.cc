@@ -20,74 +20,2209 @@
  *
  ***************************************************************************/
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/personality.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 #include "testinput.h"
 
+/* Seconds a fork server child may spend on one input before it is killed. */
+#define FORK_DEFAULT_TIMEOUT  30
+
+/* Number of slowest inputs listed in the timing report by default. */
+#define REPORT_DEFAULT_SLOWEST  5
+
+/* Clock used for wall times. The fuzz target may move CLOCK_MONOTONIC
+   forward to skip timeouts, so use a clock it leaves alone. */
+#define RUN_CLOCK  CLOCK_BOOTTIME
+
+/* Packed corpus files are recognised by this extension, and start with a
+   PACK_HEADER holding this magic and version. */
+#define PACK_EXTENSION  ".pack"
+#define PACK_MAGIC      "CURLFZPK"
+#define PACK_VERSION    1
+
+/* Number of coverage counters. Edges past this many share counters. */
+#define COV_MAP_BITS  20
+#define COV_MAP_SIZE  (1 << COV_MAP_BITS)
+
+/* Each counter gives eight features, one per hit count bucket. */
+#define COV_NUM_FEATURES  (COV_MAP_SIZE * 8)
+
+/* Most instrumented modules that can register inline 8-bit counters. */
+#define COV_MAX_REGIONS  64
+
+/* Binary coverage files start with a COV_FILE_HEADER holding this magic and
+   version. */
+#define COV_MAGIC    "CURLFZCV"
+#define COV_VERSION  1
+
+/* The coverage hooks mustn't be instrumented themselves, or they would call
+   themselves. */
+#if defined(__clang__)
+#define COV_NO_INSTRUMENT  __attribute__((no_sanitize("coverage")))
+#elif defined(__GNUC__) && __GNUC__ >= 12
+#define COV_NO_INSTRUMENT  __attribute__((no_sanitize_coverage))
+#else
+#define COV_NO_INSTRUMENT
+#endif
+
+/**
+ * Timing for one call to LLVMFuzzerTestOneInput.
+ */
+typedef struct run_timing
+{
+  /* Set once the input has been run. */
+  int ran;
+
+  uint64_t bytes;
+  uint64_t wall_ns;
+  uint64_t cpu_ns;
+
+} RUN_TIMING;
+
+/**
+ * Header of a packed corpus file. It is followed by an index of count
+ * PACK_ENTRY structures, then the entry names, then the entry contents. All
+ * fields are little-endian.
+ */
+typedef struct pack_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+
+  /* Size of the whole file. */
+  uint64_t size;
+  uint64_t reserved;
+
+} PACK_HEADER;
+
+/**
+ * Index entry in a packed corpus. Offsets are from the start of the file.
+ * Names are NUL-terminated, so they can be used in place. Contents are
+ * aligned to 16 bytes, or to a page if they're at least a page long.
+ */
+typedef struct pack_entry
+{
+  uint64_t data_offset;
+  uint32_t data_len;
+  uint32_t name_offset;
+  uint32_t name_len;
+  uint32_t reserved;
+
+} PACK_ENTRY;
+
+/**
+ * Header of a binary coverage file. It is followed by a COV_RECORD for each
+ * input that ran, in the order they ran. All fields are little-endian.
+ */
+typedef struct cov_file_header
+{
+  char magic[8];
+  uint32_t version;
+
+  /* Features are numbered from 0 to 2^feature_bits - 1. */
+  uint32_t feature_bits;
+
+} COV_FILE_HEADER;
+
+/**
+ * Record for one input in a binary coverage file. It is followed by the
+ * input's name, which isn't NUL-terminated, then its features in ascending
+ * order. Each feature is written as the difference from the one before it
+ * (or from 0 for the first) as an unsigned LEB128 number.
+ */
+typedef struct cov_record
+{
+  uint32_t name_len;
+
+  /* Features the input hit, and how many of those no earlier input hit. */
+  uint32_t num_features;
+  uint32_t new_features;
+  uint32_t reserved;
+
+  uint64_t bytes;
+  uint64_t wall_ns;
+
+} COV_RECORD;
+
+/**
+ * A block of inline 8-bit counters belonging to one instrumented module.
+ */
+typedef struct cov_region
+{
+  uint8_t *start;
+  uint8_t *stop;
+
+  /* Number of the region's first counter, shared with the guard numbers. */
+  uint32_t base;
+
+} COV_REGION;
+
+/**
+ * An input in a mapped packed corpus, which is run in place.
+ */
+typedef struct packed_input
+{
+  /* Start of the entry's contents, or NULL if the input is a file. */
+  const uint8_t *data;
+  size_t len;
+
+} PACKED_INPUT;
+
+/**
+ * Status sent over the control pipe by a fork server child each time it
+ * finishes an input.
+ */
+typedef struct fork_status
+{
+  /* Index into argv of the input that was run. */
+  int32_t arg_index;
+
+  /* Return code from LLVMFuzzerTestOneInput. */
+  int32_t rc;
+
+  /* How long the input took. */
+  RUN_TIMING timing;
+
+} FORK_STATUS;
+
+/**
+ * Counters for the fork server summary.
+ */
+typedef struct fork_stats
+{
+  unsigned long children;
+  unsigned long inputs;
+  unsigned long crashes;
+  unsigned long hangs;
+
+} FORK_STATS;
+
+/**
+ * Why an input was quarantined by the supervisor.
+ */
+typedef enum quarantine_reason {
+  QUARANTINE_NONE,
+  QUARANTINE_CRASH,
+  QUARANTINE_HANG,
+  QUARANTINE_SLOW
+} QUARANTINE_REASON;
+
+/**
+ * A supervisor worker process, and the input it is running.
+ */
+typedef struct supervisor_worker
+{
+  pid_t pid;
+
+  /* Pipes for sending input indexes to the worker, and for the worker's
+     FORK_STATUS replies. */
+  int cmd_fd;
+  int status_fd;
+
+  /* Index into argv of the input being run, or -1 if the worker is idle. */
+  int arg_index;
+
+  /* When the worker was given its input. */
+  struct timespec started;
+
+} SUPERVISOR_WORKER;
+
+/**
+ * Supervisor settings and counters.
+ */
+typedef struct supervisor
+{
+  SUPERVISOR_WORKER *workers;
+  int num_workers;
+
+  /* Seconds an input may run before its worker is killed, or 0 to wait
+     forever. */
+  int timeout;
+
+  /* Inputs which finish but take longer than this many milliseconds are
+     quarantined as slow, unless it's 0. */
+  int slow_ms;
+
+  /* Directory to copy quarantined inputs into, or NULL. */
+  const char *quarantine_dir;
+
+  /* Why each input was quarantined, and the signal or exit status for
+     crashes; indexed like argv. */
+  QUARANTINE_REASON *reasons;
+  int *statuses;
+
+  unsigned long workers_started;
+  unsigned long inputs;
+  unsigned long crashes;
+  unsigned long hangs;
+  unsigned long slow;
+
+  /* Workers that exited unsuccessfully while not running an input, such as
+     when a leak check fails at exit. */
+  unsigned long failed_workers;
+
+} SUPERVISOR;
+
+/**
+ * A replay worker thread and its statistics.
+ */
+typedef struct replay_worker
+{
+  pthread_t thread;
+  int id;
+
+  /* CPU to pin the thread to, or -1 to let it run anywhere. */
+  int cpu;
+
+  unsigned long inputs;
+  unsigned long long bytes;
+  double busy_seconds;
+  double cpu_seconds;
+
+} REPLAY_WORKER;
+
+/* Timing for each input, indexed like argv. */
+static RUN_TIMING *run_timings;
+
+/* Inputs from packed corpora, indexed like argv, or NULL if none were
+   given. */
+static PACKED_INPUT *packed_inputs;
+
+/**
+ * Inputs shared between the replay worker threads. Each thread claims the
+ * next input by atomically incrementing next_arg, so a thread that gets
+ * quick inputs simply takes more of them.
+ */
+typedef struct replay_queue
+{
+  char **argv;
+  int next_arg;
+  int end_arg;
+
+} REPLAY_QUEUE;
+
+static REPLAY_QUEUE replay_queue;
+
+/**
+ * Hit counts for each edge, filled in by the SanitizerCoverage hooks when
+ * the fuzz target is built with -fsanitize-coverage=trace-pc-guard or
+ * inline-8bit-counters (clang) or -fsanitize-coverage=trace-pc (gcc).
+ */
+static uint8_t cov_map[COV_MAP_SIZE];
+
+/* Number of guards and inline counters handed out so far. */
+static uint32_t cov_guards;
+
+/* Inline 8-bit counters, which are copied into cov_map after each input. */
+static COV_REGION cov_regions[COV_MAX_REGIONS];
+static int cov_num_regions;
+
+/* Features hit by the last input, in ascending order. */
+static uint32_t cov_features[COV_MAP_SIZE];
+static size_t cov_num_features;
+
+/* One bit for each feature any input has hit. */
+static uint8_t cov_seen[COV_NUM_FEATURES / 8];
+
+/* Set once any instrumented code has run. */
+static int cov_instrumented;
+
+/**
+ * Fuzz targets may provide this to set up global state once. A weak
+ * reference lets targets which don't need it leave it out.
+ */
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv)
+  __attribute__((weak));
+
+/**
+ * Nanoseconds elapsed on a clock since a starting point.
+ */
+static uint64_t ns_since(clockid_t clk_id, const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(clk_id, &now);
+  return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000 +
+         now.tv_nsec - start->tv_nsec;
+}
+
+/**
+ * Called once for each instrumented module to number its guards. Each guard
+ * gets its own counter until the map is full.
+ */
+extern "C" COV_NO_INSTRUMENT
+void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop)
+{
+  uint32_t *guard;
+
+  if(start == stop || *start != 0) {
+    return;
+  }
+
+  for(guard = start; guard < stop; guard++) {
+    *guard = 1 + cov_guards++ % (COV_MAP_SIZE - 1);
+  }
+}
+
+/**
+ * Called on every instrumented edge when built with trace-pc-guard.
+ */
+extern "C" COV_NO_INSTRUMENT
+void __sanitizer_cov_trace_pc_guard(uint32_t *guard)
+{
+  uint8_t *counter = &cov_map[*guard];
+
+  if(*guard != 0 && *counter != 255) {
+    (*counter)++;
+  }
+}
+
+/**
+ * Called on every instrumented edge when built with trace-pc. There are no
+ * guards, so the caller's address is hashed to pick a counter.
+ */
+extern "C" COV_NO_INSTRUMENT
+void __sanitizer_cov_trace_pc(void)
+{
+  uint64_t pc = (uintptr_t)__builtin_return_address(0);
+  uint8_t *counter =
+    &cov_map[(pc * 0x9e3779b97f4a7c15ULL) >> (64 - COV_MAP_BITS)];
+
+  if(*counter != 255) {
+    (*counter)++;
+  }
+}
+
+/**
+ * Called once for each instrumented module built with inline-8bit-counters.
+ * The counters are numbered after the guards handed out so far.
+ */
+extern "C" COV_NO_INSTRUMENT
+void __sanitizer_cov_8bit_counters_init(uint8_t *start, uint8_t *stop)
+{
+  COV_REGION *region;
+  int ii;
+
+  if(start == stop) {
+    return;
+  }
+
+  for(ii = 0; ii < cov_num_regions; ii++) {
+    if(cov_regions[ii].start == start) {
+      return;
+    }
+  }
+
+  if(cov_num_regions == COV_MAX_REGIONS) {
+    fprintf(stderr, "Too many modules with inline 8-bit counters \n");
+    return;
+  }
+
+  region = &cov_regions[cov_num_regions++];
+  region->start = start;
+  region->stop = stop;
+  region->base = cov_guards;
+  cov_guards += stop - start;
+}
+
+/**
+ * Bucket for an edge's hit count, as libFuzzer counts them: 1, 2, 3, 4-7,
+ * 8-15, 16-31, 32-127 and 128 or more.
+ */
+static int cov_bucket(uint8_t count)
+{
+  if(count <= 3) {
+    return count - 1;
+  }
+  else if(count <= 7) {
+    return 3;
+  }
+  else if(count <= 15) {
+    return 4;
+  }
+  else if(count <= 31) {
+    return 5;
+  }
+  else if(count <= 127) {
+    return 6;
+  }
+
+  return 7;
+}
+
+/**
+ * Gather the features hit by the last input into cov_features, one edge
+ * and hit count bucket each, and count the ones no earlier input hit. The
+ * counters are cleared for the next input. Returns the number of new
+ * features.
+ */
+static size_t cov_collect(void)
+{
+  const uint64_t *words = (const uint64_t *)cov_map;
+  COV_REGION *region;
+  uint8_t *counter;
+  uint8_t *sum;
+  uint32_t feature;
+  size_t new_features = 0;
+  size_t ii;
+  size_t jj;
+  int kk;
+
+  /* Add the inline counters to the map, as the guards would have. */
+  for(kk = 0; kk < cov_num_regions; kk++) {
+    region = &cov_regions[kk];
+    for(counter = region->start; counter < region->stop; counter++) {
+      if(*counter == 0) {
+        continue;
+      }
+
+      sum = &cov_map[1 + (region->base + (counter - region->start)) %
+                         (COV_MAP_SIZE - 1)];
+      *sum = *sum + *counter > 255 ? 255 : *sum + *counter;
+      *counter = 0;
+    }
+  }
+
+  cov_num_features = 0;
+
+  /* Most counters are zero, so skip them eight at a time. */
+  for(ii = 0; ii < COV_MAP_SIZE / sizeof(uint64_t); ii++) {
+    if(words[ii] == 0) {
+      continue;
+    }
+
+    for(jj = ii * sizeof(uint64_t); jj < (ii + 1) * sizeof(uint64_t); jj++) {
+      if(cov_map[jj] == 0) {
+        continue;
+      }
+
+      feature = jj * 8 + cov_bucket(cov_map[jj]);
+      cov_features[cov_num_features++] = feature;
+      if(!(cov_seen[feature / 8] & (1 << (feature % 8)))) {
+        cov_seen[feature / 8] |= 1 << (feature % 8);
+        new_features++;
+      }
+    }
+  }
+
+  if(cov_num_features > 0) {
+    cov_instrumented = 1;
+  }
+
+  memset(cov_map, 0, sizeof(cov_map));
+
+  return new_features;
+}
+
+/**
+ * Throw away coverage which isn't down to any one input.
+ */
+static void cov_reset(void)
+{
+  int ii;
+
+  for(ii = 0; ii < cov_num_regions; ii++) {
+    memset(cov_regions[ii].start,
+           0,
+           cov_regions[ii].stop - cov_regions[ii].start);
+  }
+
+  memset(cov_map, 0, sizeof(cov_map));
+}
+
+/**
+ * Write the features hit by the last input on a line with the input's size
+ * and wall time.
+ */
+static void cov_write_features(FILE *out,
+                               const char *filename,
+                               const RUN_TIMING *timing)
+{
+  size_t ii;
+
+  fprintf(out,
+          "%s\t%llu\t%llu\t",
+          filename,
+          (unsigned long long)timing->bytes,
+          (unsigned long long)timing->wall_ns);
+
+  for(ii = 0; ii < cov_num_features; ii++) {
+    fprintf(out, " %u", cov_features[ii]);
+  }
+
+  fputc('\n', out);
+}
+
+/**
+ * Write the features hit by the last input to a binary coverage file.
+ */
+static void cov_write_record(FILE *out,
+                             const char *filename,
+                             const RUN_TIMING *timing,
+                             size_t new_features)
+{
+  COV_RECORD record;
+  uint32_t previous = 0;
+  uint32_t delta;
+  size_t ii;
+
+  memset(&record, 0, sizeof(record));
+  record.name_len = strlen(filename);
+  record.num_features = cov_num_features;
+  record.new_features = new_features;
+  record.bytes = timing->bytes;
+  record.wall_ns = timing->wall_ns;
+
+  fwrite(&record, sizeof(record), 1, out);
+  fwrite(filename, 1, record.name_len, out);
+
+  for(ii = 0; ii < cov_num_features; ii++) {
+    delta = cov_features[ii] - previous;
+    previous = cov_features[ii];
+
+    while(delta >= 0x80) {
+      fputc((delta & 0x7f) | 0x80, out);
+      delta >>= 7;
+    }
+    fputc(delta, out);
+  }
+}
+
+/**
+ * Call the fuzzing interface with an input, and fill in how long the call
+ * took. Returns the return code from the fuzzing interface.
+ */
+static int run_data(const char *filename,
+                    const uint8_t *data,
+                    size_t data_len,
+                    int progress,
+                    RUN_TIMING *timing)
+{
+  struct timespec start;
+  struct timespec cpu_start;
+  int rc;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+  clock_gettime(RUN_CLOCK, &start);
+
+  rc = LLVMFuzzerTestOneInput(data, data_len);
+
+  timing->wall_ns = ns_since(RUN_CLOCK, &start);
+  timing->cpu_ns = ns_since(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+  timing->bytes = data_len;
+  timing->ran = 1;
+
+  if(progress) {
+    printf("complete !!");
+  }
+  else {
+    printf("[%s] Opened.. Read %zu bytes, fuzzing.. complete !!\n",
+           filename,
+           data_len);
+  }
+
+  return rc;
+}
+
+/**
+ * Read a file into memory and call the fuzzing interface with the data.
+ * Returns the return code from the fuzzing interface, and fills in how long
+ * the call took. Progress is printed as the file is worked through; worker
+ * threads print the whole line at the end instead so that lines from
+ * different threads don't get mixed up.
+ */
+static int run_file(const char *filename, int progress, RUN_TIMING *timing)
+{
+  FILE *infile;
+  uint8_t *buffer = NULL;
+  size_t buffer_len = 0;
+  int rc = 0;
+
+  if(progress) {
+    printf("[%s] ", filename);
+  }
+
+  /* Try and open the file. */
+  infile = fopen(filename, "rb");
+  if(infile) {
+    if(progress) {
+      printf("Opened.. ");
+    }
+
+    /* Get the length of the file. */
+    fseek(infile, 0L, SEEK_END);
+    buffer_len = ftell(infile);
+
+    /* Reset the file indicator to the beginning of the file. */
+    fseek(infile, 0L, SEEK_SET);
+
+    /* Allocate a buffer for the file contents. */
+    buffer = (uint8_t *)calloc(buffer_len, sizeof(uint8_t));
+    if(buffer) {
+      /* Read all the text from the file into the buffer. */
+      fread(buffer, sizeof(uint8_t), buffer_len, infile);
+      if(progress) {
+        printf("Read %zu bytes, fuzzing.. ", buffer_len);
+      }
+
+      /* Call the fuzzer with the data. */
+      rc = run_data(filename, buffer, buffer_len, progress, timing);
+
+      /* Free the buffer as it's no longer needed. */
+      free(buffer);
+      buffer = NULL;
+    }
+    else
+    {
+      fprintf(stderr,
+              "[%s] Failed to allocate %zu bytes \n",
+              filename,
+              buffer_len);
+    }
+
+    /* Close the file as it's no longer needed. */
+    fclose(infile);
+    infile = NULL;
+  }
+  else
+  {
+    /* Failed to open the file. Maybe wrong name or wrong permissions? */
+    fprintf(stderr, "[%s] Open failed. \n", filename);
+  }
+
+  if(progress) {
+    printf("\n");
+  }
+
+  return rc;
+}
+
+/**
+ * Run the input at an argv index, straight from its packed corpus if it's
+ * in one, otherwise from its file.
+ */
+static int run_input(char **argv, int index, int progress, RUN_TIMING *timing)
+{
+  const PACKED_INPUT *packed;
+  int rc;
+
+  if(packed_inputs == NULL || packed_inputs[index].data == NULL) {
+    return run_file(argv[index], progress, timing);
+  }
+
+  packed = &packed_inputs[index];
+
+  if(progress) {
+    printf("[%s] Opened.. Read %zu bytes, fuzzing.. ",
+           argv[index],
+           packed->len);
+  }
+
+  rc = run_data(argv[index], packed->data, packed->len, progress, timing);
+
+  if(progress) {
+    printf("\n");
+  }
+
+  return rc;
+}
+
+/**
+ * Map a packed corpus and check that its index is sound. Returns the mapping,
+ * or NULL on error. The mapping is kept until the process exits, and is
+ * shared with forked workers.
+ */
+static const uint8_t *pack_map(const char *path)
+{
+  const PACK_HEADER *header;
+  const PACK_ENTRY *entries;
+  struct stat st;
+  uint8_t *map;
+  uint32_t ii;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if(fd == -1 || fstat(fd, &st) == -1) {
+    fprintf(stderr, "[%s] Open failed. \n", path);
+    if(fd != -1) {
+      close(fd);
+    }
+    return NULL;
+  }
+
+  if((size_t)st.st_size < sizeof(PACK_HEADER)) {
+    fprintf(stderr, "[%s] Not a packed corpus. \n", path);
+    close(fd);
+    return NULL;
+  }
+
+  map = (uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    fprintf(stderr, "[%s] Failed to map. \n", path);
+    return NULL;
+  }
+
+  /* Inputs are run in order, so have the kernel start reading ahead. */
+  madvise(map, st.st_size, MADV_WILLNEED);
+
+  header = (const PACK_HEADER *)map;
+  entries = (const PACK_ENTRY *)(header + 1);
+
+  if(memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0 ||
+     header->version != PACK_VERSION ||
+     header->size != (uint64_t)st.st_size ||
+     header->count > (st.st_size - sizeof(PACK_HEADER)) / sizeof(PACK_ENTRY)) {
+    fprintf(stderr, "[%s] Not a packed corpus. \n", path);
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  for(ii = 0; ii < header->count; ii++) {
+    if(entries[ii].data_offset > header->size ||
+       entries[ii].data_len > header->size - entries[ii].data_offset ||
+       entries[ii].name_offset >= header->size ||
+       entries[ii].name_len >= header->size - entries[ii].name_offset ||
+       map[entries[ii].name_offset + entries[ii].name_len] != '\0') {
+      fprintf(stderr, "[%s] Entry %u is corrupt. \n", path, ii);
+      munmap(map, st.st_size);
+      return NULL;
+    }
+  }
+
+  return map;
+}
+
+/**
+ * Returns whether a path names a packed corpus.
+ */
+static int pack_is_pack(const char *path)
+{
+  size_t path_len = strlen(path);
+  size_t ext_len = strlen(PACK_EXTENSION);
+
+  return path_len > ext_len &&
+         strcmp(&path[path_len - ext_len], PACK_EXTENSION) == 0;
+}
+
+/**
+ * Replace any packed corpora in the list of inputs with the entries in
+ * them, named "<pack>/<entry>". The entries are run in place from the
+ * mapped files, so replaying a packed corpus opens one file rather than one
+ * per input. Returns 0 on success.
+ */
+static int pack_expand(int *argc, char ***argv, int first)
+{
+  const PACK_HEADER *header;
+  const PACK_ENTRY *entries;
+  const uint8_t *map;
+  const char *name;
+  size_t path_len;
+  size_t name_len;
+  char **new_argv;
+  char *names;
+  int new_argc = 0;
+  int ii;
+  uint32_t jj;
+
+  /* Leave everything alone unless there's a packed corpus. */
+  for(ii = first; ii < *argc && !pack_is_pack((*argv)[ii]); ii++) {
+  }
+  if(ii == *argc) {
+    return 0;
+  }
+
+  new_argv = (char **)calloc(first, sizeof(char *));
+  packed_inputs = (PACKED_INPUT *)calloc(first, sizeof(PACKED_INPUT));
+  if(new_argv == NULL || packed_inputs == NULL) {
+    fprintf(stderr, "Failed to allocate inputs \n");
+    return 1;
+  }
+
+  for(ii = 0; ii < first; ii++) {
+    new_argv[new_argc++] = (*argv)[ii];
+  }
+
+  for(ii = first; ii < *argc; ii++) {
+    path_len = strlen((*argv)[ii]);
+    header = NULL;
+
+    if(pack_is_pack((*argv)[ii])) {
+      map = pack_map((*argv)[ii]);
+      if(map == NULL) {
+        return 1;
+      }
+      header = (const PACK_HEADER *)map;
+    }
+
+    new_argv = (char **)realloc(new_argv,
+                                (new_argc + (header ? header->count : 1)) *
+                                sizeof(char *));
+    packed_inputs = (PACKED_INPUT *)realloc(packed_inputs,
+                                            (new_argc +
+                                             (header ? header->count : 1)) *
+                                            sizeof(PACKED_INPUT));
+    if(new_argv == NULL || packed_inputs == NULL) {
+      fprintf(stderr, "Failed to allocate inputs \n");
+      return 1;
+    }
+
+    if(header == NULL) {
+      /* A plain file. */
+      packed_inputs[new_argc].data = NULL;
+      packed_inputs[new_argc].len = 0;
+      new_argv[new_argc++] = (*argv)[ii];
+      continue;
+    }
+
+    entries = (const PACK_ENTRY *)(header + 1);
+
+    for(jj = 0; jj < header->count; jj++) {
+      name = (const char *)map + entries[jj].name_offset;
+      name_len = entries[jj].name_len;
+
+      names = (char *)malloc(path_len + 1 + name_len + 1);
+      if(names == NULL) {
+        fprintf(stderr, "Failed to allocate inputs \n");
+        return 1;
+      }
+      memcpy(names, (*argv)[ii], path_len);
+      names[path_len] = '/';
+      memcpy(&names[path_len + 1], name, name_len + 1);
+
+      packed_inputs[new_argc].data = map + entries[jj].data_offset;
+      packed_inputs[new_argc].len = entries[jj].data_len;
+      new_argv[new_argc++] = names;
+    }
+  }
+
+  *argc = new_argc;
+  *argv = new_argv;
+
+  return 0;
+}
+
+/**
+ * Body of a fork server child: run a batch of inputs, reporting each one to
+ * the parent once it has finished.
+ */
+static void fork_child(char **argv, int first, int last, int status_fd)
+{
+  FORK_STATUS status;
+  int ii;
+
+  for(ii = first; ii < last; ii++) {
+    memset(&status, 0, sizeof(status));
+    status.arg_index = ii;
+    status.rc = run_input(argv, ii, 1, &status.timing);
+
+    /* Make sure the output for this input is out before reporting it. */
+    fflush(stdout);
+    if(write(status_fd, &status, sizeof(status)) != sizeof(status)) {
+      /* The parent has gone away. */
+      break;
+    }
+  }
+
+  /* Run exit handlers so the fuzz target can print its statistics. The
+     status pipe stays open until they have finished, so the parent's
+     timeout covers them too. */
+  exit(0);
+}
+
+/**
+ * Wait for a fork server child to finish its batch. Returns the index of the
+ * first input the child did not finish, which is "last" if it got through the
+ * whole batch. A child that finishes its batch but then fails, for example in
+ * its exit handlers, is counted against the last input of the batch.
+ */
+static int fork_wait(pid_t pid,
+                     char **argv,
+                     int first,
+                     int last,
+                     int status_fd,
+                     int timeout,
+                     FORK_STATS *stats)
+{
+  struct pollfd pfd;
+  FORK_STATUS status;
+  ssize_t got;
+  int next = first;
+  int hung = 0;
+  int wstatus;
+  int rc;
+
+  pfd.fd = status_fd;
+  pfd.events = POLLIN;
+
+  for(;;) {
+    rc = poll(&pfd, 1, timeout > 0 ? timeout * 1000 : -1);
+    if(rc == -1 && errno == EINTR) {
+      continue;
+    }
+    else if(rc == 0) {
+      /* No input finished in time. */
+      kill(pid, SIGKILL);
+      hung = 1;
+      break;
+    }
+
+    got = read(status_fd, &status, sizeof(status));
+    if(got == -1 && errno == EINTR) {
+      continue;
+    }
+    else if(got != sizeof(status)) {
+      /* The child has finished or died. */
+      break;
+    }
+
+    next = status.arg_index + 1;
+    run_timings[status.arg_index] = status.timing;
+    stats->inputs++;
+  }
+
+  while(waitpid(pid, &wstatus, 0) == -1 && errno == EINTR) {
+  }
+
+  if(next < last) {
+    if(hung) {
+      fprintf(stderr,
+              "[%s] Timed out after %d seconds \n",
+              argv[next],
+              timeout);
+      stats->hangs++;
+    }
+    else if(WIFSIGNALED(wstatus)) {
+      fprintf(stderr,
+              "[%s] Crashed with signal %d \n",
+              argv[next],
+              WTERMSIG(wstatus));
+      stats->crashes++;
+    }
+    else {
+      fprintf(stderr,
+              "[%s] Exited with status %d \n",
+              argv[next],
+              WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1);
+      stats->crashes++;
+    }
+  }
+  else if(hung) {
+    fprintf(stderr,
+            "[%s] Timed out %d seconds after its last input \n",
+            argv[last - 1],
+            timeout);
+    stats->hangs++;
+  }
+  else if(WIFSIGNALED(wstatus)) {
+    fprintf(stderr,
+            "[%s] Crashed with signal %d after its last input \n",
+            argv[last - 1],
+            WTERMSIG(wstatus));
+    stats->crashes++;
+  }
+  else if(!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+    /* Such as a leak check failing in the exit handlers. */
+    fprintf(stderr,
+            "[%s] Exited with status %d after its last input \n",
+            argv[last - 1],
+            WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1);
+    stats->crashes++;
+  }
+
+  return next;
+}
+
+/**
+ * Fork server mode. libcurl and anything else the fuzz target sets up in
+ * LLVMFuzzerInitialize has already been initialised, so each child starts
+ * pre-warmed. Each child runs a batch of inputs; if one crashes or hangs, it
+ * is reported and the next child carries on from the input after it.
+ */
+static int fork_server(int argc,
+                       char **argv,
+                       int first,
+                       int batch,
+                       int timeout)
+{
+  FORK_STATS stats;
+  int pipefd[2];
+  int last;
+  pid_t pid;
+
+  memset(&stats, 0, sizeof(stats));
+
+  while(first < argc) {
+    last = first + batch;
+    if(last > argc) {
+      last = argc;
+    }
+
+    if(pipe(pipefd) == -1) {
+      perror("pipe");
+      return 1;
+    }
+
+    /* Don't let the child inherit buffered output. */
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if(pid == -1) {
+      perror("fork");
+      close(pipefd[0]);
+      close(pipefd[1]);
+      return 1;
+    }
+    else if(pid == 0) {
+      close(pipefd[0]);
+      fork_child(argv, first, last, pipefd[1]);
+    }
+
+    close(pipefd[1]);
+    stats.children++;
+
+    first = fork_wait(pid, argv, first, last, pipefd[0], timeout, &stats);
+    close(pipefd[0]);
+
+    if(first < last) {
+      /* Skip the input which failed. */
+      first++;
+    }
+  }
+
+  fprintf(stderr,
+          "Fork server: %lu inputs run in %lu children, "
+          "%lu crashes, %lu hangs\n",
+          stats.inputs,
+          stats.children,
+          stats.crashes,
+          stats.hangs);
+
+  return (stats.crashes > 0 || stats.hangs > 0) ? 1 : 0;
+}
+
+/**
+ * Body of a replay worker thread: keep taking inputs from the shared queue
+ * until there are none left.
+ */
+static void *replay_thread(void *arg)
+{
+  REPLAY_WORKER *worker = (REPLAY_WORKER *)arg;
+  struct timespec start;
+  struct timespec cpu_start;
+  cpu_set_t cpus;
+  int arg_index;
+
+  if(worker->cpu >= 0) {
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  clock_gettime(RUN_CLOCK, &start);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+
+  for(;;) {
+    arg_index = __atomic_fetch_add(&replay_queue.next_arg,
+                                   1,
+                                   __ATOMIC_RELAXED);
+    if(arg_index >= replay_queue.end_arg) {
+      break;
+    }
+
+    run_input(replay_queue.argv, arg_index, 0, &run_timings[arg_index]);
+    worker->inputs++;
+    worker->bytes += run_timings[arg_index].bytes;
+  }
+
+  worker->busy_seconds = ns_since(RUN_CLOCK, &start) / 1e9;
+  worker->cpu_seconds = ns_since(CLOCK_THREAD_CPUTIME_ID, &cpu_start) / 1e9;
+
+  return NULL;
+}
+
+/**
+ * Replay inputs in-process on several threads at once. With pinning, thread
+ * N runs on the Nth CPU the process is allowed to use.
+ */
+static int replay_threaded(int argc,
+                           char **argv,
+                           int first,
+                           int num_threads,
+                           int pin)
+{
+  REPLAY_WORKER *workers;
+  cpu_set_t allowed;
+  int cpu_list[CPU_SETSIZE];
+  int num_cpus = 0;
+  int ii;
+  int rc = 0;
+
+  workers = (REPLAY_WORKER *)calloc(num_threads, sizeof(REPLAY_WORKER));
+  if(workers == NULL) {
+    fprintf(stderr, "Failed to allocate %d workers \n", num_threads);
+    return 1;
+  }
+
+  if(pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for(ii = 0; ii < CPU_SETSIZE; ii++) {
+      if(CPU_ISSET(ii, &allowed)) {
+        cpu_list[num_cpus++] = ii;
+      }
+    }
+  }
+
+  replay_queue.argv = argv;
+  replay_queue.next_arg = first;
+  replay_queue.end_arg = argc;
+
+  for(ii = 0; ii < num_threads; ii++) {
+    workers[ii].id = ii;
+    workers[ii].cpu = (num_cpus > 0) ? cpu_list[ii % num_cpus] : -1;
+
+    if(pthread_create(&workers[ii].thread,
+                      NULL,
+                      replay_thread,
+                      &workers[ii]) != 0) {
+      fprintf(stderr, "Failed to start thread %d \n", ii);
+      num_threads = ii;
+      rc = 1;
+      break;
+    }
+  }
+
+  for(ii = 0; ii < num_threads; ii++) {
+    pthread_join(workers[ii].thread, NULL);
+  }
+
+  /* Make sure every input has been printed before the statistics. */
+  fflush(stdout);
+
+  for(ii = 0; ii < num_threads; ii++) {
+    fprintf(stderr,
+            "Thread %d%s: %lu inputs, %llu bytes, %.3fs busy, %.3fs CPU\n",
+            workers[ii].id,
+            workers[ii].cpu >= 0 ? " (pinned)" : "",
+            workers[ii].inputs,
+            workers[ii].bytes,
+            workers[ii].busy_seconds,
+            workers[ii].cpu_seconds);
+  }
+
+  free(workers);
+
+  return rc;
+}
+
+/**
+ * Sort argv indexes by wall time, slowest first.
+ */
+static int compare_wall_desc(const void *a, const void *b)
+{
+  uint64_t wall_a = run_timings[*(const int *)a].wall_ns;
+  uint64_t wall_b = run_timings[*(const int *)b].wall_ns;
+
+  return (wall_a < wall_b) - (wall_a > wall_b);
+}
+
+/**
+ * Wall time of the input at a percentile, from indexes sorted slowest first.
+ */
+static uint64_t percentile_ns(const int *sorted, int count, int percent)
+{
+  int rank = (int)(((long long)count * percent + 99) / 100);
+
+  if(rank < 1) {
+    rank = 1;
+  }
+
+  /* The Nth fastest input is count - N from the start. */
+  return run_timings[sorted[count - rank]].wall_ns;
+}
+
+/**
+ * Histogram bucket for a wall time. Buckets double in size, starting with
+ * everything under a microsecond.
+ */
+static int histogram_bucket(uint64_t wall_ns)
+{
+  int bucket = 0;
+
+  for(wall_ns /= 1000; wall_ns > 0; wall_ns >>= 1) {
+    bucket++;
+  }
+
+  return bucket;
+}
+
+/**
+ * Write a string as a JSON string literal.
+ */
+static void json_string(FILE *out, const char *str)
+{
+  fputc('"', out);
+  for(; *str != '\0'; str++) {
+    if(*str == '"' || *str == '\\') {
+      fprintf(out, "\\%c", *str);
+    }
+    else if((unsigned char)*str < 0x20) {
+      fprintf(out, "\\u%04x", (unsigned char)*str);
+    }
+    else {
+      fputc(*str, out);
+    }
+  }
+  fputc('"', out);
+}
+
+/**
+ * Body of a supervisor worker process: run each input the supervisor sends,
+ * reporting back once it has finished.
+ */
+static void supervisor_child(char **argv, int cmd_fd, int status_fd)
+{
+  FORK_STATUS status;
+  int32_t arg_index;
+
+  while(read(cmd_fd, &arg_index, sizeof(arg_index)) == sizeof(arg_index)) {
+    memset(&status, 0, sizeof(status));
+    status.arg_index = arg_index;
+    status.rc = run_input(argv, arg_index, 0, &status.timing);
+
+    /* Make sure the output for this input is out before reporting it. */
+    fflush(stdout);
+    if(write(status_fd, &status, sizeof(status)) != sizeof(status)) {
+      break;
+    }
+  }
+
+  /* The supervisor has no more inputs; run exit handlers so the fuzz target
+     can print its statistics. */
+  exit(0);
+}
+
+/**
+ * Start a supervisor worker process. Returns 0 on success.
+ */
+static int supervisor_start(SUPERVISOR *sup, SUPERVISOR_WORKER *worker,
+                            char **argv)
+{
+  int cmd_pipe[2];
+  int status_pipe[2];
+  int ii;
+
+  if(pipe(cmd_pipe) == -1) {
+    perror("pipe");
+    return 1;
+  }
+
+  if(pipe(status_pipe) == -1) {
+    perror("pipe");
+    close(cmd_pipe[0]);
+    close(cmd_pipe[1]);
+    return 1;
+  }
+
+  /* Don't let the child inherit buffered output. */
+  fflush(stdout);
+  fflush(stderr);
+
+  worker->pid = fork();
+  if(worker->pid == -1) {
+    perror("fork");
+    close(cmd_pipe[0]);
+    close(cmd_pipe[1]);
+    close(status_pipe[0]);
+    close(status_pipe[1]);
+    return 1;
+  }
+  else if(worker->pid == 0) {
+    /* The child mustn't hold other workers' pipes open. */
+    for(ii = 0; ii < sup->num_workers; ii++) {
+      if(&sup->workers[ii] != worker && sup->workers[ii].pid > 0) {
+        close(sup->workers[ii].cmd_fd);
+        close(sup->workers[ii].status_fd);
+      }
+    }
+    close(cmd_pipe[1]);
+    close(status_pipe[0]);
+    supervisor_child(argv, cmd_pipe[0], status_pipe[1]);
+  }
+
+  close(cmd_pipe[0]);
+  close(status_pipe[1]);
+  worker->cmd_fd = cmd_pipe[1];
+  worker->status_fd = status_pipe[0];
+  worker->arg_index = -1;
+  sup->workers_started++;
+
+  return 0;
+}
+
+/**
+ * Reap a worker process that has died or been killed, returning its wait
+ * status.
+ */
+static int supervisor_reap(SUPERVISOR_WORKER *worker)
+{
+  int wstatus = 0;
+
+  close(worker->cmd_fd);
+  close(worker->status_fd);
+
+  while(waitpid(worker->pid, &wstatus, 0) == -1 && errno == EINTR) {
+  }
+
+  worker->pid = 0;
+
+  return wstatus;
+}
+
+/**
+ * Reap a worker process that wasn't running an input, counting it as failed
+ * unless it exited successfully.
+ */
+static void supervisor_retire(SUPERVISOR *sup, SUPERVISOR_WORKER *worker)
+{
+  pid_t pid = worker->pid;
+  int wstatus = supervisor_reap(worker);
+
+  if(WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0) {
+    return;
+  }
+
+  if(WIFSIGNALED(wstatus)) {
+    fprintf(stderr,
+            "Worker %d killed by signal %d between inputs \n",
+            (int)pid,
+            WTERMSIG(wstatus));
+  }
+  else {
+    fprintf(stderr,
+            "Worker %d exited with status %d between inputs \n",
+            (int)pid,
+            WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1);
+  }
+
+  sup->failed_workers++;
+}
+
+/**
+ * Copy a quarantined input into a subdirectory of the quarantine directory
+ * named after the reason.
+ */
+static void supervisor_quarantine(SUPERVISOR *sup,
+                                  char **argv,
+                                  int arg_index,
+                                  QUARANTINE_REASON reason)
+{
+  static const char *const subdirs[] = { "", "crash", "hang", "slow" };
+  const char *path = argv[arg_index];
+  const char *name = strrchr(path, '/');
+  char dest[4096];
+  char buf[65536];
+  ssize_t got;
+  int in_fd = -1;
+  int out_fd;
+
+  if(sup->quarantine_dir == NULL) {
+    return;
+  }
+
+  snprintf(dest, sizeof(dest), "%s/%s", sup->quarantine_dir, subdirs[reason]);
+  mkdir(sup->quarantine_dir, 0777);
+  mkdir(dest, 0777);
+
+  snprintf(dest,
+           sizeof(dest),
+           "%s/%s/%s",
+           sup->quarantine_dir,
+           subdirs[reason],
+           name ? name + 1 : path);
+
+  if(packed_inputs == NULL || packed_inputs[arg_index].data == NULL) {
+    in_fd = open(path, O_RDONLY);
+    if(in_fd == -1) {
+      return;
+    }
+  }
+
+  out_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(out_fd == -1) {
+    fprintf(stderr, "[%s] Failed to open for writing. \n", dest);
+  }
+  else if(in_fd == -1) {
+    /* Packed inputs are written straight from the mapping. */
+    got = packed_inputs[arg_index].len;
+    if(write(out_fd, packed_inputs[arg_index].data, got) != got) {
+      fprintf(stderr, "[%s] Failed to write. \n", dest);
+    }
+  }
+  else {
+    while((got = read(in_fd, buf, sizeof(buf))) > 0) {
+      if(write(out_fd, buf, got) != got) {
+        fprintf(stderr, "[%s] Failed to write. \n", dest);
+        break;
+      }
+    }
+  }
+
+  if(out_fd != -1) {
+    close(out_fd);
+  }
+  if(in_fd != -1) {
+    close(in_fd);
+  }
+}
+
+/**
+ * Handle a worker that died or was killed while running an input: report
+ * and quarantine the input, then start a new worker in its place.
+ */
+static int supervisor_lost(SUPERVISOR *sup,
+                           SUPERVISOR_WORKER *worker,
+                           char **argv,
+                           int hung)
+{
+  int arg_index = worker->arg_index;
+  int wstatus = supervisor_reap(worker);
+
+  if(arg_index >= 0) {
+    if(hung) {
+      fprintf(stderr,
+              "[%s] Timed out after %d seconds \n",
+              argv[arg_index],
+              sup->timeout);
+      sup->reasons[arg_index] = QUARANTINE_HANG;
+      sup->hangs++;
+    }
+    else {
+      if(WIFSIGNALED(wstatus)) {
+        fprintf(stderr,
+                "[%s] Crashed with signal %d \n",
+                argv[arg_index],
+                WTERMSIG(wstatus));
+        sup->statuses[arg_index] = -WTERMSIG(wstatus);
+      }
+      else {
+        fprintf(stderr,
+                "[%s] Exited with status %d \n",
+                argv[arg_index],
+                WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1);
+        sup->statuses[arg_index] =
+          WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+      }
+      sup->reasons[arg_index] = QUARANTINE_CRASH;
+      sup->crashes++;
+    }
+
+    supervisor_quarantine(sup, argv, arg_index, sup->reasons[arg_index]);
+  }
+
+  return supervisor_start(sup, worker, argv);
+}
+
+/**
+ * Handle a status report from a worker that finished its input.
+ */
+static void supervisor_finished(SUPERVISOR *sup,
+                                SUPERVISOR_WORKER *worker,
+                                char **argv,
+                                const FORK_STATUS *status)
+{
+  run_timings[status->arg_index] = status->timing;
+  sup->inputs++;
+  worker->arg_index = -1;
+
+  if(sup->slow_ms > 0 &&
+     status->timing.wall_ns > (uint64_t)sup->slow_ms * 1000000) {
+    fprintf(stderr,
+            "[%s] Slow: took %.1fms \n",
+            argv[status->arg_index],
+            status->timing.wall_ns / 1e6);
+    sup->reasons[status->arg_index] = QUARANTINE_SLOW;
+    sup->slow++;
+    supervisor_quarantine(sup, argv, status->arg_index, QUARANTINE_SLOW);
+  }
+}
+
+/**
+ * Write the supervisor summary as JSON.
+ */
+static void supervisor_summary(SUPERVISOR *sup,
+                               int argc,
+                               char **argv,
+                               int first,
+                               uint64_t total_ns,
+                               const char *path)
+{
+  static const char *const lists[] = { "", "crashes", "hangs", "slow" };
+  FILE *out;
+  int reason;
+  int count;
+  int ii;
+
+  out = fopen(path, "w");
+  if(out == NULL) {
+    fprintf(stderr, "[%s] Failed to open for writing. \n", path);
+    return;
+  }
+
+  fprintf(out,
+          "{\n  \"inputs\": %d,\n  \"inputs_finished\": %lu,\n"
+          "  \"workers\": %d,\n  \"workers_started\": %lu,\n"
+          "  \"wall_seconds\": %.6f,\n  \"timeout_seconds\": %d,\n"
+          "  \"slow_ms\": %d,\n  \"failed_workers\": %lu",
+          argc - first,
+          sup->inputs,
+          sup->num_workers,
+          sup->workers_started,
+          total_ns / 1e9,
+          sup->timeout,
+          sup->slow_ms,
+          sup->failed_workers);
+
+  for(reason = QUARANTINE_CRASH; reason <= QUARANTINE_SLOW; reason++) {
+    fprintf(out, ",\n  \"%s\": [", lists[reason]);
+    count = 0;
+
+    for(ii = first; ii < argc; ii++) {
+      if(sup->reasons[ii] != reason) {
+        continue;
+      }
+
+      fprintf(out, "%s\n    {\"path\": ", count++ ? "," : "");
+      json_string(out, argv[ii]);
+      if(reason == QUARANTINE_CRASH) {
+        fprintf(out, ", \"status\": %d}", sup->statuses[ii]);
+      }
+      else if(reason == QUARANTINE_SLOW) {
+        fprintf(out, ", \"wall_us\": %.1f}", run_timings[ii].wall_ns / 1e3);
+      }
+      else {
+        fprintf(out, "}");
+      }
+    }
+
+    fprintf(out, "%s]", count ? "\n  " : "");
+  }
+
+  fprintf(out, "\n}\n");
+  fclose(out);
+}
+
+/**
+ * Supervisor mode. Inputs are handed out one at a time to a pool of worker
+ * processes forked after LLVMFuzzerInitialize, so a quick worker simply takes
+ * more inputs. A worker that crashes or runs an input for too long is
+ * replaced, and the input is quarantined along with any that are slow.
+ */
+static int supervisor_run(SUPERVISOR *sup,
+                          int argc,
+                          char **argv,
+                          int first)
+{
+  struct pollfd *pfds;
+  FORK_STATUS status;
+  SUPERVISOR_WORKER *worker;
+  int next_arg = first;
+  int busy;
+  int wait_ms;
+  int32_t arg_index;
+  int64_t left_ms;
+  ssize_t got;
+  int rc = 0;
+  int ii;
+
+  sup->workers = (SUPERVISOR_WORKER *)calloc(sup->num_workers,
+                                             sizeof(SUPERVISOR_WORKER));
+  sup->reasons = (QUARANTINE_REASON *)calloc(argc,
+                                             sizeof(QUARANTINE_REASON));
+  sup->statuses = (int *)calloc(argc, sizeof(int));
+  pfds = (struct pollfd *)calloc(sup->num_workers, sizeof(struct pollfd));
+  if(sup->workers == NULL || sup->reasons == NULL ||
+     sup->statuses == NULL || pfds == NULL) {
+    fprintf(stderr, "Failed to allocate %d workers \n", sup->num_workers);
+    rc = 1;
+    goto EXIT_LABEL;
+  }
+
+  /* A worker that dies mid-write mustn't take the supervisor with it. */
+  signal(SIGPIPE, SIG_IGN);
+
+  for(ii = 0; ii < sup->num_workers; ii++) {
+    if(supervisor_start(sup, &sup->workers[ii], argv) != 0) {
+      rc = 1;
+      goto EXIT_LABEL;
+    }
+  }
+
+  for(;;) {
+    /* Give every idle worker its next input. */
+    busy = 0;
+    wait_ms = -1;
+
+    for(ii = 0; ii < sup->num_workers; ii++) {
+      worker = &sup->workers[ii];
+
+      if(worker->arg_index < 0 && next_arg < argc) {
+        arg_index = next_arg;
+        if(write(worker->cmd_fd, &arg_index, sizeof(arg_index)) !=
+           sizeof(arg_index)) {
+          /* The worker died between inputs; start another. */
+          supervisor_retire(sup, worker);
+          if(supervisor_start(sup, worker, argv) != 0) {
+            rc = 1;
+            goto EXIT_LABEL;
+          }
+          ii--;
+          continue;
+        }
+        worker->arg_index = next_arg++;
+        clock_gettime(RUN_CLOCK, &worker->started);
+      }
+
+      pfds[ii].fd = worker->status_fd;
+      pfds[ii].events = POLLIN;
+      pfds[ii].revents = 0;
+
+      if(worker->arg_index >= 0) {
+        busy++;
+
+        if(sup->timeout > 0) {
+          left_ms = (int64_t)sup->timeout * 1000 -
+                    (int64_t)(ns_since(RUN_CLOCK, &worker->started) /
+                              1000000);
+          if(left_ms < 0) {
+            left_ms = 0;
+          }
+          if(wait_ms < 0 || left_ms < wait_ms) {
+            wait_ms = (int)left_ms;
+          }
+        }
+      }
+    }
+
+    if(busy == 0) {
+      break;
+    }
+
+    if(poll(pfds, sup->num_workers, wait_ms) == -1 && errno != EINTR) {
+      perror("poll");
+      rc = 1;
+      goto EXIT_LABEL;
+    }
+
+    for(ii = 0; ii < sup->num_workers; ii++) {
+      worker = &sup->workers[ii];
+
+      if(worker->arg_index < 0) {
+        continue;
+      }
+
+      if(pfds[ii].revents != 0) {
+        got = read(worker->status_fd, &status, sizeof(status));
+        if(got == sizeof(status)) {
+          supervisor_finished(sup, worker, argv, &status);
+          continue;
+        }
+        else if(got == -1 && errno == EINTR) {
+          continue;
+        }
+
+        /* The worker has died. */
+        if(supervisor_lost(sup, worker, argv, 0) != 0) {
+          rc = 1;
+          goto EXIT_LABEL;
+        }
+      }
+      else if(sup->timeout > 0 &&
+              ns_since(RUN_CLOCK, &worker->started) >=
+                (uint64_t)sup->timeout * 1000000000) {
+        kill(worker->pid, SIGKILL);
+        if(supervisor_lost(sup, worker, argv, 1) != 0) {
+          rc = 1;
+          goto EXIT_LABEL;
+        }
+      }
+    }
+  }
+
+EXIT_LABEL:
+
+  /* Closing the command pipes tells the workers to exit. */
+  for(ii = 0; sup->workers != NULL && ii < sup->num_workers; ii++) {
+    if(sup->workers[ii].pid > 0) {
+      supervisor_retire(sup, &sup->workers[ii]);
+    }
+  }
+
+  fprintf(stderr,
+          "Supervisor: %lu inputs run by %lu workers, "
+          "%lu crashes, %lu hangs, %lu slow, %lu failed workers\n",
+          sup->inputs,
+          sup->workers_started,
+          sup->crashes,
+          sup->hangs,
+          sup->slow,
+          sup->failed_workers);
+
+  free(pfds);
+  free(sup->workers);
+  sup->workers = NULL;
+
+  if(rc == 0 &&
+     (sup->crashes > 0 || sup->hangs > 0 || sup->failed_workers > 0)) {
+    rc = 1;
+  }
+
+  return rc;
+}
+
+/**
+ * Print the timing report: exec/s, a latency histogram with percentiles and
+ * the slowest inputs. If json_path is set, the same figures are written to
+ * that file as JSON.
+ */
+static void timing_report(int argc,
+                          char **argv,
+                          int first,
+                          uint64_t total_ns,
+                          int num_slowest,
+                          const char *json_path)
+{
+  int histogram[65];
+  int *sorted;
+  int count = 0;
+  int min_bucket = 64;
+  int max_bucket = 0;
+  int bucket;
+  int max_count = 0;
+  uint64_t cpu_ns = 0;
+  uint64_t wall_ns = 0;
+  double mean_us;
+  double total_seconds = total_ns / 1e9;
+  double exec_per_sec;
+  uint64_t pct[4];
+  static const int pct_levels[4] = { 50, 90, 99, 100 };
+  FILE *out;
+  int ii;
+
+  sorted = (int *)calloc(argc, sizeof(int));
+  if(sorted == NULL) {
+    return;
+  }
+
+  memset(histogram, 0, sizeof(histogram));
+
+  for(ii = first; ii < argc; ii++) {
+    if(run_timings[ii].ran) {
+      sorted[count++] = ii;
+      cpu_ns += run_timings[ii].cpu_ns;
+      wall_ns += run_timings[ii].wall_ns;
+
+      bucket = histogram_bucket(run_timings[ii].wall_ns);
+      histogram[bucket]++;
+      min_bucket = (bucket < min_bucket) ? bucket : min_bucket;
+      max_bucket = (bucket > max_bucket) ? bucket : max_bucket;
+      max_count = (histogram[bucket] > max_count) ?
+                    histogram[bucket] : max_count;
+    }
+  }
+
+  if(count == 0) {
+    free(sorted);
+    return;
+  }
+
+  qsort(sorted, count, sizeof(int), compare_wall_desc);
+
+  for(ii = 0; ii < 4; ii++) {
+    pct[ii] = percentile_ns(sorted, count, pct_levels[ii]);
+  }
+
+  if(num_slowest > count) {
+    num_slowest = count;
+  }
+
+  exec_per_sec = (total_seconds > 0) ? count / total_seconds : 0.0;
+  mean_us = wall_ns / 1e3 / count;
+
+  fprintf(stderr,
+          "Ran %d inputs in %.3fs (%.1f exec/s), %.3fs CPU in the target\n",
+          count,
+          total_seconds,
+          exec_per_sec,
+          cpu_ns / 1e9);
+  fprintf(stderr,
+          "Latency: mean %.1fus, p50 %.1fus, p90 %.1fus, p99 %.1fus, "
+          "max %.1fus\n",
+          mean_us,
+          pct[0] / 1e3,
+          pct[1] / 1e3,
+          pct[2] / 1e3,
+          pct[3] / 1e3);
+
+  for(bucket = min_bucket; bucket <= max_bucket; bucket++) {
+    fprintf(stderr,
+            "  %9lluus - %9lluus %8d |%.*s\n",
+            bucket ? (1ULL << (bucket - 1)) : 0ULL,
+            1ULL << bucket,
+            histogram[bucket],
+            histogram[bucket] * 40 / max_count,
+            "########################################");
+  }
+
+  if(num_slowest > 0) {
+    fprintf(stderr, "Slowest inputs:\n");
+  }
+  for(ii = 0; ii < num_slowest; ii++) {
+    fprintf(stderr,
+            "  %10.1fus wall %10.1fus CPU  %s\n",
+            run_timings[sorted[ii]].wall_ns / 1e3,
+            run_timings[sorted[ii]].cpu_ns / 1e3,
+            argv[sorted[ii]]);
+  }
+
+  if(json_path != NULL) {
+    out = fopen(json_path, "w");
+    if(out == NULL) {
+      fprintf(stderr, "[%s] Failed to open for writing. \n", json_path);
+    }
+    else {
+      fprintf(out,
+              "{\n  \"inputs\": %d,\n  \"wall_seconds\": %.6f,\n"
+              "  \"exec_per_second\": %.1f,\n  \"cpu_seconds\": %.6f,\n",
+              count,
+              total_seconds,
+              exec_per_sec,
+              cpu_ns / 1e9);
+      fprintf(out,
+              "  \"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, "
+              "\"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f},\n",
+              mean_us,
+              pct[0] / 1e3,
+              pct[1] / 1e3,
+              pct[2] / 1e3,
+              pct[3] / 1e3);
+
+      fprintf(out, "  \"histogram\": [");
+      for(bucket = min_bucket; bucket <= max_bucket; bucket++) {
+        fprintf(out,
+                "%s\n    {\"ge_us\": %llu, \"lt_us\": %llu, \"count\": %d}",
+                (bucket == min_bucket) ? "" : ",",
+                bucket ? (1ULL << (bucket - 1)) : 0ULL,
+                1ULL << bucket,
+                histogram[bucket]);
+      }
+      fprintf(out, "\n  ],\n  \"slowest\": [");
+      for(ii = 0; ii < num_slowest; ii++) {
+        fprintf(out, "%s\n    {\"path\": ", ii ? "," : "");
+        json_string(out, argv[sorted[ii]]);
+        fprintf(out,
+                ", \"bytes\": %llu, \"wall_us\": %.1f, \"cpu_us\": %.1f}",
+                (unsigned long long)run_timings[sorted[ii]].bytes,
+                run_timings[sorted[ii]].wall_ns / 1e3,
+                run_timings[sorted[ii]].cpu_ns / 1e3);
+      }
+      fprintf(out, "\n  ]\n}\n");
+      fclose(out);
+    }
+  }
+
+  free(sorted);
+}
+
+/**
+ * Returns whether an argument is a libFuzzer option such as "-runs=100",
+ * which mustn't be taken for "-r" with the value "uns=100".
+ */
+static int option_is_libfuzzer(const char *arg)
+{
+  size_t len = strspn(&arg[1],
+                      "abcdefghijklmnopqrstuvwxyz"
+                      "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                      "0123456789_");
+
+  return len > 0 && arg[1 + len] == '=';
+}
+
+/**
+ * Get the value of an option given either as "-xVALUE" or "-x VALUE".
+ */
+static const char *option_value(int argc, char **argv, int *index)
+{
+  if(argv[*index][2] != '\0') {
+    return &argv[*index][2];
+  }
+  else if(*index + 1 < argc) {
+    return argv[++*index];
+  }
+
+  return "";
+}
+
 /**
  * Main procedure for standalone fuzzing engine.
  *
  * Reads filenames from the argument array. For each filename, read the file
  * into memory and then call the fuzzing interface with the data.
+ *
+ * Options may come before the filenames:
+ *   -j N     replay the inputs in-process on N threads
+ *   -p       pin each of those threads to its own CPU
+ *   -k N     list the N slowest inputs in the timing report (default 5)
+ *   -o FILE  also write the timing report to FILE as JSON
+ *   -f FILE  write the coverage features each input hits to FILE, one line
+ *            per input; the fuzz target must be built with SanitizerCoverage
+ *   -c FILE  write the coverage features each input hits to FILE in binary,
+ *            along with how many no earlier input hit
+ *   -w N     supervisor mode: run the inputs in N worker processes
+ *   -s MS    quarantine inputs which take longer than MS milliseconds
+ *   -q DIR   copy quarantined inputs into DIR/crash, DIR/hang and DIR/slow
+ *   -r FILE  write a summary of the supervisor run to FILE as JSON
+ *
+ * Values may also be joined to their option, as in -j8. libFuzzer options,
+ * which look like -name=value, are ignored with a warning.
+ *
+ * Filenames ending in .pack are packed corpora, made by pack_corpus.py; each
+ * of their entries is run as if it were a file.
+ *
+ * If FUZZ_FORK_SERVER=<N> is set, inputs are run in forked children, N
+ * inputs per child, so that a crash or hang only loses one input.
+ * FUZZ_FORK_TIMEOUT=<seconds> sets how long an input may run before its
+ * child is killed; 0 waits forever. The fork server runs inputs one at a
+ * time, so -j is ignored. Coverage is collected in-process one input at a
+ * time, so -f and -c turn off the fork server, -j and -w.
+ *
+ * In supervisor mode, inputs are spread over the worker processes one at a
+ * time. FUZZ_FORK_TIMEOUT applies to each input, and inputs which crash,
+ * time out or are slow are quarantined. The exit status is non-zero if any
+ * input crashed or timed out.
  */
 int main(int argc, char **argv)
 {
   int ii;
-  FILE *infile;
-  uint8_t *buffer = NULL;
-  size_t buffer_len;
+  int first = 1;
+  const char *env;
+  int batch = 0;
+  int timeout = FORK_DEFAULT_TIMEOUT;
+  int num_threads = 1;
+  int pin = 0;
+  int num_slowest = REPORT_DEFAULT_SLOWEST;
+  const char *json_path = NULL;
+  const char *features_path = NULL;
+  FILE *features = NULL;
+  const char *coverage_path = NULL;
+  FILE *coverage = NULL;
+  COV_FILE_HEADER cov_header;
+  size_t new_features;
+  int persona;
+  SUPERVISOR sup;
+  const char *summary_path = NULL;
+  struct timespec start;
+  uint64_t total_ns;
+  int rc = 0;
 
-  for(ii = 1; ii < argc; ii++) {
-    printf("[%s] ", argv[ii]);
+  memset(&sup, 0, sizeof(sup));
 
-    /* Try and open the file. */
-    infile = fopen(argv[ii], "rb");
-    if(infile) {
-      printf("Opened.. ");
+  while(first < argc && argv[first][0] == '-') {
+    if(strcmp(argv[first], "--") == 0) {
+      first++;
+      break;
+    }
+    else if(option_is_libfuzzer(argv[first])) {
+      fprintf(stderr, "Ignoring libFuzzer option %s \n", argv[first]);
+    }
+    else if(strncmp(argv[first], "-j", 2) == 0) {
+      num_threads = atoi(option_value(argc, argv, &first));
+    }
+    else if(strcmp(argv[first], "-p") == 0) {
+      pin = 1;
+    }
+    else if(strncmp(argv[first], "-k", 2) == 0) {
+      num_slowest = atoi(option_value(argc, argv, &first));
+    }
+    else if(strncmp(argv[first], "-o", 2) == 0) {
+      json_path = option_value(argc, argv, &first);
+    }
+    else if(strncmp(argv[first], "-f", 2) == 0) {
+      features_path = option_value(argc, argv, &first);
+    }
+    else if(strncmp(argv[first], "-c", 2) == 0) {
+      coverage_path = option_value(argc, argv, &first);
+    }
+    else if(strncmp(argv[first], "-w", 2) == 0) {
+      sup.num_workers = atoi(option_value(argc, argv, &first));
+    }
+    else if(strncmp(argv[first], "-s", 2) == 0) {
+      sup.slow_ms = atoi(option_value(argc, argv, &first));
+    }
+    else if(strncmp(argv[first], "-q", 2) == 0) {
+      sup.quarantine_dir = option_value(argc, argv, &first);
+    }
+    else if(strncmp(argv[first], "-r", 2) == 0) {
+      summary_path = option_value(argc, argv, &first);
+    }
+    else {
+      fprintf(stderr, "Unknown option %s \n", argv[first]);
+      return 1;
+    }
+    first++;
+  }
 
-      /* Get the length of the file. */
-      fseek(infile, 0L, SEEK_END);
-      buffer_len = ftell(infile);
+  if(num_threads < 1) {
+    num_threads = 1;
+  }
 
-      /* Reset the file indicator to the beginning of the file. */
-      fseek(infile, 0L, SEEK_SET);
+  env = getenv("FUZZ_FORK_SERVER");
+  if(env != NULL) {
+    batch = atoi(env);
+    if(batch < 1) {
+      batch = 1;
+    }
+  }
 
-      /* Allocate a buffer for the file contents. */
-      buffer = (uint8_t *)calloc(buffer_len, sizeof(uint8_t));
-      if(buffer) {
-        /* Read all the text from the file into the buffer. */
-        fread(buffer, sizeof(uint8_t), buffer_len, infile);
-        printf("Read %zu bytes, fuzzing.. ", buffer_len);
+  env = getenv("FUZZ_FORK_TIMEOUT");
+  if(env != NULL) {
+    timeout = atoi(env);
+  }
 
-        /* Call the fuzzer with the data. */
-        LLVMFuzzerTestOneInput(buffer, buffer_len);
+  if(features_path != NULL || coverage_path != NULL) {
+    /* Features from trace-pc are addresses, so turn off address space
+       randomisation to keep them the same from one run to the next. */
+    persona = personality(0xffffffff);
+    if(persona != -1 && !(persona & ADDR_NO_RANDOMIZE) &&
+       personality(persona | ADDR_NO_RANDOMIZE) != -1) {
+      execv("/proc/self/exe", argv);
+      /* Carry on with randomised addresses if that failed. */
+    }
 
-        printf("complete !!");
+    if(features_path != NULL) {
+      features = fopen(features_path, "w");
+      if(features == NULL) {
+        fprintf(stderr, "[%s] Failed to open for writing. \n", features_path);
+        return 1;
+      }
+    }
 
-        /* Free the buffer as it's no longer needed. */
-        free(buffer);
-        buffer = NULL;
+    if(coverage_path != NULL) {
+      coverage = fopen(coverage_path, "wb");
+      if(coverage == NULL) {
+        fprintf(stderr, "[%s] Failed to open for writing. \n", coverage_path);
+        return 1;
       }
-      else
-      {
-        fprintf(stderr,
-                "[%s] Failed to allocate %zu bytes \n",
-                argv[ii],
-                buffer_len);
+
+      memset(&cov_header, 0, sizeof(cov_header));
+      memcpy(cov_header.magic, COV_MAGIC, sizeof(cov_header.magic));
+      cov_header.version = COV_VERSION;
+      cov_header.feature_bits = COV_MAP_BITS + 3;
+      fwrite(&cov_header, sizeof(cov_header), 1, coverage);
+    }
+
+    batch = 0;
+    num_threads = 1;
+    pin = 0;
+    sup.num_workers = 0;
+  }
+
+  if(LLVMFuzzerInitialize) {
+    LLVMFuzzerInitialize(&argc, &argv);
+  }
+
+  if(pack_expand(&argc, &argv, first) != 0) {
+    return 1;
+  }
+
+  /* Coverage from setting up the target isn't down to any one input. */
+  cov_reset();
+
+  run_timings = (RUN_TIMING *)calloc(argc, sizeof(RUN_TIMING));
+  if(run_timings == NULL) {
+    fprintf(stderr, "Failed to allocate timings for %d inputs \n", argc);
+    return 1;
+  }
+
+  clock_gettime(RUN_CLOCK, &start);
+
+  if(sup.num_workers > 0) {
+    sup.timeout = timeout;
+    rc = supervisor_run(&sup, argc, argv, first);
+  }
+  else if(batch > 0) {
+    rc = fork_server(argc, argv, first, batch, timeout);
+  }
+  else if(num_threads > 1 || pin) {
+    rc = replay_threaded(argc, argv, first, num_threads, pin);
+  }
+  else {
+    for(ii = first; ii < argc; ii++) {
+      run_input(argv, ii, 1, &run_timings[ii]);
+
+      if((features != NULL || coverage != NULL) && run_timings[ii].ran) {
+        new_features = cov_collect();
+        if(features != NULL) {
+          cov_write_features(features, argv[ii], &run_timings[ii]);
+        }
+        if(coverage != NULL) {
+          cov_write_record(coverage,
+                           argv[ii],
+                           &run_timings[ii],
+                           new_features);
+        }
       }
+    }
+  }
 
-      /* Close the file as it's no longer needed. */
-      fclose(infile);
-      infile = NULL;
+  if(features != NULL || coverage != NULL) {
+    if(features != NULL) {
+      fclose(features);
     }
-    else
-    {
-      /* Failed to open the file. Maybe wrong name or wrong permissions? */
-      fprintf(stderr, "[%s] Open failed. \n", argv[ii]);
+    if(coverage != NULL) {
+      fclose(coverage);
     }
 
-    printf("\n");
+    if(!cov_instrumented) {
+      fprintf(stderr,
+              "No coverage was collected; build the fuzz target with "
+              "-fsanitize-coverage=trace-pc-guard, inline-8bit-counters "
+              "or trace-pc \n");
+      rc = 1;
+    }
+  }
+
+  /* Make sure every input has been printed before the report. */
+  fflush(stdout);
+  total_ns = ns_since(RUN_CLOCK, &start);
+  timing_report(argc, argv, first, total_ns, num_slowest, json_path);
+
+  if(summary_path != NULL && sup.reasons != NULL) {
+    supervisor_summary(&sup, argc, argv, first, total_ns, summary_path);
   }
+
+  free(sup.reasons);
+  free(sup.statuses);
+
+  free(run_timings);
+  run_timings = NULL;
+
+  return rc;
 }
@@ -21,4 +21,6 @@
  ***************************************************************************/
 #include <inttypes.h>
 
-extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
\ No newline at end of file
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+/* Optional one-off initialisation, called before the first test case. */
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv);